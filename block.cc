@@ -1,20 +1,45 @@
 #include <new>
+#include <stdlib.h>
 #include <string.h>
 
 #include "block.h"
 
-Block::Block() : data(0), length(0), lastaccessed(-1), dirty(false)
+// Storage comes from malloc, or posix_memalign if it must be
+// aligned, so that either kind goes back with free
+static BYTE_T *Allocate(const SIZE_T len, const SIZE_T alignment)
+{
+  void *d;
+
+  if (alignment) {
+    if (posix_memalign(&d,alignment,len ? len : 1)) {
+      return 0;
+    }
+  } else {
+    d=malloc(len ? len : 1);
+  }
+  return (BYTE_T*)d;
+}
+
+
+Block::Block() : data(0), length(0), lastaccessed(-1), dirty(false), borrowed(false), alignment(0)
 {}
 
 
-Block::Block(const SIZE_T s) : data(0), length(0), lastaccessed(-1), dirty(false)
+Block::Block(const SIZE_T s) : data(0), length(0), lastaccessed(-1), dirty(false), borrowed(false), alignment(0)
 {
   Resize(s);
 }
 
+Block::Block(const SIZE_T s, const SIZE_T align) : data(0), length(0), lastaccessed(-1), dirty(false), borrowed(false), alignment(align)
+{
+  if (Resize(s)!=ERROR_NOERROR) { 
+    throw GenericException();
+  }
+}
+
 
 
-Block::Block(const Block &rhs) : data(0), length(0), lastaccessed(rhs.lastaccessed), dirty(rhs.dirty)
+Block::Block(const Block &rhs) : data(0), length(0), lastaccessed(rhs.lastaccessed), dirty(rhs.dirty), borrowed(false), alignment(rhs.alignment)
 {
   if (Resize(rhs.length)!=ERROR_NOERROR) { 
     throw GenericException();
@@ -22,7 +47,7 @@ Block::Block(const Block &rhs) : data(0), length(0), lastaccessed(rhs.lastaccess
   memcpy(data,rhs.data,rhs.length);
 }
 
-Block::Block(const char * str) : data(0), length(0), lastaccessed(-1), dirty(false)
+Block::Block(const char * str) : data(0), length(0), lastaccessed(-1), dirty(false), borrowed(false), alignment(0)
 {
   if (Resize(strlen(str))!=ERROR_NOERROR) { 
     throw GenericException();
@@ -32,29 +57,66 @@ Block::Block(const char * str) : data(0), length(0), lastaccessed(-1), dirty(fal
 
 Block::~Block() 
 { 
-  if (data) { delete [] data; data=0; }
+  if (data && !borrowed) { free(data); }
+  data=0;
   length=0;
   lastaccessed=-1;
   dirty=false;
 }
 
+// Reuses the existing storage when the sizes match, which keeps
+// the data where it is (the buffer cache relies on this for pinned
+// blocks) and avoids an allocation
 Block & Block::operator=(const Block &rhs)
 {
-  return *(new (this) Block(rhs));
+  if (this==&rhs) {
+    return *this;
+  }
+  if (length!=rhs.length || !data) {
+    if (Resize(rhs.length,false)!=ERROR_NOERROR) { 
+      throw GenericException();
+    }
+  }
+  memcpy(data,rhs.data,rhs.length);
+  lastaccessed=rhs.lastaccessed;
+  dirty=rhs.dirty;
+  return *this;
 }
 
 
 #define MIN(x,y) ((x)<(y) ? (x) : (y))
 
 
+void Block::Borrow(BYTE_T *storage, const SIZE_T len)
+{
+  if (data && !borrowed) { free(data); }
+  data=storage;
+  length=len;
+  borrowed=true;
+}
+
+
+ERROR_T Block::Align(const SIZE_T align)
+{
+  if (!align || (data && !borrowed && ((unsigned long)data)%align==0)) {
+    if (align) {
+      alignment=align;
+    }
+    return ERROR_NOERROR;
+  }
+  alignment=align;
+  if (!data) {
+    return ERROR_NOERROR;
+  }
+  return Resize(length);
+}
+
+
 ERROR_T Block::Resize(const SIZE_T newlen, const bool copy)
 {
-  BYTE_T *d;
+  BYTE_T *d = Allocate(newlen,alignment);
   
-  try {
-    d = new BYTE_T [newlen];
-  }
-  catch (...) {
+  if (!d) {
     return ERROR_NOMEM;
   }
 
@@ -62,8 +124,9 @@ ERROR_T Block::Resize(const SIZE_T newlen, const bool copy)
     memcpy(d,data,MIN(newlen,length));
   }
   
-  if (data) { delete [] data; }
+  if (data && !borrowed) { free(data); }
   data = d;
+  borrowed = false;
 
   length=newlen;
 
@@ -86,17 +149,18 @@ static char low2hex(BYTE_T x)
 
 
 
-#define MAX(x,y) ((x)>(y) ? (x) : (y))
-
+// A block that is a prefix of another sorts first
 bool Block::operator<(const Block &rhs) const
 {
-  return memcmp(data,rhs.data,MAX(length,rhs.length))<0;
+  int c=memcmp(data,rhs.data,MIN(length,rhs.length));
+
+  return c<0 || (c==0 && length<rhs.length);
 }
 
 
 bool Block::operator==(const Block &rhs) const
 {
-  return memcmp(data,rhs.data,MAX(length,rhs.length))==0;
+  return length==rhs.length && memcmp(data,rhs.data,length)==0;
 }
 
 ostream & Block::Print(ostream &os) const
@@ -12,9 +12,12 @@ struct Block {
   SIZE_T 	length;
   double        lastaccessed;  // for use in buffercache only
   bool          dirty;         // for use in buffercahce only
+  bool          borrowed;      // data belongs to someone else
+  SIZE_T        alignment;     // of data, or 0 if it needn't be aligned
 
   Block();
   Block(const SIZE_T size);
+  Block(const SIZE_T size, const SIZE_T alignment);
   Block(const Block &rhs);
   Block(const char *data);
   virtual ~Block();
@@ -24,6 +27,20 @@ struct Block {
   // ERROR_NOMEM or other nonzero error code.
   ERROR_T Resize(const SIZE_T newlength, const bool copy=true);
 
+  // Use storage that belongs to someone else (a mapped disk, say)
+  // instead of our own.  Assignments to the block then write
+  // straight into it.  Copies of the block get storage of their own,
+  // and so does the block itself the next time it is resized.
+  void Borrow(BYTE_T *storage, const SIZE_T length);
+  bool IsBorrowed() const { return borrowed; }
+
+  // Keep data aligned to the given power of two (direct I/O wants
+  // this) from now on, moving the contents if they aren't already.
+  // Zero means any alignment will do.  Copies of the block are
+  // aligned the same way.
+  // returns ERROR_NOERROR or ERROR_NOMEM
+  ERROR_T Align(const SIZE_T alignment);
+
   bool operator<(const Block &rhs) const;
   bool operator==(const Block &rhs) const;
 
@@ -1,4 +1,7 @@
 #include <assert.h>
+#include <sched.h>
+#include <string.h>
+#include <algorithm>
 #include "btree.h"
 
 KeyValuePair::KeyValuePair()
@@ -27,17 +30,32 @@ KeyValuePair & KeyValuePair::operator=(const KeyValuePair &rhs)
 BTreeIndex::BTreeIndex(SIZE_T keysize,
 		       SIZE_T valuesize,
 		       BufferCache *cache,
-		       bool unique)
+		       bool unique,
+		       int keytype)
 {
+  superblock.info.keytype=keytype;
   superblock.info.keysize=keysize;
   superblock.info.valuesize=valuesize;
   buffercache=cache;
+  superblockdirty=false;
+  hotlevels=BTREE_HOT_LEVELS;
+  latchchunks=0;
+  numlatchchunks=0;
+  pthread_mutex_init(&superlock,0);
+  pthread_mutex_init(&smolock,0);
+  pthread_mutex_init(&hotlock,0);
   // note: ignoring unique now
 }
 
 BTreeIndex::BTreeIndex()
 {
-  // shouldn't have to do anything
+  superblockdirty=false;
+  hotlevels=BTREE_HOT_LEVELS;
+  latchchunks=0;
+  numlatchchunks=0;
+  pthread_mutex_init(&superlock,0);
+  pthread_mutex_init(&smolock,0);
+  pthread_mutex_init(&hotlock,0);
 }
 
 
@@ -49,37 +67,70 @@ BTreeIndex::BTreeIndex(const BTreeIndex &rhs)
   buffercache=rhs.buffercache;
   superblock_index=rhs.superblock_index;
   superblock=rhs.superblock;
+  superblockdirty=rhs.superblockdirty;
+  hotlevels=rhs.hotlevels;
+  latchchunks=0;
+  numlatchchunks=0;
+  pthread_mutex_init(&superlock,0);
+  pthread_mutex_init(&smolock,0);
+  pthread_mutex_init(&hotlock,0);
+  if (rhs.latchchunks) {
+    GrowLatches(superblock.info.highwater);
+  }
 }
 
 BTreeIndex::~BTreeIndex()
 {
-  // shouldn't have to do anything
+  DropHot();
+  FreeLatches();
+  pthread_mutex_destroy(&hotlock);
+  pthread_mutex_destroy(&smolock);
+  pthread_mutex_destroy(&superlock);
 }
 
 
 BTreeIndex & BTreeIndex::operator=(const BTreeIndex &rhs)
 {
-  return *(new(this)BTreeIndex(rhs));
+  if (this!=&rhs) {
+    this->~BTreeIndex();
+    new(this)BTreeIndex(rhs);
+  }
+  return *this;
 }
 
 
+//
+// Blocks at and above the high water mark have never been handed
+// out, so they are free without being on the free list.  The free
+// list only holds blocks that were given back by DeallocateNode,
+// and those are reused first.
+//
 ERROR_T BTreeIndex::AllocateNode(SIZE_T &n)
 {
+  MutexHolder l(&superlock);
+
   n=superblock.info.freelist;
 
-  if (n==0) {
-    return ERROR_NOSPACE;
-  }
+  if (n!=0) {
+    BTreeNode node;
 
-  BTreeNode node;
+    node.Unserialize(buffercache,n);
 
-  node.Unserialize(buffercache,n);
+    assert(node.info.nodetype==BTREE_UNALLOCATED_BLOCK);
 
-  assert(node.info.nodetype==BTREE_UNALLOCATED_BLOCK);
+    superblock.info.freelist=node.info.freelist;
+  } else {
+    n=superblock.info.highwater;
+
+    if (n>=buffercache->GetNumBlocks()) {
+      return ERROR_NOSPACE;
+    }
 
-  superblock.info.freelist=node.info.freelist;
+    superblock.info.highwater++;
+    GrowLatches(superblock.info.highwater);
+  }
 
-  superblock.Serialize(buffercache,superblock_index);
+  superblockdirty=true;
 
   buffercache->NotifyAllocateBlock(n);
 
@@ -95,15 +146,27 @@ ERROR_T BTreeIndex::DeallocateNode(const SIZE_T &n)
 
   assert(node.info.nodetype!=BTREE_UNALLOCATED_BLOCK);
 
-  node.info.nodetype=BTREE_UNALLOCATED_BLOCK;
+  return FreeNode(n);
+}
+
+
+// Put block n on the free list, whatever is in it now
+ERROR_T BTreeIndex::FreeNode(const SIZE_T &n)
+{
+  MutexHolder l(&superlock);
+  BTreeNode node(BTREE_UNALLOCATED_BLOCK,
+		 superblock.info.keysize,
+		 superblock.info.valuesize,
+		 superblock.info.blocksize,
+		 superblock.info.keytype);
 
   node.info.freelist=superblock.info.freelist;
 
-  node.Serialize(buffercache,n);
+  WriteNode(node,n);
 
   superblock.info.freelist=n;
 
-  superblock.Serialize(buffercache,superblock_index);
+  superblockdirty=true;
 
   buffercache->NotifyDeallocateBlock(n);
 
@@ -111,6 +174,305 @@ ERROR_T BTreeIndex::DeallocateNode(const SIZE_T &n)
 
 }
 
+
+VERSION_T BTreeIndex::ReadLatch(const SIZE_T n) const
+{
+  VERSION_T v;
+
+  while ((v=LatchOf(n).version.load(memory_order_acquire)) & 1) {
+    sched_yield();
+  }
+  return v;
+}
+
+
+bool BTreeIndex::CheckLatch(const SIZE_T n, const VERSION_T version) const
+{
+  // what was read before this stays before it
+  atomic_thread_fence(memory_order_acquire);
+  return LatchOf(n).version.load(memory_order_relaxed)==version;
+}
+
+
+bool BTreeIndex::TryLatch(const SIZE_T n, const VERSION_T version) const
+{
+  VERSION_T v=version;
+
+  return LatchOf(n).version.compare_exchange_strong(v,version+1);
+}
+
+
+void BTreeIndex::Unlatch(const SIZE_T n) const
+{
+  LatchOf(n).version.fetch_add(1);
+}
+
+
+void BTreeIndex::Latch(const SIZE_T n)
+{
+  if (find(smolatched.begin(),smolatched.end(),n)!=smolatched.end()) {
+    return;
+  }
+  while (!TryLatch(n,ReadLatch(n))) {
+  }
+  smolatched.push_back(n);
+}
+
+
+void BTreeIndex::UnlatchAll()
+{
+  for (SIZE_T i=0;i<smolatched.size();i++) {
+    Unlatch(smolatched[i]);
+  }
+  smolatched.clear();
+}
+
+
+ERROR_T BTreeIndex::ReadNode(const SIZE_T n, BTreeNode &b,
+			     VERSION_T &version) const
+{
+  BTreeNode *h;
+  ERROR_T rc;
+
+  if (n>=numlatchchunks*BTREE_LATCH_CHUNK ||
+      !latchchunks[n/BTREE_LATCH_CHUNK].load(memory_order_acquire)) {
+    return ERROR_NOSUCHBLOCK;
+  }
+
+  do {
+    version=ReadLatch(n);
+    h=LatchOf(n).hot.load(memory_order_acquire);
+    if (h) {
+      b=*h;
+    } else {
+      // a copy rather than a pin, since a writer may change the
+      // cached block while we look at it
+      rc=b.Unserialize(buffercache,n);
+      if (rc) { return rc; }
+    }
+  } while (!CheckLatch(n,version));
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::WriteNode(const BTreeNode &b, const SIZE_T n, const SIZE_T depth)
+{
+  BTreeNode *h=LatchOf(n).hot.load(memory_order_relaxed);
+  bool interior=b.info.nodetype==BTREE_ROOT_NODE || b.info.nodetype==BTREE_INTERIOR_NODE;
+
+  if (h) {
+    if (interior) {
+      // Over the top of the old one, which a reader may be copying,
+      // so its storage has to stay where it is
+      h->info=b.info;
+      memcpy(h->data,b.data,b.info.GetNumDataBytes());
+    } else {
+      // freed, or now a leaf
+      DropHotNode(n);
+    }
+  } else if (interior && depth<hotlevels) {
+    AddHotNode(b,n,depth);
+  }
+  return b.Serialize(buffercache,n);
+}
+
+
+void BTreeIndex::AddHotNode(const BTreeNode &b, const SIZE_T n, const SIZE_T depth)
+{
+  BTreeNode *h;
+
+  pthread_mutex_lock(&hotlock);
+  if (hotspare.size()>0) {
+    h=hotspare.back();
+    hotspare.pop_back();
+    h->info=b.info;
+    memcpy(h->data,b.data,b.info.GetNumDataBytes());
+  } else {
+    h=new BTreeNode(b);
+  }
+  hotblocks.push_back(n);
+  hotdepths.push_back(depth);
+  pthread_mutex_unlock(&hotlock);
+  // only now can a reader find it
+  LatchOf(n).hot.store(h,memory_order_release);
+}
+
+
+//
+// The leftmost path says how deep the leaves are, since they all
+// are the same depth, so nothing below the interior nodes is read.
+//
+ERROR_T BTreeIndex::FillHot()
+{
+  SIZE_T n=superblock.info.rootnode;
+  SIZE_T leafdepth=0;
+  BTreeNode b;
+  ERROR_T rc;
+
+  while (1) {
+    rc=b.Unserialize(buffercache,n);
+    if (rc) { return rc; }
+    if (b.info.nodetype==BTREE_LEAF_NODE) {
+      break;
+    }
+    leafdepth++;
+    if (b.info.numkeys==0) {
+      // an empty index
+      break;
+    }
+    rc=b.GetPtr(0,n);
+    if (rc) { return rc; }
+  }
+  return FillHot(superblock.info.rootnode,0,leafdepth);
+}
+
+
+ERROR_T BTreeIndex::FillHot(const SIZE_T n, const SIZE_T depth, const SIZE_T leafdepth)
+{
+  BTreeNode *h=LatchOf(n).hot.load(memory_order_relaxed);
+  BTreeNode b;
+  SIZE_T offset, child;
+  ERROR_T rc;
+
+  if (depth>=hotlevels || depth>=leafdepth) {
+    return ERROR_NOERROR;
+  }
+  if (h) {
+    b=*h;
+  } else {
+    rc=b.Unserialize(buffercache,n);
+    if (rc) { return rc; }
+    AddHotNode(b,n,depth);
+  }
+  if (depth+1>=hotlevels || depth+1>=leafdepth) {
+    return ERROR_NOERROR;
+  }
+  for (offset=0;offset<=b.info.numkeys && b.info.numkeys>0;offset++) {
+    rc=b.GetPtr(offset,child);
+    if (rc) { return rc; }
+    rc=FillHot(child,depth+1,leafdepth);
+    if (rc) { return rc; }
+  }
+  return ERROR_NOERROR;
+}
+
+
+void BTreeIndex::DropHot()
+{
+  MutexHolder l(&hotlock);
+  SIZE_T i;
+
+  for (i=0;i<hotblocks.size();i++) {
+    delete LatchOf(hotblocks[i]).hot.exchange(0);
+  }
+  for (i=0;i<hotspare.size();i++) {
+    delete hotspare[i];
+  }
+  hotblocks.clear();
+  hotdepths.clear();
+  hotspare.clear();
+}
+
+
+void BTreeIndex::DropHotNode(const SIZE_T n)
+{
+  MutexHolder l(&hotlock);
+  BTreeNode *h=LatchOf(n).hot.exchange(0);
+
+  if (!h) {
+    return;
+  }
+  for (SIZE_T i=0;i<hotblocks.size();i++) {
+    if (hotblocks[i]==n) {
+      hotblocks[i]=hotblocks.back();
+      hotdepths[i]=hotdepths.back();
+      hotblocks.pop_back();
+      hotdepths.pop_back();
+      break;
+    }
+  }
+  // A reader that got h before we took it sees the version change
+  // when we let go of the latch, so it will not use what it copied
+  hotspare.push_back(h);
+}
+
+
+void BTreeIndex::ShiftHot(const SIZE_T root, const int levels)
+{
+  vector<SIZE_T> drop;
+  SIZE_T i;
+
+  pthread_mutex_lock(&hotlock);
+  for (i=0;i<hotblocks.size();i++) {
+    if (hotblocks[i]!=root) {
+      hotdepths[i]+=levels;
+      if (hotdepths[i]>=hotlevels) {
+	drop.push_back(hotblocks[i]);
+      }
+    }
+  }
+  pthread_mutex_unlock(&hotlock);
+
+  // Not under hotlock, which DropHotNode takes
+  for (i=0;i<drop.size();i++) {
+    Latch(drop[i]);
+    DropHotNode(drop[i]);
+  }
+}
+
+
+void BTreeIndex::GrowLatches(const SIZE_T highwater)
+{
+  SIZE_T i;
+
+  if (!latchchunks) {
+    numlatchchunks=(buffercache->GetNumBlocks()+BTREE_LATCH_CHUNK-1)/BTREE_LATCH_CHUNK;
+    latchchunks=new atomic<NodeLatch *> [numlatchchunks];
+    for (i=0;i<numlatchchunks;i++) {
+      latchchunks[i].store(0,memory_order_relaxed);
+    }
+  }
+  for (i=0;i<numlatchchunks && i*BTREE_LATCH_CHUNK<highwater;i++) {
+    if (!latchchunks[i].load(memory_order_relaxed)) {
+      latchchunks[i].store(new NodeLatch [BTREE_LATCH_CHUNK],memory_order_release);
+    }
+  }
+}
+
+
+void BTreeIndex::FreeLatches()
+{
+  for (SIZE_T i=0;i<numlatchchunks;i++) {
+    delete [] latchchunks[i].load(memory_order_relaxed);
+  }
+  delete [] latchchunks;
+  latchchunks=0;
+  numlatchchunks=0;
+}
+
+
+void BTreeIndex::SetHotLevels(const SIZE_T levels)
+{
+  hotlevels=levels;
+  DropHot();
+  if (latchchunks) {
+    // Without the copies descents just go to the buffer cache, so
+    // a failure here costs only time
+    FillHot();
+  }
+}
+
+
+void BTreeIndex::CountKeys(const int delta)
+{
+  MutexHolder l(&superlock);
+
+  superblock.info.numkeys+=delta;
+  superblockdirty=true;
+}
+
+
 ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
 {
   ERROR_T rc;
@@ -119,17 +481,28 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
   assert(superblock_index==0);
 
   if (create) {
-    // build a super block, root node, and a free space list
+    rc=NodeMetadata::CheckKeyType(superblock.info.keytype,superblock.info.keysize);
+    if (rc) {
+      return rc;
+    }
+    // build a super block and root node
     //
     // Superblock at superblock_index
     // root node at superblock_index+1
-    // free space list for rest
+    // the rest is free, which the high water mark says without
+    // touching any of it
     BTreeNode newsuperblock(BTREE_SUPERBLOCK,
 			    superblock.info.keysize,
 			    superblock.info.valuesize,
-			    buffercache->GetBlockSize());
+			    buffercache->GetBlockSize(),
+			    superblock.info.keytype);
+    rc=newsuperblock.info.CheckSizes();
+    if (rc) {
+      return rc;
+    }
     newsuperblock.info.rootnode=superblock_index+1;
-    newsuperblock.info.freelist=superblock_index+2;
+    newsuperblock.info.freelist=0;
+    newsuperblock.info.highwater=superblock_index+2;
     newsuperblock.info.numkeys=0;
 
     buffercache->NotifyAllocateBlock(superblock_index);
@@ -143,9 +516,10 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
     BTreeNode newrootnode(BTREE_ROOT_NODE,
 			  superblock.info.keysize,
 			  superblock.info.valuesize,
-			  buffercache->GetBlockSize());
+			  buffercache->GetBlockSize(),
+			  superblock.info.keytype);
     newrootnode.info.rootnode=superblock_index+1;
-    newrootnode.info.freelist=superblock_index+2;
+    newrootnode.info.freelist=0;
     newrootnode.info.numkeys=0;
 
     buffercache->NotifyAllocateBlock(superblock_index+1);
@@ -155,114 +529,163 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
     if (rc) {
       return rc;
     }
-
-    for (SIZE_T i=superblock_index+2; i<buffercache->GetNumBlocks();i++) {
-      BTreeNode newfreenode(BTREE_UNALLOCATED_BLOCK,
-			    superblock.info.keysize,
-			    superblock.info.valuesize,
-			    buffercache->GetBlockSize());
-      newfreenode.info.rootnode=superblock_index+1;
-      newfreenode.info.freelist= ((i+1)==buffercache->GetNumBlocks()) ? 0: i+1;
-
-      rc = newfreenode.Serialize(buffercache,i);
-
-      if (rc) {
-	return rc;
-      }
-
-    }
   }
 
   // OK, now, mounting the btree is simply a matter of reading the superblock
 
-  return superblock.Unserialize(buffercache,initblock);
+  DropHot();
+  FreeLatches();
+  superblockdirty=false;
+  rc=superblock.Unserialize(buffercache,initblock);
+  if (rc) {
+    return rc;
+  }
+  GrowLatches(superblock.info.highwater);
+  return FillHot();
 }
 
 
 ERROR_T BTreeIndex::Detach(SIZE_T &initblock)
 {
-  return superblock.Serialize(buffercache,superblock_index);
+  MutexHolder l(&superlock);
+  ERROR_T rc;
+
+  if (superblockdirty) {
+    rc=superblock.Serialize(buffercache,superblock_index);
+    if (rc) {
+      return rc;
+    }
+    superblockdirty=false;
+  }
+  initblock=superblock_index;
+  return ERROR_NOERROR;
 }
 
 
-ERROR_T BTreeIndex::LookupOrUpdateInternal(const SIZE_T &node,
-					   const BTreeOp op,
-					   const KEY_T &key,
-					   VALUE_T &value,vector<SIZE_T> &pointer)
+ERROR_T BTreeIndex::Checkpoint()
 {
-  BTreeNode b;
   ERROR_T rc;
+  SIZE_T initblock;
+
+  rc=Detach(initblock);
+  if (rc) {
+    return rc;
+  }
+  return buffercache->Checkpoint();
+}
+
+
+ERROR_T BTreeIndex::ReadLeaf(const KEY_T &key, SIZE_T &n, BTreeNode &node,
+			     VERSION_T &version) const
+{
+  SIZE_T parent;
+  VERSION_T parentversion;
   SIZE_T offset;
-  KEY_T testkey;
-  SIZE_T ptr;
+  ERROR_T rc;
+
+  n=superblock.info.rootnode;
+  rc=ReadNode(n,node,version);
+  if (rc) { return rc; }
 
-  rc= b.Unserialize(buffercache,node);
-  SIZE_T rootPtr = superblock.info.rootnode;
-  if(node==superblock.info.rootnode)
-  {
-  pointer.push_back(rootPtr);
+  // An interior node with no keys at all is an empty index
+  while ((node.info.nodetype==BTREE_ROOT_NODE || node.info.nodetype==BTREE_INTERIOR_NODE) &&
+	 node.info.numkeys>0) {
+    // Find the first key that's larger and go down the ptr
+    // immediately previous to it, or the last ptr if there
+    // is no such key
+    offset=node.UpperBound(key);
+    parent=n;
+    parentversion=version;
+    rc=node.GetPtr(offset,n);
+    if (rc) { return rc; }
+    rc=ReadNode(n,node,version);
+    if (rc) { return rc; }
+    if (!CheckLatch(parent,parentversion)) {
+      // The parent has changed, so n may not be where key belongs
+      // any more, or even part of the tree.  Start over.
+      n=superblock.info.rootnode;
+      rc=ReadNode(n,node,version);
+      if (rc) { return rc; }
+    }
   }
 
-  if (rc!=ERROR_NOERROR) {
-    return rc;
+  if (node.info.nodetype!=BTREE_LEAF_NODE &&
+      node.info.nodetype!=BTREE_ROOT_NODE &&
+      node.info.nodetype!=BTREE_INTERIOR_NODE) {
+    // We can't be looking at anything other than a root, internal, or leaf
+    return ERROR_INSANE;
   }
+  return ERROR_NOERROR;
+}
 
-  switch (b.info.nodetype) {
-  case BTREE_ROOT_NODE:
-  case BTREE_INTERIOR_NODE:
-    // Scan through key/ptr pairs
-    //and recurse if possible
-    for (offset=0;offset<b.info.numkeys;offset++) {
-      rc=b.GetKey(offset,testkey);
-      if (rc) {  return rc; }
-      if (key<testkey) {
-	// OK, so we now have the first key that's larger
-	// so we ned to recurse on the ptr immediately previous to
-	// this one, if it exists
-	rc=b.GetPtr(offset,ptr);
-        pointer.push_back(ptr);
-	if (rc) { return rc; }
-	return LookupOrUpdateInternal(ptr,op,key,value,pointer);
+
+ERROR_T BTreeIndex::ChangeLeaf(const BTreeOp op, const KEY_T &key,
+			       const VALUE_T &value, bool &done)
+{
+  BTreeNode node;
+  SIZE_T n;
+  VERSION_T version;
+  SIZE_T offset;
+  bool found;
+  ERROR_T rc;
+
+  done=false;
+
+  while (1) {
+    rc=ReadLeaf(key,n,node,version);
+    if (rc) { return rc; }
+    if (node.info.nodetype!=BTREE_LEAF_NODE) {
+      // the first key makes the root a leaf, which isn't done here
+      if (op==BTREE_OP_INSERT) {
+	return ERROR_NOERROR;
       }
-    }
-    // if we got here, we need to go to the next pointer, if it exists
-    if (b.info.numkeys>0) {
-      rc=b.GetPtr(b.info.numkeys,ptr);
-      pointer.push_back(ptr);
-      if (rc) { return rc; }
-      return LookupOrUpdateInternal(ptr,op,key,value,pointer);
-    } else {
-      // There are no keys at all on this node, so nowhere to go
+      done=true;
       return ERROR_NONEXISTENT;
     }
-    break;
-  case BTREE_LEAF_NODE:
-    // Scan through keys looking for matching value
-    for (offset=0;offset<b.info.numkeys;offset++) {
-      rc=b.GetKey(offset,testkey);
-      if (rc) {  return rc; }
-      if (testkey==key) {
-	if (op==BTREE_OP_LOOKUP) {
-	  return b.GetVal(offset,value);
-	}
-	else {
-	  // BTREE_OP_UPDATE
-	  // WRITE ME
-    rc = b.SetVal(offset,value);
-	if (rc) { return rc; }
-	return b.Serialize(buffercache,node);
-	}
-      }
+
+    offset=node.LowerBound(key);
+    found=offset<node.info.numkeys && node.CompareKey(offset,key)==0;
+    if (op==BTREE_OP_INSERT ? found : !found) {
+      done=true;
+      return op==BTREE_OP_INSERT ? ERROR_INSERT : ERROR_NONEXISTENT;
     }
-    return ERROR_NONEXISTENT;
-    break;
-  default:
-    // We can't be looking at anything other than a root, internal, or leaf
-    return ERROR_INSANE;
-    break;
-  }
 
-  return ERROR_INSANE;
+    switch (op) {
+    case BTREE_OP_INSERT:
+      rc=node.InsertKeyVal(offset,key,value);
+      break;
+    case BTREE_OP_UPDATE:
+      rc=node.SetVal(offset,value);
+      break;
+    case BTREE_OP_DELETE:
+      rc=node.RemoveEntry(offset);
+      break;
+    default:
+      return ERROR_INSANE;
+    }
+    if (rc) { return rc; }
+
+    if (node.IsOverfull() ||
+	(n==superblock.info.rootnode ? node.info.numkeys==0 : node.IsUnderfull())) {
+      return ERROR_NOERROR;
+    }
+
+    // Our copy is only good if the leaf is still that version
+    if (!TryLatch(n,version)) {
+      continue;
+    }
+    rc=WriteNode(node,n);
+    Unlatch(n);
+    if (rc) { return rc; }
+
+    if (op==BTREE_OP_INSERT) {
+      CountKeys(1);
+    } else if (op==BTREE_OP_DELETE) {
+      CountKeys(-1);
+    }
+    done=true;
+    return ERROR_NOERROR;
+  }
 }
 
 
@@ -300,7 +723,7 @@ static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplay
 	if (offset==b.info.numkeys) break;
 	rc=b.GetKey(offset,key);
 	if (rc) {  return rc; }
-	for (i=0;i<b.info.keysize;i++) {
+	for (i=0;i<key.length;i++) {
 	  os << key.data[i];
 	}
 	os << " ";
@@ -326,7 +749,7 @@ static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplay
       }
       rc=b.GetKey(offset,key);
       if (rc) {  return rc; }
-      for (i=0;i<b.info.keysize;i++) {
+      for (i=0;i<key.length;i++) {
 	os << key.data[i];
       }
       if (dt==BTREE_SORTED_KEYVAL) {
@@ -336,7 +759,7 @@ static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplay
       }
       rc=b.GetVal(offset,value);
       if (rc) {  return rc; }
-      for (i=0;i<b.info.valuesize;i++) {
+      for (i=0;i<value.length;i++) {
 	os << value.data[i];
       }
       if (dt==BTREE_SORTED_KEYVAL) {
@@ -361,373 +784,1350 @@ static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplay
 
 ERROR_T BTreeIndex::Lookup(const KEY_T &key, VALUE_T &value)
 {
-  vector<SIZE_T> pointer;
-  return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, value,pointer);
-}
-
+  BTreeNode node;
+  SIZE_T n;
+  VERSION_T version;
+  SIZE_T offset;
+  ERROR_T rc;
 
-ERROR_T BTreeIndex::insert_not_full_leaf(SIZE_T targetNode,BTreeNode &tempNode,const KEY_T &key,const VALUE_T &value)
-{
-   ERROR_T rc;
-   tempNode.info.numkeys++;
-   unsigned int times = 0;
-   unsigned int loops = tempNode.info.numkeys;
-   
-   for (SIZE_T offset = 0; offset < loops - 1; offset++)
-   {
-   		KEY_T testkey;
-   		tempNode.GetKey(offset, testkey);
-   		
-   		if (key == testkey)
-      {
-            break;
-      }
-      else if (key < testkey)
-      {
-        	for (unsigned int i = tempNode.info.numkeys - 1; i > offset; i--)
-        	{
-            	KEY_T tempKey;
-            	VALUE_T tempVal;
-            	tempNode.GetKey(i-1, tempKey);
-            	tempNode.GetVal(i-1, tempVal);
-            	tempNode.SetKey(i, tempKey);
-            	tempNode.SetVal(i, tempVal);
-        	}
-        	tempNode.SetKey(offset,key);
-        	tempNode.SetVal(offset,value);
-        	rc = tempNode.Serialize(buffercache, targetNode);
-        	if(rc) {return rc;}
-        	break;
-        }
-        else
-        {
-            times++;
-            if (times == (tempNode.info.numkeys -1 ))
-            {
-            	tempNode.SetKey(tempNode.info.numkeys - 1, key);
-            	tempNode.SetVal(tempNode.info.numkeys - 1, value);
-            	rc=tempNode.Serialize(buffercache,targetNode);
-            	if(rc) {return rc;}
-            	break;
-            }
-
-        }
-   }
-}
-
-// insert if the internal node is not full
-ERROR_T BTreeIndex::insert_not_full_internal(SIZE_T targetNode,BTreeNode &tempNode,SIZE_T newLeftLeafPtr,SIZE_T newRightLeafPtr,const KEY_T &key)
-{
-   ERROR_T rc;
-   tempNode.info.numkeys++;
-   unsigned int loops = tempNode.info.numkeys;
-   unsigned int times = 0;
-   for (SIZE_T offset = 0;offset < loops - 1; offset++)
-   {
-   		KEY_T testkey;
-   		tempNode.GetKey(offset, testkey);
-   		
-   		if (key == testkey)
-      {
-           break;
-      }
-      else if (key < testkey)
-      {
-        	for (unsigned int i = tempNode.info.numkeys - 1; i > offset; i--)
-        	{	
-            	KEY_T tempKey;
-            	SIZE_T tempPointer;
-           	 	tempNode.GetKey(i - 1, tempKey);
-            	tempNode.SetKey(i, tempKey);
-           		tempNode.GetPtr(i, tempPointer);
-           		tempNode.SetPtr(i + 1, tempPointer);
-        	}
-        	tempNode.SetKey(offset, key);
-        	tempNode.SetPtr(offset, newLeftLeafPtr);
-        	tempNode.SetPtr(offset + 1, newRightLeafPtr);
-       		rc = tempNode.Serialize(buffercache, targetNode);
-        	if(rc) {return rc;}
-       		break;
-        }
-        else
-        {
-            times++;
-            if (times == (tempNode.info.numkeys - 1))
-            {
-            		tempNode.SetKey(tempNode.info.numkeys - 1, key);
-            		tempNode.SetPtr(tempNode.info.numkeys - 1, newLeftLeafPtr);
-            		tempNode.SetPtr(tempNode.info.numkeys, newRightLeafPtr);
-            		rc = tempNode.Serialize(buffercache, targetNode);
-            		if(rc) {return rc;}
-            		break;
-            }
-        }
-   }
-}
-
-
-// split the leaf when the leaf is full
-ERROR_T BTreeIndex::split_full_leaf(BTreeNode Node,SIZE_T& newLeftLeafPtr,SIZE_T& newRightLeafPtr, KEY_T& Key, VALUE_T& value)
-{   
-		ERROR_T rc;
-		AllocateNode(newLeftLeafPtr);
-    AllocateNode(newRightLeafPtr);
-    
-    // build a new left leaf
-    BTreeNode leftLeaf;
-    leftLeaf = BTreeNode(BTREE_LEAF_NODE, superblock.info.keysize, superblock.info.valuesize, superblock.info.blocksize);
-    leftLeaf.Serialize(buffercache, newLeftLeafPtr);
-    rc = leftLeaf.Unserialize(buffercache,newLeftLeafPtr);
-    if (rc) {return rc;}
-
-		// build a new right leaf
-		BTreeNode rightLeaf;
-    rightLeaf = BTreeNode(BTREE_LEAF_NODE, superblock.info.keysize, superblock.info.valuesize, superblock.info.blocksize);
-    rightLeaf.Serialize(buffercache, newRightLeafPtr);
-    rc = rightLeaf.Unserialize(buffercache,newRightLeafPtr);
-    if (rc) {return rc;}
-    
-    // move to new left node
-    for (unsigned int offset = 0;offset < (Node.info.GetNumSlotsAsLeaf()) / 2; offset++)
-    {
-        KEY_T tempKey;
-        VALUE_T tempValue;
-        rc = Node.GetKey(offset, tempKey);
-        if (rc){return rc;}
-        rc = Node.GetVal(offset, tempValue);
-        if(rc){return rc;}
-        leftLeaf.info.numkeys++;
-        rc = leftLeaf.SetKey(offset, tempKey);
-        if(rc) {return rc;}
-        rc = leftLeaf.SetVal(offset, tempValue);
-        if(rc) {return rc;}
-    }
-    leftLeaf.Serialize(buffercache,newLeftLeafPtr);
-
-		// move to new right node
-    for (unsigned int offset = (Node.info.GetNumSlotsAsLeaf()) / 2; offset < Node.info.GetNumSlotsAsLeaf(); offset++)
-    {
-        KEY_T tempKey;
-        VALUE_T tempValue;
-        rc = Node.GetKey(offset, tempKey);
-        if (rc){return rc;}
-        rc = Node.GetVal(offset, tempValue);
-        if(rc){return rc;}
-        rightLeaf.info.numkeys++;
-        rc = rightLeaf.SetKey(offset - (Node.info.GetNumSlotsAsLeaf()) / 2, tempKey);
-        if(rc) {return rc;}
-        rc = rightLeaf.SetVal(offset - (Node.info.GetNumSlotsAsLeaf()) / 2, tempValue);
-        if(rc) {return rc;}
-    }
-    rightLeaf.Serialize(buffercache, newRightLeafPtr);
-    rc = Node.GetKey((Node.info.GetNumSlotsAsLeaf()) / 2, Key);
-    rc = Node.GetVal((Node.info.GetNumSlotsAsLeaf()) / 2, value);
-}
-
-
-// split the internal node
-ERROR_T BTreeIndex::split_internal(vector<SIZE_T>& pointer, SIZE_T& newLeftLeafPtr, SIZE_T& newRightLeafPtr, KEY_T& key, int& result)
-{
-    ERROR_T rc;
-    if(result == 0)
-    {
-    		BTreeNode tempNode;
-    		SIZE_T targetNode = pointer.back();
-    		pointer.pop_back();
-    		rc=tempNode.Unserialize(buffercache,targetNode);
-    if(tempNode.info.numkeys == tempNode.info.GetNumSlotsAsInterior() - 1)
-    {
-        SIZE_T rootPtr = superblock.info.rootnode;
-        if(targetNode != rootPtr)
-        {
-        		SIZE_T newLeftInternalPtr;
-       			SIZE_T newRightInternalPtr;
-        		KEY_T tempKey;
-        		insert_not_full_internal(targetNode, tempNode, newLeftLeafPtr, newRightLeafPtr, key);
-        		split_full_internal(tempNode, newLeftInternalPtr, newRightInternalPtr, tempKey);
-        		split_internal(pointer, newLeftInternalPtr, newRightInternalPtr, tempKey, result);
-        }
-        if(targetNode == rootPtr)
-        {
-        		SIZE_T newLeftInternalPtr;
-        		SIZE_T newRightInternalPtr;
-        		KEY_T tempKey;
-        		BTreeNode newRoot;
-        		insert_not_full_internal(targetNode, tempNode, newLeftLeafPtr, newRightLeafPtr, key);
-        		split_full_internal(tempNode,newLeftInternalPtr,newRightInternalPtr,tempKey);
-        		newRoot=BTreeNode(BTREE_INTERIOR_NODE,superblock.info.keysize,superblock.info.valuesize, superblock.info.blocksize);
-        		newRoot.info.numkeys++;
-        		newRoot.SetKey(0, tempKey);
-        		newRoot.SetPtr(0, newLeftInternalPtr);
-        		newRoot.SetPtr(1, newRightInternalPtr);
-        		rc = newRoot.Serialize(buffercache, superblock.info.rootnode);
-        		result=1;
-        		return rc;
-        }
-    }
-    else
-    {
-        insert_not_full_internal(targetNode, tempNode, newLeftLeafPtr, newRightLeafPtr, key);
-        result=1;
-        return rc;
-    }
-    }
-    else
-    {
-    		return rc;
-    }
-}
-
-ERROR_T BTreeIndex::split_full_internal(BTreeNode Node, SIZE_T& newLeftInternalPtr, SIZE_T& newRightInternalPtr, KEY_T& Key)
-{   
-		ERROR_T rc;
-		AllocateNode(newLeftInternalPtr);
-		AllocateNode(newRightInternalPtr);
-		
-		// build new left internal node
-    BTreeNode Left_Internal;
-    Left_Internal = BTreeNode(BTREE_INTERIOR_NODE, superblock.info.keysize, superblock.info.valuesize, superblock.info.blocksize);
-    Left_Internal.Serialize(buffercache, newLeftInternalPtr);
-    rc = Left_Internal.Unserialize(buffercache,newLeftInternalPtr);
-    if (rc) {return rc;}
-    
-    // build new right internal node
-    BTreeNode Right_Internal;
-    Right_Internal = BTreeNode(BTREE_INTERIOR_NODE, superblock.info.keysize, superblock.info.valuesize, superblock.info.blocksize);
-    Right_Internal.Serialize(buffercache, newRightInternalPtr);
-    rc = Right_Internal.Unserialize(buffercache,newRightInternalPtr);
-    if (rc) {return rc;}
-    
-    for (unsigned int offset = 0;offset < (Node.info.GetNumSlotsAsInterior()) / 2; offset++)
-    {
-        KEY_T tempKey;
-        SIZE_T tempPointer;
-        rc=Node.GetKey(offset,tempKey);
-        if (rc){return rc;}
-        
-        rc=Node.GetPtr(offset,tempPointer);
-        Left_Internal.info.numkeys++;
-        rc=Left_Internal.SetKey(offset,tempKey);
-        rc=Left_Internal.SetPtr(offset,tempPointer);
-        if(rc) {return rc;}
-    }
-        SIZE_T tempPointer;
-        rc=Node.GetPtr((Node.info.GetNumSlotsAsInterior()) / 2, tempPointer);
-        rc=Left_Internal.SetPtr((Node.info.GetNumSlotsAsInterior()) / 2, tempPointer);
-        Left_Internal.Serialize(buffercache, newLeftInternalPtr);
-
-    for (unsigned int offset=(Node.info.GetNumSlotsAsInterior()) / 2 + 1; offset < Node.info.GetNumSlotsAsInterior(); offset++)
-    {
-        KEY_T tempKey;
-        SIZE_T tempPointer;
-        rc = Node.GetKey(offset, tempKey);
-        if (rc){return rc;}
-        rc = Node.GetPtr(offset, tempPointer);
-        Right_Internal.info.numkeys++;
-        rc = Right_Internal.SetKey(offset - Node.info.GetNumSlotsAsInterior() / 2 - 1, tempKey);
-        rc = Right_Internal.SetPtr(offset - Node.info.GetNumSlotsAsInterior() / 2 - 1, tempPointer);
-        if(rc) {return rc;}
-    }
-    SIZE_T tempPoint;
-    rc = Node.GetPtr(Node.info.GetNumSlotsAsInterior(), tempPoint);
-    rc = Right_Internal.SetPtr((Node.info.GetNumSlotsAsInterior()) / 2 - 1, tempPoint);
-    Right_Internal.Serialize(buffercache, newRightInternalPtr);
-    rc = Node.GetKey((Node.info.GetNumSlotsAsInterior()) / 2, Key);
+  rc=ReadLeaf(key,n,node,version);
+  if (rc) { return rc; }
+  if (node.info.nodetype!=BTREE_LEAF_NODE) {
+    return ERROR_NONEXISTENT;
+  }
+  // Search the keys for a matching one
+  offset=node.LowerBound(key);
+  if (offset<node.info.numkeys && node.CompareKey(offset,key)==0) {
+    return node.GetVal(offset,value);
+  }
+  return ERROR_NONEXISTENT;
 }
 
 
-ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
-{
-  VALUE_T val;
-  bool firstBlock;
-  vector<SIZE_T> pointers;
-  ERROR_T errorCode = LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, val, pointers);
-
-  switch(errorCode) {
-    case ERROR_NOERROR:
-    return ERROR_INSERT;
-
-    case ERROR_NONEXISTENT:
-    superblock.info.numkeys++;
-    BTreeNode leafNode;
-    BTreeNode rootNode;
-    ERROR_T rc;
-    SIZE_T rootPtr = superblock.info.rootnode;
-    rootNode.Unserialize(buffercache, rootPtr);
-    firstBlock = false;
-    if (rootNode.info.numkeys != 0) 
-    {
-      firstBlock = true;
-    }
-    rootNode.Serialize(buffercache, rootPtr);
-    if(!firstBlock){
-      firstBlock = true;
-      leafNode = BTreeNode(BTREE_LEAF_NODE, superblock.info.keysize, superblock.info.valuesize, superblock.info.blocksize);
-      leafNode.info.numkeys++;
-      leafNode.SetKey(0, key);
-      leafNode.SetVal(0, value);
-      rootNode = leafNode;
-      rc = rootNode.Serialize(buffercache, superblock.info.rootnode);
-      if (rc) {return rc;}
-     }
-     if(firstBlock)
-     {
-        SIZE_T targetNode = pointers.back();
-        pointers.pop_back();
-        BTreeNode tempNode;
-        rc = tempNode.Unserialize(buffercache,targetNode);
-        if(tempNode.info.numkeys == tempNode.info.GetNumSlotsAsLeaf() - 1)
-        {
-        		insert_not_full_leaf(targetNode, tempNode, key, value);
-        		SIZE_T newLeftLeafPtr;
-        		SIZE_T newRightLeafPtr;
-        		SIZE_T rootPtr = superblock.info.rootnode;
-        		if(targetNode == rootPtr)
-        		{
-        				KEY_T tempKey;
-        				VALUE_T tempVal;
-        				split_full_leaf(tempNode,newLeftLeafPtr,newRightLeafPtr,tempKey,tempVal);
-        				BTreeNode newRoot;
-        				newRoot = BTreeNode(BTREE_INTERIOR_NODE,superblock.info.keysize,superblock.info.valuesize, superblock.info.blocksize);
-        				newRoot.info.numkeys++;
-        				newRoot.SetKey(0, tempKey);
-        				newRoot.SetPtr(0, newLeftLeafPtr);
-        				newRoot.SetPtr(1, newRightLeafPtr);
-        				rc = newRoot.Serialize(buffercache, superblock.info.rootnode);
-        		}
-        		if(targetNode != rootPtr)
-        		{
-         				KEY_T tempKey;
-         				VALUE_T tempVal;
-         				int result = 0;
-         				split_full_leaf(tempNode,newLeftLeafPtr,newRightLeafPtr,tempKey,tempVal);
-         				split_internal(pointers,newLeftLeafPtr,newRightLeafPtr,tempKey,result);
-        		}
-        }
-        else
-        {
-            insert_not_full_leaf(targetNode,tempNode,key,value);
-        }
-			}
-	}
-}
+// Orders positions in a vector of keys by the keys
+struct KeyOrder {
+  const vector<KEY_T> &keys;
 
+  KeyOrder(const vector<KEY_T> &k) : keys(k) {}
+  bool operator()(const SIZE_T a, const SIZE_T b) const { return keys[a]<keys[b]; }
+};
 
-ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
-{
-  // WRITE ME
- VALUE_T val = value;
- vector<SIZE_T> pointer;
- return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_UPDATE, key, val,pointer);
-}
+
+//
+// Find keys[order[first..last-1]] in the subtree at node.  These
+// are in key order, so the ones that go to the same child are next
+// to each other, and each child is visited just once.
+//
+ERROR_T BTreeIndex::MultiLookupInternal(const SIZE_T &node,
+					const SIZE_T depth,
+					const SIZE_T parent,
+					const VERSION_T parentversion,
+					const vector<KEY_T> &keys,
+					const vector<SIZE_T> &order,
+					const SIZE_T first,
+					const SIZE_T last,
+					vector<VALUE_T> &values,
+					vector<SIZE_T> &retry) const
+{
+  BTreeNode b;
+  VERSION_T version;
+  ERROR_T rc;
+  SIZE_T i, j, k, offset;
+  SIZE_T ptr;
+  vector<SIZE_T> children;
+  vector<SIZE_T> ends;
+
+  rc=ReadNode(node,b,version);
+  if (rc) { return rc; }
+  if (depth>0 && !CheckLatch(parent,parentversion)) {
+    // node may not be where the keys belong any more
+    retry.insert(retry.end(),order.begin()+first,order.begin()+last);
+    return ERROR_NOERROR;
+  }
+
+  switch (b.info.nodetype) {
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE:
+    if (b.info.numkeys==0) {
+      // empty index, so none of them exist
+      return ERROR_NOERROR;
+    }
+    // Split the keys into runs that go to the same child
+    for (i=first;i<last;i=j) {
+      offset=b.UpperBound(keys[order[i]]);
+      for (j=i+1;
+	   j<last && (offset==b.info.numkeys || b.CompareKey(offset,keys[order[j]])>0);
+	   j++) {
+      }
+      rc=b.GetPtr(offset,ptr);
+      if (rc) { return rc; }
+      children.push_back(ptr);
+      ends.push_back(j);
+    }
+    // hot children are read from the cache once at most, so there
+    // is no point in asking for them ahead of time
+    if (children.size()>1 && depth+1>=hotlevels) {
+      rc=PrefetchBlocks(children);
+      if (rc) { return rc; }
+    }
+    for (k=0,i=first;k<children.size();i=ends[k],k++) {
+      rc=MultiLookupInternal(children[k],depth+1,node,version,keys,order,i,ends[k],values,retry);
+      if (rc) { return rc; }
+    }
+    return ERROR_NOERROR;
+    break;
+  case BTREE_LEAF_NODE:
+    for (i=first;i<last;i++) {
+      offset=b.LowerBound(keys[order[i]]);
+      if (offset<b.info.numkeys && b.CompareKey(offset,keys[order[i]])==0) {
+	rc=b.GetVal(offset,values[order[i]]);
+	if (rc) { return rc; }
+      }
+    }
+    return ERROR_NOERROR;
+    break;
+  default:
+    return ERROR_INSANE;
+    break;
+  }
+
+  return ERROR_INSANE;
+}
+
+
+ERROR_T BTreeIndex::MultiLookup(const vector<KEY_T> &keys, vector<VALUE_T> &values) const
+{
+  vector<SIZE_T> order, retry;
+  ERROR_T rc;
+
+  // a key of the wrong size can't be there
+  values.assign(keys.size(),VALUE_T());
+  for (SIZE_T i=0;i<keys.size();i++) {
+    if (superblock.info.IsKeySize(keys[i].length)) {
+      order.push_back(i);
+    }
+  }
+  sort(order.begin(),order.end(),KeyOrder(keys));
+
+  // A writer may change a node we've been through, in which case
+  // the keys below it start over from the root.  They come back in
+  // the order they went in, so they are still sorted.
+  while (order.size()>0) {
+    retry.clear();
+    rc=MultiLookupInternal(superblock.info.rootnode,0,0,0,keys,order,0,order.size(),values,retry);
+    if (rc) {
+      return rc;
+    }
+    order.swap(retry);
+  }
+  return ERROR_NOERROR;
+}
+
+
+BTreeScan::BTreeScan() : index(0), buffercache(0), offset(0), backward(false), done(true)
+{}
+
+
+void BTreeScan::Close()
+{
+  leaf=BTreeNode();
+  path.clear();
+  child.clear();
+  done=true;
+}
+
+
+//
+// Go down from node to a leaf and set offset within it.  If
+// bounded, this is the leaf where the scan starts, otherwise it's
+// the leaf at the edge of the subtree that the scan reaches first.
+// On the way down leaf holds a copy of each of the interior nodes in
+// turn.
+//
+ERROR_T BTreeScan::Descend(SIZE_T node, const bool bounded)
+{
+  ERROR_T rc;
+  VERSION_T version;
+  SIZE_T c;
+
+  while (1) {
+    rc=index->ReadNode(node,leaf,version);
+    if (rc) { return rc; }
+
+    switch (leaf.info.nodetype) {
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+      if (leaf.info.numkeys==0) {
+	// an empty index
+	Close();
+	return ERROR_NOERROR;
+      }
+      if (backward) {
+	c = (bounded && hi.length) ? leaf.UpperBound(hi) : leaf.info.numkeys;
+	path.push_back(node);
+	child.push_back(c);
+      } else {
+	c = (bounded && lo.length) ? leaf.UpperBound(lo) : 0;
+      }
+      rc=leaf.GetPtr(c,node);
+      if (rc) { return rc; }
+      break;
+    case BTREE_LEAF_NODE:
+      if (backward) {
+	offset = (bounded && hi.length) ? leaf.UpperBound(hi) : leaf.info.numkeys;
+      } else {
+	offset = (bounded && lo.length) ? leaf.LowerBound(lo) : 0;
+      }
+      return ERROR_NOERROR;
+      break;
+    default:
+      return ERROR_INSANE;
+    }
+  }
+}
+
+
+ERROR_T BTreeScan::NextLeaf()
+{
+  ERROR_T rc;
+  SIZE_T next;
+
+  rc=leaf.GetPtr(0,next);
+  if (rc) { return rc; }
+
+  if (next==0) {
+    Close();
+    return ERROR_NOERROR;
+  }
+
+  rc=leaf.Pin(buffercache,next);
+  if (rc) { return rc; }
+  offset=0;
+
+  // Start reading the leaf after this one while we go through this
+  // one.  The cache may decline, which is fine.
+  rc=leaf.GetPtr(0,next);
+  if (rc) { return rc; }
+  if (next!=0) {
+    buffercache->PrefetchBlock(next);
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeScan::PrevLeaf()
+{
+  VERSION_T version;
+  ERROR_T rc;
+  SIZE_T node;
+
+  // Climb until there is a pointer to the left of the one we took
+  while (!path.empty() && child.back()==0) {
+    path.pop_back();
+    child.pop_back();
+  }
+
+  if (path.empty()) {
+    Close();
+    return ERROR_NOERROR;
+  }
+
+  child.back()--;
+  rc=index->ReadNode(path.back(),leaf,version);
+  if (rc) { return rc; }
+  rc=leaf.GetPtr(child.back(),node);
+  if (rc) { return rc; }
+
+  return Descend(node,false);
+}
+
+
+ERROR_T BTreeScan::Next(KEY_T &key, VALUE_T &value)
+{
+  ERROR_T rc;
+
+  while (!done) {
+    if (!backward && offset<leaf.info.numkeys) {
+      if (hi.length && leaf.CompareKey(offset,hi)>0) {
+	break;
+      }
+      rc=leaf.GetKey(offset,key);
+      if (rc) { return rc; }
+      rc=leaf.GetVal(offset,value);
+      offset++;
+      return rc;
+    }
+    if (backward && offset>0) {
+      if (lo.length && leaf.CompareKey(offset-1,lo)<0) {
+	break;
+      }
+      offset--;
+      rc=leaf.GetKey(offset,key);
+      if (rc) { return rc; }
+      return leaf.GetVal(offset,value);
+    }
+    // Nothing more in this leaf
+    rc = backward ? PrevLeaf() : NextLeaf();
+    if (rc) { return rc; }
+  }
+
+  Close();
+  return ERROR_NONEXISTENT;
+}
+
+
+ERROR_T BTreeIndex::Scan(const KEY_T &lo, const KEY_T &hi, BTreeScan &scan,
+			 const bool backward) const
+{
+  if ((lo.length && !superblock.info.IsKeySize(lo.length)) ||
+      (hi.length && !superblock.info.IsKeySize(hi.length))) {
+    return ERROR_SIZE;
+  }
+
+  scan.Close();
+  scan.index=this;
+  scan.buffercache=buffercache;
+  scan.lo=lo;
+  scan.hi=hi;
+  scan.backward=backward;
+  scan.done=false;
+
+  if (lo.length && hi.length && hi<lo) {
+    // nothing can be in the range
+    scan.Close();
+    return ERROR_NOERROR;
+  }
+
+  return scan.Descend(superblock.info.rootnode,true);
+}
+
+
+// fill of room, but no more than most and no less than least
+static SIZE_T FillTo(const double fill, const SIZE_T room, const SIZE_T most, SIZE_T least)
+{
+  SIZE_T n=(SIZE_T)(fill*room);
+
+  if (least<1) {
+    least=1;
+  }
+  if (n>most) {
+    n=most;
+  }
+  if (n<least) {
+    n=least;
+  }
+  return n;
+}
+
+
+//
+// With variable length keys the key that goes up between two leaves
+// need only be long enough to tell them apart: the shortest start of
+// the first key on the right that is greater than the last one on
+// the left.  The keys in interior nodes are then shorter, so more fit.
+//
+static void Separate(const KEY_T &left, const KEY_T &right, KEY_T &sep)
+{
+  SIZE_T i;
+
+  for (i=0;i<left.length && i<right.length && left.data[i]==right.data[i];i++) {
+  }
+  sep=right;
+  if (i+1<sep.length) {
+    sep.Resize(i+1);
+  }
+}
+
+
+ERROR_T BTreeIndex::BeginBulkLoad(BTreeBulkLoader &loader, const double fill)
+{
+  const NodeMetadata &info=superblock.info;
+  BTreeNode root;
+  ERROR_T rc;
+  SIZE_T slots;
+
+  if (!(fill>0 && fill<=1)) {
+    return ERROR_BADCONFIG;
+  }
+
+  rc=root.Pin(buffercache,superblock.info.rootnode);
+  if (rc) { return rc; }
+  if (root.info.nodetype!=BTREE_ROOT_NODE || root.info.numkeys!=0) {
+    return ERROR_CONFLICT;
+  }
+
+  // Insert splits a node once it is full, so one slot stays free,
+  // and no node may be less full than Delete would leave it
+  if (info.keytype==BTREE_KEY_VARIABLE) {
+    // The caps are in bytes.  A node is complete when the next
+    // entry would take it past its cap, so it may fall short of the
+    // cap by up to an entry.  Some of an interior node may be its
+    // prefix, which doesn't count toward the minimum.
+    SIZE_T m=info.GetEntryBytesAsLeaf(info.keysize,info.valuesize);
+    loader.leafcap=FillTo(fill,info.GetNumPageBytes(),info.GetNumPageBytes()-m,
+			  info.GetMinBytesAsLeaf()+m);
+    m=info.GetEntryBytesAsInterior(info.keysize);
+    loader.interiorcap=FillTo(fill,info.GetNumPageBytes(),info.GetNumPageBytes()-m,
+			      info.GetMinBytesAsInterior()+m+info.GetMaxPrefixBytes());
+  } else {
+    slots=info.GetNumSlotsAsLeaf();
+    loader.leafcap=FillTo(fill,slots,slots-1,info.GetMinKeysAsLeaf());
+    slots=info.GetNumSlotsAsInterior();
+    loader.interiorcap=FillTo(fill,slots,slots-1,info.GetMinKeysAsInterior());
+  }
+
+  loader.index=this;
+  loader.levels.clear();
+  loader.count=0;
+  loader.active=true;
+
+  return ERROR_NOERROR;
+}
+
+
+BTreeBulkLoader::BTreeBulkLoader() :
+  index(0), leafcap(0), interiorcap(0), count(0), active(false)
+{}
+
+
+BTreeNode BTreeBulkLoader::NewNode(const SIZE_T level) const
+{
+  const NodeMetadata &info=index->superblock.info;
+
+  return BTreeNode(level==0 ? BTREE_LEAF_NODE : BTREE_INTERIOR_NODE,
+		   info.keysize, info.valuesize, info.blocksize, info.keytype);
+}
+
+
+bool BTreeBulkLoader::Full(const BTreeNode &node, const SIZE_T cap, const SIZE_T bytes) const
+{
+  if (node.info.keytype==BTREE_KEY_VARIABLE) {
+    return node.GetUsedBytes()+bytes>cap;
+  }
+  return node.info.numkeys==cap;
+}
+
+
+//
+// The node being filled at level is full.  It gets a block, and
+// the one before it can now be written.
+//
+ERROR_T BTreeBulkLoader::Complete(const SIZE_T level)
+{
+  ERROR_T rc;
+  SIZE_T block;
+
+  rc=index->AllocateNode(block);
+  if (rc) { return rc; }
+
+  if (levels[level].hasprev) {
+    Level &l=levels[level];
+    if (level==0) {
+      rc=l.prev.SetPtr(0,block);
+      if (rc) { return rc; }
+    }
+    rc=index->WriteNode(l.prev,l.prevblock);
+    if (rc) { return rc; }
+    // may add a level, so nothing in l can be used after this
+    KEY_T prevlowkey=l.prevlowkey;
+    rc=AddChild(level+1,prevlowkey,l.prevblock);
+    if (rc) { return rc; }
+  }
+
+  Level &l=levels[level];
+  if (level>0 && l.node.info.keytype==BTREE_KEY_VARIABLE) {
+    rc=l.node.Rebase();
+    if (rc) { return rc; }
+  }
+  l.prev=l.node;
+  l.prevlowkey=l.lowkey;
+  l.prevblock=block;
+  l.hasprev=true;
+  l.node=NewNode(level);
+  l.empty=true;
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeBulkLoader::AddChild(const SIZE_T level, const KEY_T &lowkey, const SIZE_T block)
+{
+  ERROR_T rc;
+
+  if (level==levels.size()) {
+    levels.push_back(Level());
+    levels[level].node=NewNode(level);
+    levels[level].empty=true;
+    levels[level].hasprev=false;
+  }
+
+  if (!levels[level].empty &&
+      Full(levels[level].node,interiorcap,
+	   index->superblock.info.GetEntryBytesAsInterior(lowkey.length))) {
+    rc=Complete(level);
+    if (rc) { return rc; }
+  }
+
+  Level &l=levels[level];
+
+  if (l.empty) {
+    // the first child has no key in front of it
+    l.lowkey=lowkey;
+    l.empty=false;
+    return l.node.SetPtr(0,block);
+  }
+
+  if (l.node.info.numkeys==0 && l.node.info.keytype==BTREE_KEY_VARIABLE) {
+    // The keys to come follow this one, so with clustered keys they
+    // have much of it in common.  Complete may find a better prefix
+    // once the node is full.
+    KEY_T prefix=lowkey;
+    SIZE_T most=index->superblock.info.GetMaxPrefixBytes();
+    if (prefix.length>most) {
+      prefix.Resize(most);
+    }
+    rc=l.node.SetPrefix(prefix);
+    if (rc) { return rc; }
+  }
+  return l.node.InsertKeyPtr(l.node.info.numkeys,lowkey,block);
+}
+
+
+ERROR_T BTreeBulkLoader::Add(const KEY_T &key, const VALUE_T &value)
+{
+  ERROR_T rc;
+
+  if (!active) {
+    return ERROR_GENERAL;
+  }
+  if (!index->superblock.info.IsKeySize(key.length) ||
+      !index->superblock.info.IsValueSize(value.length)) {
+    return ERROR_SIZE;
+  }
+  if (count>0 && !(lastkey<key)) {
+    return ERROR_CONFLICT;
+  }
+
+  if (levels.empty()) {
+    levels.push_back(Level());
+    levels[0].node=NewNode(0);
+    levels[0].empty=true;
+    levels[0].hasprev=false;
+  }
+
+  if (Full(levels[0].node,leafcap,
+	   index->superblock.info.GetEntryBytesAsLeaf(key.length,value.length))) {
+    rc=Complete(0);
+    if (rc) { return rc; }
+  }
+
+  Level &l=levels[0];
+
+  if (l.empty) {
+    if (count>0 && index->superblock.info.keytype==BTREE_KEY_VARIABLE) {
+      Separate(lastkey,key,l.lowkey);
+    } else {
+      l.lowkey=key;
+    }
+    l.empty=false;
+  }
+  rc=l.node.InsertKeyVal(l.node.info.numkeys,key,value);
+  if (rc) { return rc; }
+
+  lastkey=key;
+  count++;
+  return ERROR_NOERROR;
+}
+
+
+//
+// If the last node of a level came up short, move entries into it
+// from the (full) node before it, the same way Delete does, or if
+// that can't spare enough, put them all in the one before it
+// (merged)
+//
+ERROR_T BTreeBulkLoader::Rebalance(const SIZE_T level, bool &merged)
+{
+  Level &l=levels[level];
+  ERROR_T rc;
+
+  merged=false;
+
+  while (l.node.IsUnderfull()) {
+    if (!l.prev.CanLend(l.prev.info.numkeys-1)) {
+      merged=true;
+      return index->MergeNodes(l.lowkey,l.prev,l.node);
+    }
+    rc=index->BorrowFromLeft(l.lowkey,l.prev,l.node);
+    if (rc) { return rc; }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeBulkLoader::Finish()
+{
+  ERROR_T rc;
+  SIZE_T level;
+  SIZE_T block;
+  bool merged;
+
+  if (!active) {
+    return ERROR_GENERAL;
+  }
+  active=false;
+
+  // Every level but the top now has two nodes left to write, and
+  // their parent may be completed by them, adding another level
+  for (level=0;level<levels.size();level++) {
+    if (!levels[level].hasprev) {
+      // The only node on the top level is the root, which stays
+      // where it always is
+      rc=index->WriteNode(levels[level].node,index->superblock.info.rootnode);
+      if (rc) { return rc; }
+      break;
+    }
+    rc=Rebalance(level,merged);
+    if (rc) { return rc; }
+    if (merged) {
+      KEY_T prevlowkey=levels[level].prevlowkey;
+      SIZE_T prevblock=levels[level].prevblock;
+      rc=index->WriteNode(levels[level].prev,prevblock);
+      if (rc) { return rc; }
+      if (level+1==levels.size()) {
+	// It was the only node left on the top level, so it is the
+	// root after all, and its block isn't needed
+	rc=index->WriteNode(levels[level].prev,index->superblock.info.rootnode);
+	if (rc) { return rc; }
+	rc=index->DeallocateNode(prevblock);
+	if (rc) { return rc; }
+	break;
+      }
+      rc=AddChild(level+1,prevlowkey,prevblock);
+      if (rc) { return rc; }
+      continue;
+    }
+    rc=index->AllocateNode(block);
+    if (rc) { return rc; }
+    if (level==0) {
+      rc=levels[level].prev.SetPtr(0,block);
+      if (rc) { return rc; }
+    }
+    rc=index->WriteNode(levels[level].prev,levels[level].prevblock);
+    if (rc) { return rc; }
+    rc=index->WriteNode(levels[level].node,block);
+    if (rc) { return rc; }
+    KEY_T prevlowkey=levels[level].prevlowkey;
+    KEY_T lowkey=levels[level].lowkey;
+    SIZE_T prevblock=levels[level].prevblock;
+    rc=AddChild(level+1,prevlowkey,prevblock);
+    if (rc) { return rc; }
+    rc=AddChild(level+1,lowkey,block);
+    if (rc) { return rc; }
+  }
+  levels.clear();
+
+  index->superblock.info.numkeys+=count;
+  index->superblockdirty=true;
+  // the nodes were written before anyone knew how deep they are
+  return index->FillHot();
+}
+
+
+//
+// Go down from the root to the leaf where key belongs, latch it and
+// read it into node.  The interior nodes on the way come from the
+// hot tier if they are in it.  path gets the blocks on the way and
+// slots which child of each the next one is (slots[i] is which child
+// of path[i] path[i+1] is).  In an empty index node is left as the
+// root, which is not a leaf.
+//
+// Only a writer holding smolock changes interior nodes, so with it
+// held, only the node at the end can change under us, until we have
+// its latch.
+//
+ERROR_T BTreeIndex::FindLeaf(const KEY_T &key, vector<SIZE_T> &path,
+			     vector<SIZE_T> &slots, BTreeNode &node)
+{
+  SIZE_T n=superblock.info.rootnode;
+  SIZE_T offset;
+  VERSION_T version;
+  ERROR_T rc;
+
+  while (1) {
+    rc=ReadNode(n,node,version);
+    if (rc) { return rc; }
+    path.push_back(n);
+    if (node.info.nodetype==BTREE_LEAF_NODE ||
+	((node.info.nodetype==BTREE_ROOT_NODE || node.info.nodetype==BTREE_INTERIOR_NODE) &&
+	 node.info.numkeys==0)) {
+      Latch(n);
+      return node.Unserialize(buffercache,n);
+    }
+    if (node.info.nodetype!=BTREE_ROOT_NODE &&
+	node.info.nodetype!=BTREE_INTERIOR_NODE) {
+      return ERROR_INSANE;
+    }
+    offset=node.UpperBound(key);
+    slots.push_back(offset);
+    rc=node.GetPtr(offset,n);
+    if (rc) { return rc; }
+  }
+}
+
+
+ERROR_T BTreeIndex::ChangeTree(const BTreeOp op, const KEY_T &key, const VALUE_T &value)
+{
+  vector<SIZE_T> path;
+  vector<SIZE_T> slots;
+  BTreeNode node;
+  SIZE_T offset;
+  bool found;
+  ERROR_T rc;
+
+  rc=FindLeaf(key,path,slots,node);
+  if (rc) { return rc; }
+
+  if (node.info.nodetype!=BTREE_LEAF_NODE) {
+    if (op!=BTREE_OP_INSERT) {
+      return ERROR_NONEXISTENT;
+    }
+    // the first key makes the root a leaf
+    node=BTreeNode(BTREE_LEAF_NODE,
+		   superblock.info.keysize,
+		   superblock.info.valuesize,
+		   superblock.info.blocksize,
+		   superblock.info.keytype);
+    offset=0;
+    found=false;
+  } else {
+    offset=node.LowerBound(key);
+    found=offset<node.info.numkeys && node.CompareKey(offset,key)==0;
+  }
+  if (op==BTREE_OP_INSERT ? found : !found) {
+    return op==BTREE_OP_INSERT ? ERROR_INSERT : ERROR_NONEXISTENT;
+  }
+
+  switch (op) {
+  case BTREE_OP_INSERT:
+    rc=node.InsertKeyVal(offset,key,value);
+    if (rc) { return rc; }
+    rc=FixOverflow(path,slots,node);
+    if (rc) { return rc; }
+    CountKeys(1);
+    return ERROR_NOERROR;
+    break;
+  case BTREE_OP_UPDATE:
+    // A value of another length changes how full the leaf is, so it
+    // may have to be split or rebalanced afterward
+    rc=node.SetVal(offset,value);
+    if (rc) { return rc; }
+    if (node.IsOverfull()) {
+      return FixOverflow(path,slots,node);
+    }
+    return FixUnderflow(path,slots,node);
+    break;
+  case BTREE_OP_DELETE:
+    rc=node.RemoveEntry(offset);
+    if (rc) { return rc; }
+    rc=FixUnderflow(path,slots,node);
+    if (rc) { return rc; }
+    CountKeys(-1);
+    return ERROR_NOERROR;
+    break;
+  default:
+    return ERROR_INSANE;
+    break;
+  }
+}
+
+
+ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
+{
+  bool done;
+  ERROR_T rc;
+
+  if (!superblock.info.IsKeySize(key.length) ||
+      !superblock.info.IsValueSize(value.length)) {
+    return ERROR_SIZE;
+  }
+
+  rc=ChangeLeaf(BTREE_OP_INSERT,key,value,done);
+  if (rc || done) { return rc; }
+
+  // The leaf has to be split, or the index is empty
+  MutexHolder l(&smolock);
+  rc=ChangeTree(BTREE_OP_INSERT,key,value);
+  UnlatchAll();
+  return rc;
+}
+
+
+//
+// Split node (the last one on path) if it is overfull, and write it.
+// The right half goes to a new block, and the key that separates
+// the halves goes up into the parent, which may overflow in turn.
+//
+// The root never moves, so when it splits both halves go to new
+// blocks and the root gets just the key between them, which makes
+// the tree one level taller.  Otherwise the left half stays where
+// the node was, so that the link from the leaf before it stays good.
+//
+// Every level is split in memory and every new block allocated
+// before anything is written, so if the disk is full the tree is
+// left as it was and the blocks go back to the allocator.
+//
+ERROR_T BTreeIndex::FixOverflow(vector<SIZE_T> &path, vector<SIZE_T> &slots, BTreeNode &node)
+{
+  ERROR_T rc;
+  vector<SIZE_T> allocated;
+  vector<BTreeNode> nodes;
+  vector<SIZE_T> blocks;
+  vector<SIZE_T> depths;
+  bool grew=false;
+  SIZE_T i;
+
+  while (1) {
+    SIZE_T n=path.back();
+
+    if (!node.IsOverfull()) {
+      nodes.push_back(node);
+      blocks.push_back(n);
+      depths.push_back(path.size()-1);
+      break;
+    }
+
+    BTreeNode right;
+    KEY_T sep;
+    SIZE_T leftblock;
+    SIZE_T rightblock;
+    SIZE_T next;
+    bool leaf=node.info.nodetype==BTREE_LEAF_NODE;
+
+    if (leaf) {
+      rc=node.GetPtr(0,next);
+      if (rc) { return AbandonNodes(allocated,rc); }
+    }
+    rc=SplitNode(node,right,sep);
+    if (rc) { return AbandonNodes(allocated,rc); }
+
+    if (path.size()==1) {
+      rc=AllocateNode(leftblock);
+      if (rc) { return AbandonNodes(allocated,rc); }
+      allocated.push_back(leftblock);
+      Latch(leftblock);
+    } else {
+      leftblock=n;
+    }
+    rc=AllocateNode(rightblock);
+    if (rc) { return AbandonNodes(allocated,rc); }
+    allocated.push_back(rightblock);
+    Latch(rightblock);
+
+    if (leaf) {
+      // left -> right -> whatever followed the old leaf
+      rc=node.SetPtr(0,rightblock);
+      if (rc) { return AbandonNodes(allocated,rc); }
+      rc=right.SetPtr(0,next);
+      if (rc) { return AbandonNodes(allocated,rc); }
+    }
+    nodes.push_back(node);
+    blocks.push_back(leftblock);
+    depths.push_back(path.size()-1);
+    nodes.push_back(right);
+    blocks.push_back(rightblock);
+    depths.push_back(path.size()-1);
+
+    if (path.size()==1) {
+      BTreeNode root(BTREE_INTERIOR_NODE,
+		     superblock.info.keysize,
+		     superblock.info.valuesize,
+		     superblock.info.blocksize,
+		     superblock.info.keytype);
+      rc=root.SetPtr(0,leftblock);
+      if (rc) { return AbandonNodes(allocated,rc); }
+      rc=root.InsertKeyPtr(0,sep,rightblock);
+      if (rc) { return AbandonNodes(allocated,rc); }
+      nodes.push_back(root);
+      blocks.push_back(n);
+      depths.push_back(0);
+      grew=true;
+      break;
+    }
+
+    path.pop_back();
+    SIZE_T slot=slots.back();
+    slots.pop_back();
+
+    BTreeNode parent;
+    Latch(path.back());
+    rc=parent.Unserialize(buffercache,path.back());
+    if (rc) { return AbandonNodes(allocated,rc); }
+    rc=parent.InsertKeyPtr(slot,sep,rightblock);
+    if (rc) { return AbandonNodes(allocated,rc); }
+
+    node=parent;
+  }
+
+  if (grew) {
+    // the root split, so everything else is a level further down.
+    // The hot copies are moved first, so that those the writes add
+    // are made at the depth they end up at.
+    ShiftHot(path.back(),1);
+    for (i=0;i+1<nodes.size();i++) {
+      depths[i]++;
+    }
+  }
+  // children before their parents, as before
+  for (i=0;i<nodes.size();i++) {
+    rc=WriteNode(nodes[i],blocks[i],depths[i]);
+    if (rc) { return rc; }
+  }
+  return ERROR_NOERROR;
+}
+
+
+// Give back blocks that FixOverflow allocated but never wrote, and
+// pass on the error that stopped it
+ERROR_T BTreeIndex::AbandonNodes(const vector<SIZE_T> &blocks, const ERROR_T rc)
+{
+  for (SIZE_T i=0;i<blocks.size();i++) {
+    FreeNode(blocks[i]);
+  }
+  return rc;
+}
+
+
+//
+// Move the entries of node from its split point on to right, a new
+// node of the same kind.  For a leaf, sep is then the first key of
+// right (or with variable length keys, as little of it as will do).
+// For an interior node, the key at the split point comes out, with
+// the pointer after it becoming right's first, and is sep.
+//
+ERROR_T BTreeIndex::SplitNode(BTreeNode &node, BTreeNode &right, KEY_T &sep)
+{
+  ERROR_T rc;
+  KEY_T tempKey;
+  VALUE_T tempVal;
+  SIZE_T tempPtr;
+  SIZE_T half=node.SplitPoint();
+  SIZE_T i;
+  int type = node.info.nodetype==BTREE_LEAF_NODE ? BTREE_LEAF_NODE : BTREE_INTERIOR_NODE;
+  BTreeNode left(type,
+		 superblock.info.keysize,
+		 superblock.info.valuesize,
+		 superblock.info.blocksize,
+		 superblock.info.keytype);
+
+  right=left;
+
+  if (type==BTREE_LEAF_NODE) {
+    for (i=0;i<node.info.numkeys;i++) {
+      BTreeNode &to = i<half ? left : right;
+      rc=node.GetKey(i,tempKey);
+      if (rc) { return rc; }
+      rc=node.GetVal(i,tempVal);
+      if (rc) { return rc; }
+      rc=to.InsertKeyVal(to.info.numkeys,tempKey,tempVal);
+      if (rc) { return rc; }
+    }
+    rc=right.GetKey(0,sep);
+    if (rc) { return rc; }
+    if (superblock.info.keytype==BTREE_KEY_VARIABLE) {
+      rc=left.GetKey(left.info.numkeys-1,tempKey);
+      if (rc) { return rc; }
+      Separate(tempKey,sep,sep);
+    }
+  } else {
+    if (superblock.info.keytype==BTREE_KEY_VARIABLE) {
+      // The halves start off with node's prefix, so that they are
+      // sure to fit, and then get their own
+      rc=node.GetPrefix(tempKey);
+      if (rc) { return rc; }
+      rc=left.SetPrefix(tempKey);
+      if (rc) { return rc; }
+      rc=right.SetPrefix(tempKey);
+      if (rc) { return rc; }
+    }
+    rc=node.GetPtr(0,tempPtr);
+    if (rc) { return rc; }
+    rc=left.SetPtr(0,tempPtr);
+    if (rc) { return rc; }
+    rc=node.GetPtr(half+1,tempPtr);
+    if (rc) { return rc; }
+    rc=right.SetPtr(0,tempPtr);
+    if (rc) { return rc; }
+    for (i=0;i<node.info.numkeys;i++) {
+      rc=node.GetKey(i,tempKey);
+      if (rc) { return rc; }
+      if (i==half) {
+	sep=tempKey;
+	continue;
+      }
+      BTreeNode &to = i<half ? left : right;
+      rc=node.GetPtr(i+1,tempPtr);
+      if (rc) { return rc; }
+      rc=to.InsertKeyPtr(to.info.numkeys,tempKey,tempPtr);
+      if (rc) { return rc; }
+    }
+    if (superblock.info.keytype==BTREE_KEY_VARIABLE) {
+      rc=left.Rebase();
+      if (rc) { return rc; }
+      rc=right.Rebase();
+      if (rc) { return rc; }
+    }
+  }
+
+  node=left;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
+{
+  bool done;
+  ERROR_T rc;
+
+  if (!superblock.info.IsKeySize(key.length) ||
+      !superblock.info.IsValueSize(value.length)) {
+    return ERROR_SIZE;
+  }
+
+  rc=ChangeLeaf(BTREE_OP_UPDATE,key,value,done);
+  if (rc || done) { return rc; }
+
+  // Only with variable length values, which can change how full
+  // the leaf is
+  MutexHolder l(&smolock);
+  rc=ChangeTree(BTREE_OP_UPDATE,key,value);
+  UnlatchAll();
+  return rc;
+}
 
 
 ERROR_T BTreeIndex::Delete(const KEY_T &key)
 {
-  // This is optional extra credit
-  //
-  //
-  return ERROR_UNIMPL;
+  bool done;
+  ERROR_T rc;
+
+  if (!superblock.info.IsKeySize(key.length)) {
+    return ERROR_SIZE;
+  }
+
+  rc=ChangeLeaf(BTREE_OP_DELETE,key,VALUE_T(),done);
+  if (rc || done) { return rc; }
+
+  // The leaf has to borrow or merge, or the index is now empty
+  MutexHolder l(&smolock);
+  rc=ChangeTree(BTREE_OP_DELETE,key,VALUE_T());
+  UnlatchAll();
+  return rc;
+}
+
+
+//
+// Move entries into node (the last one on path) from a sibling if
+// node has fallen below the minimum, or if the sibling can't spare
+// one, merge the two, which takes a key out of the parent, and
+// carry on with the parent.  Separators in the parent are left as
+// they are otherwise - one that no longer matches a key still
+// divides the keys correctly.
+//
+// With fixed size keys one entry is always enough.  With variable
+// length keys it may take several, and the parent's separator may
+// change length, which can leave the parent overfull (and so split
+// it) or underfull (and so carry on with it).
+//
+// The root is allowed to get as small as it likes, but once an
+// interior root is down to one child, that child is moved into
+// the root block (the root never moves) so the tree gets shorter.
+//
+ERROR_T BTreeIndex::FixUnderflow(vector<SIZE_T> &path, vector<SIZE_T> &slots, BTreeNode &node)
+{
+  ERROR_T rc;
+
+  while (1) {
+    SIZE_T n=path.back();
+    bool leaf=node.info.nodetype==BTREE_LEAF_NODE;
+
+    if (path.size()==1) {
+      if (leaf && node.info.numkeys==0) {
+	// back to how Attach makes an empty index
+	BTreeNode emptyroot(BTREE_ROOT_NODE,
+			    superblock.info.keysize,
+			    superblock.info.valuesize,
+			    superblock.info.blocksize,
+			    superblock.info.keytype);
+	emptyroot.info.rootnode=n;
+	return WriteNode(emptyroot,n,0);
+      }
+      if (!leaf && node.info.numkeys==0) {
+	SIZE_T child;
+	BTreeNode childnode;
+	rc=node.GetPtr(0,child);
+	if (rc) { return rc; }
+	Latch(child);
+	rc=childnode.Unserialize(buffercache,child);
+	if (rc) { return rc; }
+	rc=WriteNode(childnode,n,0);
+	if (rc) { return rc; }
+	rc=DeallocateNode(child);
+	if (rc) { return rc; }
+	// everything is a level further up, and the level that comes
+	// into the top hotlevels needs copies
+	ShiftHot(n,-1);
+	return FillHot();
+      }
+      return WriteNode(node,n,0);
+    }
+
+    if (!node.IsUnderfull()) {
+      return WriteNode(node,n,path.size()-1);
+    }
+
+    path.pop_back();
+    SIZE_T slot=slots.back();
+    slots.pop_back();
+
+    BTreeNode parent;
+    Latch(path.back());
+    rc=parent.Unserialize(buffercache,path.back());
+    if (rc) { return rc; }
+
+    // Use the sibling to the left if there is one, else the one to
+    // the right.  Then left and right are the two in key order,
+    // and sep is the key in parent between them.
+    SIZE_T sibslot = slot>0 ? slot-1 : slot+1;
+    SIZE_T sibblock;
+    BTreeNode sibling;
+    rc=parent.GetPtr(sibslot,sibblock);
+    if (rc) { return rc; }
+    Latch(sibblock);
+    rc=sibling.Unserialize(buffercache,sibblock);
+    if (rc) { return rc; }
+
+    BTreeNode &left = slot>0 ? sibling : node;
+    BTreeNode &right = slot>0 ? node : sibling;
+    SIZE_T leftblock = slot>0 ? sibblock : n;
+    SIZE_T rightblock = slot>0 ? n : sibblock;
+    SIZE_T sepslot = slot>0 ? slot-1 : slot;
+    KEY_T sep;
+    bool merge=false;
+
+    rc=parent.GetKey(sepslot,sep);
+    if (rc) { return rc; }
+
+    while (node.IsUnderfull()) {
+      // the entry the sibling would give up is the one next to node
+      if (!sibling.CanLend(slot>0 ? sibling.info.numkeys-1 : 0)) {
+	merge=true;
+	break;
+      }
+      rc = slot>0 ? BorrowFromLeft(sep,left,right) : BorrowFromRight(sep,left,right);
+      if (rc) { return rc; }
+    }
+
+    if (!merge) {
+      rc=parent.SetKey(sepslot,sep);
+      if (rc) { return rc; }
+      rc=WriteNode(left,leftblock,path.size());
+      if (rc) { return rc; }
+      rc=WriteNode(right,rightblock,path.size());
+      if (rc) { return rc; }
+      node=parent;
+      if (node.IsOverfull()) {
+	return FixOverflow(path,slots,node);
+      }
+      continue;
+    }
+
+    rc=MergeNodes(sep,left,right);
+    if (rc) { return rc; }
+    rc=parent.RemoveEntry(sepslot);
+    if (rc) { return rc; }
+    rc=WriteNode(left,leftblock,path.size());
+    if (rc) { return rc; }
+    rc=DeallocateNode(rightblock);
+    if (rc) { return rc; }
+
+    // the parent may now be short itself
+    node=parent;
+  }
+}
+
+
+// Move the last entry of left to the front of right.  sep is the
+// key between them, before and after.
+ERROR_T BTreeIndex::BorrowFromLeft(KEY_T &sep, BTreeNode &left, BTreeNode &right)
+{
+  ERROR_T rc;
+  KEY_T tempKey;
+  VALUE_T tempVal;
+  SIZE_T tempPtr;
+  SIZE_T first;
+  SIZE_T last=left.info.numkeys-1;
+
+  if (right.info.nodetype==BTREE_LEAF_NODE) {
+    rc=left.GetKey(last,tempKey);
+    if (rc) { return rc; }
+    rc=left.GetVal(last,tempVal);
+    if (rc) { return rc; }
+    rc=left.RemoveEntry(last);
+    if (rc) { return rc; }
+    rc=right.InsertKeyVal(0,tempKey,tempVal);
+    if (rc) { return rc; }
+    // the new first key of right is the new separator
+    sep=tempKey;
+    if (right.info.keytype==BTREE_KEY_VARIABLE && left.info.numkeys>0) {
+      rc=left.GetKey(left.info.numkeys-1,tempKey);
+      if (rc) { return rc; }
+      Separate(tempKey,sep,sep);
+    }
+    return ERROR_NOERROR;
+  }
+
+  // The separator comes down in front of right's keys, along with
+  // left's last child, and left's last key goes up in its place
+  rc=left.GetPtr(last+1,tempPtr);
+  if (rc) { return rc; }
+  rc=right.GetPtr(0,first);
+  if (rc) { return rc; }
+  rc=right.InsertKeyPtr(0,sep,first);
+  if (rc) { return rc; }
+  rc=right.SetPtr(0,tempPtr);
+  if (rc) { return rc; }
+  rc=left.GetKey(last,sep);
+  if (rc) { return rc; }
+  return left.RemoveEntry(last);
+}
+
+
+// Move the first entry of right to the end of left
+ERROR_T BTreeIndex::BorrowFromRight(KEY_T &sep, BTreeNode &left, BTreeNode &right)
+{
+  ERROR_T rc;
+  KEY_T tempKey;
+  VALUE_T tempVal;
+  SIZE_T tempPtr;
+
+  if (left.info.nodetype==BTREE_LEAF_NODE) {
+    rc=right.GetKey(0,tempKey);
+    if (rc) { return rc; }
+    rc=right.GetVal(0,tempVal);
+    if (rc) { return rc; }
+    rc=left.InsertKeyVal(left.info.numkeys,tempKey,tempVal);
+    if (rc) { return rc; }
+    rc=right.RemoveEntry(0);
+    if (rc) { return rc; }
+    rc=right.GetKey(0,sep);
+    if (rc) { return rc; }
+    if (left.info.keytype==BTREE_KEY_VARIABLE) {
+      Separate(tempKey,sep,sep);
+    }
+    return ERROR_NOERROR;
+  }
+
+  // The separator comes down after left's keys, along with right's
+  // first child, and right's first key goes up in its place
+  rc=right.GetPtr(0,tempPtr);
+  if (rc) { return rc; }
+  rc=left.InsertKeyPtr(left.info.numkeys,sep,tempPtr);
+  if (rc) { return rc; }
+  rc=right.GetKey(0,sep);
+  if (rc) { return rc; }
+  rc=right.GetPtr(1,tempPtr);
+  if (rc) { return rc; }
+  rc=right.RemoveEntry(0);
+  if (rc) { return rc; }
+  return right.SetPtr(0,tempPtr);
+}
+
+
+// Append sep (interior nodes only) and everything in right to left.
+// right's block is then unused, and the caller takes sep and the
+// pointer to right out of the parent.
+ERROR_T BTreeIndex::MergeNodes(const KEY_T &sep, BTreeNode &left, BTreeNode &right)
+{
+  ERROR_T rc;
+  KEY_T tempKey;
+  VALUE_T tempVal;
+  SIZE_T tempPtr;
+  SIZE_T i;
+
+  if (left.info.nodetype==BTREE_LEAF_NODE) {
+    for (i=0;i<right.info.numkeys;i++) {
+      rc=right.GetKey(i,tempKey);
+      if (rc) { return rc; }
+      rc=right.GetVal(i,tempVal);
+      if (rc) { return rc; }
+      rc=left.InsertKeyVal(left.info.numkeys,tempKey,tempVal);
+      if (rc) { return rc; }
+    }
+    // right drops out of the chain of leaves
+    rc=right.GetPtr(0,tempPtr);
+    if (rc) { return rc; }
+    return left.SetPtr(0,tempPtr);
+  }
+
+  // The merged node is sure to fit with no prefix, whatever the two
+  // had, and then gets one of its own
+  if (left.info.keytype==BTREE_KEY_VARIABLE) {
+    rc=left.SetPrefix(KEY_T());
+    if (rc) { return rc; }
+  }
+  rc=right.GetPtr(0,tempPtr);
+  if (rc) { return rc; }
+  rc=left.InsertKeyPtr(left.info.numkeys,sep,tempPtr);
+  if (rc) { return rc; }
+  for (i=0;i<right.info.numkeys;i++) {
+    rc=right.GetKey(i,tempKey);
+    if (rc) { return rc; }
+    rc=right.GetPtr(i+1,tempPtr);
+    if (rc) { return rc; }
+    rc=left.InsertKeyPtr(left.info.numkeys,tempKey,tempPtr);
+    if (rc) { return rc; }
+  }
+  if (left.info.keytype==BTREE_KEY_VARIABLE) {
+    return left.Rebase();
+  }
+  return ERROR_NOERROR;
+}
+
+
+// How many children ahead of the current one a traversal asks for
+#define DISPLAY_PREFETCH_WINDOW 16
+
+//
+// Ask the cache to start reading children first..first+count-1
+// of an interior node.  They are requested in block order so the
+// disk can stream them rather than seek around in key order.  The
+// cache declines prefetches once it has enough in flight, which is
+// not an error.
+//
+ERROR_T BTreeIndex::PrefetchChildren(const BTreeNode &b,
+				     const SIZE_T first,
+				     const SIZE_T count) const
+{
+  vector<SIZE_T> children;
+  SIZE_T ptr;
+  ERROR_T rc;
+
+  for (SIZE_T offset=first;offset<=b.info.numkeys && offset<first+count;offset++) {
+    rc=b.GetPtr(offset,ptr);
+    if (rc) { return rc; }
+    children.push_back(ptr);
+  }
+  return PrefetchBlocks(children);
+}
+
+
+// Ask the cache to start reading blocks, as one batch that the
+// disk's scheduler puts in order
+ERROR_T BTreeIndex::PrefetchBlocks(const vector<SIZE_T> &blocks) const
+{
+  buffercache->PrefetchBlocks(blocks);
+  return ERROR_NOERROR;
 }
 
 
@@ -747,7 +2147,7 @@ ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
   ERROR_T rc;
   SIZE_T offset;
 
-  rc= b.Unserialize(buffercache,node);
+  rc= b.Pin(buffercache,node);
 
   if (rc!=ERROR_NOERROR) {
     return rc;
@@ -770,6 +2170,10 @@ ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
   case BTREE_INTERIOR_NODE:
     if (b.info.numkeys>0) {
       for (offset=0;offset<=b.info.numkeys;offset++) {
+	if (offset%DISPLAY_PREFETCH_WINDOW==0) {
+	  rc=PrefetchChildren(b,offset,DISPLAY_PREFETCH_WINDOW);
+	  if (rc) { return rc; }
+	}
 	rc=b.GetPtr(offset,ptr);
 	if (rc) { return rc; }
 	if (display_type==BTREE_DEPTH_DOT) {
@@ -815,107 +2219,124 @@ ERROR_T BTreeIndex::Display(ostream &o, BTreeDisplayType display_type) const
 // the tree is integreted
 ERROR_T BTreeIndex::SanityCheck() const
 {
-	SIZE_T totalKeys = 0;
-  ERROR_T errorCode = SanityTraverse(superblock.info.rootnode, totalKeys);
-  if (totalKeys != superblock.info.numkeys) 
-  {
+  SIZE_T totalKeys=0;
+  SIZE_T leafDepth=0;
+  SIZE_T nextLeaf=0;
+  ERROR_T rc;
+
+  rc=SanityTraverse(superblock.info.rootnode,0,0,1,totalKeys,leafDepth,nextLeaf);
+  if (rc) {
+    return rc;
+  }
+  if (nextLeaf!=0) {
+    cout << "The last leaf links to "<<nextLeaf<<"."<<endl;
+    return ERROR_INSANE;
+  }
+  if (totalKeys!=superblock.info.numkeys) {
+    cout << "The tree has "<<totalKeys<<" keys, but the superblock says "
+	 <<superblock.info.numkeys<<"."<<endl;
+    return ERROR_INSANE;
+  }
+  return ERROR_NOERROR;
+}
+
+
+//
+// Every key under node must be at least *lo and less than *hi (no
+// bound if 0).  The leaves are visited in order, so each one must be
+// the one the leaf before it links to (nextLeaf), and all must be at
+// the same depth.  Every node but the root must be at least as full
+// as Delete keeps it.
+//
+ERROR_T BTreeIndex::SanityTraverse(const SIZE_T &node, const KEY_T *lo, const KEY_T *hi,
+				   const SIZE_T depth, SIZE_T &totalKeys,
+				   SIZE_T &leafDepth, SIZE_T &nextLeaf) const
+{
+  ERROR_T rc;
+  BTreeNode b;
+  SIZE_T offset;
+  SIZE_T ptr;
+  KEY_T key;
+  KEY_T prevkey;
+  bool root = node==superblock.info.rootnode;
+
+  rc=b.Pin(buffercache,node);
+  if (rc) { return rc; }
+
+  switch (b.info.nodetype) {
+  case BTREE_ROOT_NODE:
+    // only an empty index has one of these
+    if (!root || b.info.numkeys!=0) {
+      cout << "Node "<<node<<" is an empty root in the wrong place."<<endl;
+      return ERROR_INSANE;
+    }
+    return ERROR_NOERROR;
+  case BTREE_INTERIOR_NODE:
+  case BTREE_LEAF_NODE:
+    if ((root ? b.info.numkeys<1 : b.IsUnderfull()) || b.IsOverfull()) {
+      cout << (b.info.nodetype==BTREE_LEAF_NODE ? "Leaf " : "Interior node ")
+	   << node<<" has "<<b.info.numkeys<<" keys";
+      if (b.info.keytype==BTREE_KEY_VARIABLE) {
+	cout << " in "<<b.GetUsedBytes()<<" bytes";
+      }
+      cout << "."<<endl;
+      return ERROR_INSANE;
+    }
+    break;
+  default:
+    cout << "Node "<<node<<" is not part of a tree."<<endl;
+    return ERROR_INSANE;
+  }
+
+  for (offset=0;offset<b.info.numkeys;offset++) {
+    rc=b.GetKey(offset,key);
+    if (rc) { return rc; }
+    if ((offset>0 && !(prevkey<key)) ||
+	(lo && key<*lo) ||
+	(hi && !(key<*hi))) {
+      cout << "The keys of node "<<node<<" are not in order."<<endl;
+      return ERROR_INSANE;
+    }
+    prevkey=key;
+  }
+
+  if (b.info.nodetype==BTREE_LEAF_NODE) {
+    if (leafDepth==0) {
+      leafDepth=depth;
+    } else if (depth!=leafDepth) {
+      cout << "Leaf "<<node<<" is at depth "<<depth<<", not "<<leafDepth<<"."<<endl;
+      return ERROR_INSANE;
+    } else if (nextLeaf!=node) {
+      cout << "Leaf "<<node<<" follows a leaf that links to "<<nextLeaf<<"."<<endl;
       return ERROR_INSANE;
+    }
+    rc=b.GetPtr(0,nextLeaf);
+    if (rc) { return rc; }
+    totalKeys+=b.info.numkeys;
+    return ERROR_NOERROR;
   }
-	return errorCode;
-}
-
-
-ERROR_T BTreeIndex::SanityTraverse(const SIZE_T &node, SIZE_T &totalKeys) const
-{
-		ERROR_T rc;
-		BTreeNode currentNode;
-		SIZE_T offset;
-		SIZE_T currentPtr;
-		KEY_T testkey;
-		KEY_T tempkey;
-		VALUE_T value;
-		
-		rc = currentNode.Unserialize(buffercache, node);
-		totalKeys = superblock.info.numkeys;
-		//cout<<"switch"<<endl;
-		switch(currentNode.info.nodetype){
-
-  		case BTREE_ROOT_NODE:
-  		case BTREE_INTERIOR_NODE:
-  		//cout<<"currentNode.numkeys: "<<currentNode.info.numkeys<<endl;
-  		for(offset = 0; offset < currentNode.info.numkeys; offset++)
-  		{
-    			rc = currentNode.GetKey(offset, testkey);
-    			//if(rc) {return rc;}
-					//cout<<"current offset is: "<<offset<<endl;
-    			if(offset + 1 < currentNode.info.numkeys - 1)
-    			{
-      				rc = currentNode.GetKey(offset + 1, tempkey);
-      				if(tempkey < testkey)
-      				{
-        					cout<<"The keys are not in order."<<endl;
-      				}
-      				//else
-      				//{
-      						//cout<<"The keys are stored in order"<<endl;
-      				//}
-    			}
-    			rc = currentNode.GetPtr(offset, currentPtr);
-    			//if(rc){return rc;}
-    			return SanityTraverse(currentPtr, totalKeys);
-  		}
-  		if(currentNode.info.numkeys > 0)
-  		{
-    			rc = currentNode.GetPtr(currentNode.info.numkeys, currentPtr);
-    			//if(rc) { return rc; }
-      		return SanityTraverse(currentPtr, totalKeys);
-  		}
-  		else
-  		{
-    			cout << "The keys is nonexistent."<<endl;
-    			return ERROR_NONEXISTENT;
-  		}
-  		break;
-  		case BTREE_LEAF_NODE:
-  		//cout<<"leaf node"<<endl;
-  		for(offset = 0; offset < currentNode.info.numkeys; offset++)
-  		{
-    			rc = currentNode.GetKey(offset, testkey);
-    			if(rc) 
-    			{
-      				cout << "missing key"<<endl;
-      				return rc;
-    			}
-    			//else
-    			//{
-    					//cout<<"no missing key"<<endl;
-    			//}
-    			rc = currentNode.GetVal(offset, value);
-    			if(rc)
-    			{
-      				cout << "missing value"<<endl;
-      				return rc;
-    			}
-    			//else
-    			//{
-    					//cout<<"no missing value"<<endl;
-    			//}
-    			if(offset + 1 < currentNode.info.numkeys)
-    			{
-      				rc = currentNode.GetKey(offset + 1, tempkey);
-      				if(tempkey < testkey)
-      				{
-        					cout<<"The keys are not in order."<<endl;
-      				}
-    			}
-  			}
-  			break;
-  			default:
-  				return ERROR_INSANE;
-  			break;
-			}
-			return ERROR_NOERROR;
-		}
+
+  // Child i has the keys between key i-1 and key i
+  for (offset=0;offset<=b.info.numkeys;offset++) {
+    KEY_T childlo, childhi;
+    if (offset>0) {
+      rc=b.GetKey(offset-1,childlo);
+      if (rc) { return rc; }
+    }
+    if (offset<b.info.numkeys) {
+      rc=b.GetKey(offset,childhi);
+      if (rc) { return rc; }
+    }
+    rc=b.GetPtr(offset,ptr);
+    if (rc) { return rc; }
+    rc=SanityTraverse(ptr,
+		      offset>0 ? &childlo : lo,
+		      offset<b.info.numkeys ? &childhi : hi,
+		      depth+1,totalKeys,leafDepth,nextLeaf);
+    if (rc) { return rc; }
+  }
+  return ERROR_NOERROR;
+}
 
 
 ostream & BTreeIndex::Print(ostream &os) const
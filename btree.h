@@ -3,6 +3,7 @@
 
 #include <iostream>
 #include <string>
+#include <atomic>
 
 #include "global.h"
 #include "block.h"
@@ -41,11 +42,188 @@ enum BTreeOp {BTREE_OP_INSERT, BTREE_OP_DELETE, BTREE_OP_UPDATE,BTREE_OP_LOOKUP}
 
 enum BTreeDisplayType {BTREE_DEPTH, BTREE_DEPTH_DOT, BTREE_SORTED_KEYVAL};
 
+
+//
+// A cursor over the key/value pairs of an index in key order,
+// positioned by BTreeIndex::Scan.  Going forward it follows the
+// leaves' sibling links, so a scan of k pairs reads O(log n + k/b)
+// blocks.  There are no links going backward, so instead the cursor
+// remembers the interior nodes above its leaf and climbs back up
+// through them to reach the previous leaf.
+//
+// The leaf the scan starts in is a copy, and each one after it stays
+// pinned in the buffer cache until the cursor moves off it or is
+// closed.  Changing the index while a scan is open leaves the
+// scan's results undefined.
+//
+class BTreeIndex;
+
+class BTreeScan {
+ private:
+  const BTreeIndex *index;
+  BufferCache   *buffercache;
+  BTreeNode      leaf;
+  SIZE_T         offset;     // next pair to return (backward: one past it)
+  KEY_T          lo;         // length 0 means no bound
+  KEY_T          hi;
+  bool           backward;
+  bool           done;
+  vector<SIZE_T> path;       // interior nodes above leaf (backward only)
+  vector<SIZE_T> child;      // which of their pointers leads to leaf
+
+  ERROR_T Descend(SIZE_T node, const bool bounded);
+  ERROR_T NextLeaf();
+  ERROR_T PrevLeaf();
+
+  friend class BTreeIndex;
+
+ public:
+  BTreeScan();
+
+  // return zero on success
+  // return ERROR_NONEXISTENT once the scan is past its bound or the
+  // end of the index
+  ERROR_T Next(KEY_T &key, VALUE_T &value);
+
+  // Unpin the current leaf, after which Next returns ERROR_NONEXISTENT
+  void Close();
+};
+
+//
+// Builds an index bottom up from pairs that arrive in increasing
+// key order, positioned by BTreeIndex::BeginBulkLoad.  Each level of
+// the tree has one node being filled.  When it has as many entries
+// as the fill factor allows, it gets the next free block and its
+// first key and block go up to the level above.  So nodes are never
+// split, and blocks are handed out in the order the nodes are built.
+//
+// Each level keeps the node before the one being filled in memory
+// until the next one is started, so that leaves can be linked to
+// their right siblings and, at the end, the last two nodes of a
+// level can share out or merge their entries if the last one came
+// up short.
+//
+class BTreeBulkLoader {
+ private:
+  struct Level {
+    BTreeNode node;      // being filled
+    KEY_T     lowkey;    // first key under node
+    bool      empty;     // nothing in node yet
+    BTreeNode prev;      // full, waiting to be written
+    KEY_T     prevlowkey;
+    SIZE_T    prevblock;
+    bool      hasprev;
+  };
+
+  BTreeIndex   *index;
+  SIZE_T        leafcap;      // pairs per leaf (bytes with variable length keys)
+  SIZE_T        interiorcap;  // keys per interior node (likewise)
+  vector<Level> levels;       // levels[0] are the leaves
+  KEY_T         lastkey;
+  SIZE_T        count;
+  bool          active;
+
+  BTreeNode NewNode(const SIZE_T level) const;
+  ERROR_T   Complete(const SIZE_T level);
+  ERROR_T   AddChild(const SIZE_T level, const KEY_T &lowkey, const SIZE_T block);
+  ERROR_T   Rebalance(const SIZE_T level, bool &merged);
+  // Whether node is at cap, or with variable length keys, whether an
+  // entry of bytes more would take it past cap
+  bool      Full(const BTreeNode &node, const SIZE_T cap, const SIZE_T bytes) const;
+
+  friend class BTreeIndex;
+
+ public:
+  BTreeBulkLoader();
+
+  // return zero on success
+  // return ERROR_SIZE if the key or value are the wrong size for this index
+  // return ERROR_CONFLICT if the key is not greater than the last one
+  // return ERROR_NOSPACE if you run out of disk space
+  ERROR_T Add(const KEY_T &key, const VALUE_T &value);
+
+  // Write out everything that's left and make the result the index
+  ERROR_T Finish();
+};
+
+
+// How many levels at the top of the tree BTreeIndex keeps in its
+// hot tier unless told otherwise (see SetHotLevels).  This many
+// means every level above the leaves, however tall the tree gets,
+// which costs about one block in memory per fan-out leaves.
+#define BTREE_HOT_LEVELS ((SIZE_T)-1)
+
+typedef unsigned long long VERSION_T;
+
+//
+// Each block of an index has one of these while it is attached.
+//
+// version is a latch for optimistic lock coupling.  Its low bit is
+// set while a writer has the block, and it goes up by two each time
+// the writer lets go, so a reader that sees the same even version
+// before and after copying the node has all of one version of it.
+// Readers never write it, so they don't get in each other's way.
+//
+// hot is the hot tier's copy of the node, if it has one.  Copies
+// are only made by writers and when the tree is attached, so
+// readers don't write this either.  Writers bring it up to date in
+// place while they have the latch, rather than freeing it, so a
+// reader copying it never finds it gone.  It is dropped, but not
+// freed, when the block stops being an interior node or falls below
+// the top hotlevels levels.
+//
+struct NodeLatch {
+  atomic<VERSION_T>   version;
+  atomic<BTreeNode *> hot;
+
+  NodeLatch() : version(0), hot(0) {}
+};
+
+// Latches are made this many blocks at a time, as the allocator's
+// high water mark reaches them, so that attaching to a big disk
+// costs only as much as the index has used of it
+#define BTREE_LATCH_CHUNK 4096
+
 class BTreeIndex {
  private:
   BufferCache *buffercache;
   SIZE_T       superblock_index;
   BTreeNode    superblock;
+  // The copy in memory is the real one.  It is only written back
+  // by Detach and Checkpoint, and only if it has changed.
+  bool         superblockdirty;
+  // Guards superblock, which writers share
+  mutable pthread_mutex_t superlock;
+  // The hot tier: our own copies of the interior nodes in the top
+  // hotlevels levels (see NodeLatch), made when the tree is attached
+  // and whenever a writer writes such a node that has none.  They
+  // don't take up room in the buffer cache, so scans and misses on
+  // leaves can't push them out.
+  SIZE_T       hotlevels;
+  // One NodeLatch per block below the high water mark.  There is a
+  // slot for every BTREE_LATCH_CHUNK blocks of the disk, and a chunk
+  // once made never moves, so readers find latches without a lock.
+  // Chunks are only added by Attach and AllocateNode.
+  atomic<NodeLatch *> *latchchunks;
+  SIZE_T       numlatchchunks;
+  // The blocks that have a hot copy and how far below the root each
+  // was, so that DropHot need not look at every block and a root
+  // split can find the ones that fall out of the top hotlevels.
+  // hotspare are copies that have been dropped, kept to be used
+  // again, since a reader may still be copying one.  hotlock guards
+  // all three.  Readers never touch them.
+  mutable vector<SIZE_T> hotblocks;
+  mutable vector<SIZE_T> hotdepths;
+  mutable vector<BTreeNode *> hotspare;
+  mutable pthread_mutex_t hotlock;
+  // A writer that has to split, merge or borrow holds smolock, so
+  // only one of them at a time changes interior nodes.  smolatched
+  // are the latches it has, which it keeps until it is done.
+  pthread_mutex_t smolock;
+  vector<SIZE_T>  smolatched;
+
+  friend class BTreeBulkLoader;
+  friend class BTreeScan;
 
  protected:
 
@@ -53,17 +231,129 @@ class BTreeIndex {
 
   ERROR_T      DeallocateNode(const SIZE_T &node);
 
-  ERROR_T      LookupOrUpdateInternal(const SIZE_T &Node,
-				      const BTreeOp op, 
-				      const KEY_T &key,
-				      VALUE_T &val,
-				      vector<SIZE_T> &pointer);
+  // The latch of block n, which must be below the high water mark
+  NodeLatch   &LatchOf(const SIZE_T n) const { return latchchunks[n/BTREE_LATCH_CHUNK].load(memory_order_acquire)[n%BTREE_LATCH_CHUNK]; }
+  // Make sure blocks below highwater have latches
+  void         GrowLatches(const SIZE_T highwater);
+  void         FreeLatches();
+  // Put a block on the free list without looking at what is in it
+  ERROR_T      FreeNode(const SIZE_T &node);
+
+  // Optimistic lock coupling on the latch of block n (see NodeLatch).
+  // ReadLatch waits out any writer and gives the version, and
+  // CheckLatch says whether it is still that version.  TryLatch
+  // takes the latch if it is still at version, and Latch waits for
+  // it.  Only a writer holding smolock waits, and it keeps what it
+  // takes until UnlatchAll.
+  VERSION_T    ReadLatch(const SIZE_T n) const;
+  bool         CheckLatch(const SIZE_T n, const VERSION_T version) const;
+  bool         TryLatch(const SIZE_T n, const VERSION_T version) const;
+  void         Unlatch(const SIZE_T n) const;
+  void         Latch(const SIZE_T n);
+  void         UnlatchAll();
+
+  // Copy node n into b, from the hot tier if it is there, and set
+  // version to the version of it that was copied.  This writes
+  // nothing that other threads look at.
+  ERROR_T      ReadNode(const SIZE_T n, BTreeNode &b, VERSION_T &version) const;
+
+  // Every node of the tree is written through here, by a writer that
+  // has its latch, so that the hot tier is kept up to date.  depth
+  // is how far below the root n is, if the writer knows; an interior
+  // node in the top hotlevels levels gets a hot copy if it has none.
+  ERROR_T      WriteNode(const BTreeNode &b, const SIZE_T n,
+			 const SIZE_T depth=(SIZE_T)-1);
+
+  // Give block n, which holds b and is depth below the root, a hot
+  // copy.  The caller is a writer with smolock or the latch of n, or
+  // nothing else is using the index.
+  void         AddHotNode(const BTreeNode &b, const SIZE_T n, const SIZE_T depth);
+
+  // Give every interior node in the top hotlevels levels that has no
+  // hot copy one, reading them from the buffer cache.  Only while
+  // nothing can change the interior nodes: with smolock held, or
+  // when nothing else is using the index.
+  ERROR_T      FillHot();
+  ERROR_T      FillHot(const SIZE_T n, const SIZE_T depth, const SIZE_T leafdepth);
+
+  // Free the hot tier's copies, when nothing else is using the index
+  void         DropHot();
+
+  // Take block n out of the hot tier, by a writer that has its latch
+  void         DropHotNode(const SIZE_T n);
+
+  // The tree has grown or shrunk by levels at root, so every other
+  // hot copy is that much further down.  Those that are no longer in
+  // the top hotlevels are dropped, but none are added.  The caller
+  // has smolock.
+  void         ShiftHot(const SIZE_T root, const int levels);
+
+  // Add delta to the number of keys in the superblock
+  void         CountKeys(const int delta);
+
+  // Go down to the leaf where key belongs with optimistic lock
+  // coupling, and copy it into node, with its block in n and the
+  // version copied in version.  In an empty index node is the root,
+  // which is not a leaf.
+  ERROR_T      ReadLeaf(const KEY_T &key, SIZE_T &n, BTreeNode &node,
+			VERSION_T &version) const;
+
+  // Do op (insert, update or delete) to the leaf where key belongs,
+  // holding nothing but its latch, if it doesn't have to be split or
+  // rebalanced afterward.  done says whether it was.
+  ERROR_T      ChangeLeaf(const BTreeOp op, const KEY_T &key,
+			  const VALUE_T &value, bool &done);
 
   ERROR_T      LookupLeaf(const SIZE_T &Node,
 				      const BTreeOp op, 
 				      const KEY_T &key,
 				      VALUE_T &val, std::vector<SIZE_T> &pointerPath);
 				      
+  ERROR_T      PrefetchChildren(const BTreeNode &b,
+				    const SIZE_T first,
+				    const SIZE_T count) const;
+
+  ERROR_T      PrefetchBlocks(const vector<SIZE_T> &blocks) const;
+
+  // With smolock held
+  ERROR_T      FindLeaf(const KEY_T &key,
+			vector<SIZE_T> &path,
+			vector<SIZE_T> &slots,
+			BTreeNode &node);
+
+  // Do op to the leaf where key belongs and then split or rebalance
+  // whatever needs it, with smolock held
+  ERROR_T      ChangeTree(const BTreeOp op, const KEY_T &key,
+			  const VALUE_T &value);
+
+  ERROR_T      FixOverflow(vector<SIZE_T> &path,
+			   vector<SIZE_T> &slots,
+			   BTreeNode &node);
+  ERROR_T      AbandonNodes(const vector<SIZE_T> &blocks, const ERROR_T rc);
+
+  ERROR_T      SplitNode(BTreeNode &node, BTreeNode &right, KEY_T &sep);
+
+  ERROR_T      FixUnderflow(vector<SIZE_T> &path,
+			    vector<SIZE_T> &slots,
+			    BTreeNode &node);
+
+  ERROR_T      BorrowFromLeft(KEY_T &sep, BTreeNode &left, BTreeNode &right);
+
+  ERROR_T      BorrowFromRight(KEY_T &sep, BTreeNode &left, BTreeNode &right);
+
+  ERROR_T      MergeNodes(const KEY_T &sep, BTreeNode &left, BTreeNode &right);
+
+  ERROR_T      MultiLookupInternal(const SIZE_T &node,
+				       const SIZE_T depth,
+				       const SIZE_T parent,
+				       const VERSION_T parentversion,
+				       const vector<KEY_T> &keys,
+				       const vector<SIZE_T> &order,
+				       const SIZE_T first,
+				       const SIZE_T last,
+				       vector<VALUE_T> &values,
+				       vector<SIZE_T> &retry) const;
+
   // add a const in the end of the method means that the method is a access method. not a mutator(alter method)
   // access method only can read the data rather than change it
   ERROR_T      DisplayInternal(const SIZE_T &node,
@@ -83,7 +373,8 @@ public:
   BTreeIndex(SIZE_T keysize, 
 	     SIZE_T valuesize,
 	     BufferCache *cache,
-	     bool unique=true);   // true if a  key maps to a single value
+	     bool unique=true,    // true if a  key maps to a single value
+	     int keytype=BTREE_KEY_BYTES);
 
 
   BTreeIndex();
@@ -106,22 +397,29 @@ public:
   // We expect you to tell us the number of your superblock, which
   // we will return to you on the next attach
   ERROR_T Detach(SIZE_T &initblock);
+
+  // Write the superblock if it has changed, and then everything
+  // else that is dirty in the cache, so that the index on disk is
+  // complete as of now.
+  ERROR_T Checkpoint();
+
+  // Keep the interior nodes of the top levels of the tree (1 is
+  // just the root) in memory, so that descents only go to the
+  // buffer cache below them.  0 turns the hot tier off.  Only while
+  // nothing else is using the index, since this reads those nodes
+  // in.
+  void SetHotLevels(const SIZE_T levels);
   
-  // insert into not full leaf node
-  ERROR_T insert_not_full_leaf(SIZE_T Address,BTreeNode &Temp_Node,const KEY_T &key,const VALUE_T &value);
-  
-  // insert into not full internal node
-  ERROR_T insert_not_full_internal(SIZE_T Address,BTreeNode &Temp_Node,SIZE_T new_blockptr_leftleaf,SIZE_T new_blockptr_rightleaf,const KEY_T &key);
-  
-  // split the leaf node when it is full
-  ERROR_T split_full_leaf(BTreeNode Node,SIZE_T &new_blockptr_leftleaf,SIZE_T &new_blockptr_rightleaf, KEY_T &Key,VALUE_T &Val);
-  
-  // split the internal node
-  ERROR_T split_internal(vector<SIZE_T> &pointer,SIZE_T &new_blockptr_leftleaf,SIZE_T &new_blockptr_rightleaf,KEY_T &key,int &flag);
-  
-  // split the internal node when it is full
-  ERROR_T split_full_internal(BTreeNode Node,SIZE_T &new_blockptr_leftInternal,SIZE_T &new_blockptr_rightInternal, KEY_T &Key);
-  
+  // Insert, Update, Delete, Lookup and MultiLookup may be called
+  // from any number of threads at once.  Readers copy each node and
+  // check its latch hasn't moved on, starting over if it has, and a
+  // writer only latches the nodes it changes.  Everything else needs
+  // the index to itself.
+
+  // With variable length keys (BTREE_KEY_VARIABLE), keysize and
+  // valuesize are the longest that may be stored, and nodes hold as
+  // many entries as fit, so shorter keys mean more of them.
+
   // return zero on success
   // return ERROR_NOSPACE if you run out of disk space
   // return ERROR_SIZE if the key or value are the wrong size for this index
@@ -133,6 +431,8 @@ public:
   // return ERROR_SIZE if the key or value are the wrong size for this index
   ERROR_T Update(const KEY_T &key, const VALUE_T &value);
   
+  // Nodes that get too empty borrow from or merge with a sibling,
+  // and merged away nodes go back on the free list.
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
   // return ERROR_SIZE if the key or value are the wrong size for this index
@@ -142,12 +442,37 @@ public:
   // return ERROR_NONEXISTENT  if the key doesn't exist
   ERROR_T Lookup(const KEY_T &key, VALUE_T &value);
 
+  // Look up all of keys at once, putting the value for keys[i] in
+  // values[i].  Keys that don't exist, or are the wrong size for
+  // this index, get a value of length zero.  Each node on the way to
+  // the keys is read once for the whole batch.
+  // return zero on success
+  ERROR_T MultiLookup(const vector<KEY_T> &keys, vector<VALUE_T> &values) const;
+
+  // Position scan for the pairs with lo <= key <= hi, in increasing
+  // order of key, or in decreasing order if backward.  A lo or hi of
+  // length zero leaves that end unbounded.
+  // return zero on success, even if there is nothing in the range
+  ERROR_T Scan(const KEY_T &lo, const KEY_T &hi, BTreeScan &scan,
+	       const bool backward=false) const;
+
+  // Start building the index with loader.  Nodes are filled to fill
+  // (0<fill<=1) of what they can hold, but always leave room for one
+  // more Insert, and are never less full than Delete keeps them
+  // (about half).
+  // return zero on success
+  // return ERROR_CONFLICT if the index is not empty
+  // return ERROR_BADCONFIG if fill is out of range
+  ERROR_T BeginBulkLoad(BTreeBulkLoader &loader, const double fill=1.0);
+
   // Here you should figure out if your index makes sense
   // Is it a tree?  Is it in order?  Is it balanced?  Does each node have
   // a valid use ratio?
   ERROR_T SanityCheck() const;
   
-  ERROR_T SanityTraverse(const SIZE_T &node, SIZE_T &totalKeys) const;
+  ERROR_T SanityTraverse(const SIZE_T &node, const KEY_T *lo, const KEY_T *hi,
+			 const SIZE_T depth, SIZE_T &totalKeys,
+			 SIZE_T &leafDepth, SIZE_T &nextLeaf) const;
   
   ERROR_T NodesInOrder(const SIZE_T &node, SIZE_T &totalKeys) const;
 
@@ -0,0 +1,96 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "btree.h"
+
+void usage() 
+{
+  cerr << "usage: btree_bulkload filestem cachesize [fill] < pairs\n";
+  cerr << "  pairs is one \"key value\" per line in increasing order of key\n";
+  cerr << "  (sort(1) will do this), and the index must be empty\n";
+}
+
+
+int main(int argc, char **argv)
+{
+  char *filestem;
+  SIZE_T cachesize;
+  SIZE_T superblocknum;
+  double fill=1.0;
+  char line[1024];
+  char key[1024], value[1024];
+  SIZE_T numpairs=0;
+
+  if (argc!=3 && argc!=4) { 
+    usage();
+    return -1;
+  }
+
+  filestem=argv[1];
+  cachesize=atoi(argv[2]);
+  if (argc==4) {
+    fill=atof(argv[3]);
+  }
+
+  DiskSystem disk(filestem);
+  BufferCache cache(&disk,cachesize);
+  BTreeIndex btree(0,0,&cache);
+  BTreeBulkLoader loader;
+  
+  ERROR_T rc;
+
+  if ((rc=cache.Attach())!=ERROR_NOERROR) { 
+    cerr << "Can't attach buffer cache due to error"<<rc<<endl;
+    return -1;
+  }
+
+  if ((rc=btree.Attach(0))!=ERROR_NOERROR) { 
+    cerr << "Can't attach to index  due to error "<<rc<<endl;
+    return -1;
+  } else {
+    cerr << "Index attached!"<<endl;
+    if ((rc=btree.BeginBulkLoad(loader,fill))!=ERROR_NOERROR) {
+      cerr <<"Can't start bulk load due to error "<<rc<<endl;
+      return -1;
+    }
+    while (fgets(line,sizeof(line),stdin)!=NULL) {
+      if (sscanf(line,"%1023s %1023s",key,value)!=2) {
+	continue;
+      }
+      if ((rc=loader.Add(KEY_T(key),VALUE_T(value)))!=ERROR_NOERROR) {
+	cerr <<"Can't load "<<key<<" due to error "<<rc<<endl;
+	return -1;
+      }
+      numpairs++;
+    }
+    if ((rc=loader.Finish())!=ERROR_NOERROR) {
+      cerr <<"Can't finish bulk load due to error "<<rc<<endl;
+      return -1;
+    }
+    cerr <<"Loaded "<<numpairs<<" pairs\n";
+    if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) { 
+      cerr <<"Can't detach from index due to error "<<rc<<endl;
+      return -1;
+    }
+    if ((rc=cache.Detach())!=ERROR_NOERROR) { 
+      cerr <<"Can't detach from cache due to error "<<rc<<endl;
+      return -1;
+    }
+    cerr << "Performance statistics:\n";
+    
+    cerr << "numallocs       = "<<cache.GetNumAllocs()<<endl;
+    cerr << "numdeallocs     = "<<cache.GetNumDeallocs()<<endl;
+    cerr << "numreads        = "<<cache.GetNumReads()<<endl;
+    cerr << "numdiskreads    = "<<cache.GetNumDiskReads()<<endl;
+    cerr << "numwrites       = "<<cache.GetNumWrites()<<endl;
+    cerr << "numdiskwrites   = "<<cache.GetNumDiskWrites()<<endl;
+    cerr << endl;
+    
+    cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+
+    return 0;
+  }
+}
+  
+
+  
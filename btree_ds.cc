@@ -2,6 +2,10 @@
 #include <iostream>
 #include <assert.h>
 #include <string.h>
+#include <stdint.h>
+#if defined(BTREE_SIMD)
+#include <immintrin.h>
+#endif
 
 #include "btree_ds.h"
 #include "buffercache.h"
@@ -10,6 +14,33 @@
 
 using namespace std;
 
+// Offsets into and lengths within a slotted page (variable length keys)
+typedef uint16_t SLOT_T;
+
+#define SLOT_MAX 0xffff
+
+// Where the heap size, the length of the prefix and the array of
+// offsets are in a slotted page
+#define VAR_HEAP_OFFSET sizeof(SIZE_T)
+#define VAR_PREFIX_OFFSET (sizeof(SIZE_T)+sizeof(SLOT_T))
+#define VAR_SLOTS_OFFSET (sizeof(SIZE_T)+2*sizeof(SLOT_T))
+
+static inline SIZE_T GetSlot(const char *p)
+{
+  SLOT_T x;
+
+  memcpy(&x,p,sizeof(x));
+  return x;
+}
+
+static inline void PutSlot(char *p, const SIZE_T v)
+{
+  SLOT_T x=v;
+
+  memcpy(p,&x,sizeof(x));
+}
+
+
 SIZE_T NodeMetadata::GetNumDataBytes() const
 {
   SIZE_T n=blocksize-sizeof(*this);
@@ -27,6 +58,135 @@ SIZE_T NodeMetadata::GetNumSlotsAsLeaf() const
   return (GetNumDataBytes()-sizeof(SIZE_T))/(keysize+valuesize);  // floor intended
 }
 
+// A node is split once all of its slots fill, so it keeps at most
+// slots-1 keys.  Half of that means a node one key short of the
+// minimum, a sibling at the minimum and the key between them always
+// fit in one node.
+SIZE_T NodeMetadata::GetMinKeysAsInterior() const
+{
+  return (GetNumSlotsAsInterior()-1)/2;
+}
+
+SIZE_T NodeMetadata::GetMinKeysAsLeaf() const
+{
+  return (GetNumSlotsAsLeaf()-1)/2;
+}
+
+
+SIZE_T NodeMetadata::GetNumPageBytes() const
+{
+  return GetNumDataBytes()-VAR_SLOTS_OFFSET;
+}
+
+SIZE_T NodeMetadata::GetEntryBytesAsInterior(const SIZE_T keylen) const
+{
+  return 3*sizeof(SLOT_T)+keylen+sizeof(SIZE_T);
+}
+
+SIZE_T NodeMetadata::GetEntryBytesAsLeaf(const SIZE_T keylen, const SIZE_T vallen) const
+{
+  return 3*sizeof(SLOT_T)+keylen+vallen;
+}
+
+// The same reasoning as for GetMinKeys*, except that a node goes
+// from not overfull to overfull with an entry of up to m bytes, and
+// the halves of a split or a borrowed entry can each be off by up
+// to m.  A node short of this, a sibling that can't spare an entry
+// and the key between them always fit in one node.
+//
+// Interior nodes count their entries at full length, as if they
+// had no prefix, so that this still holds once two nodes with
+// different prefixes are put together.  The prefix of the node
+// being split takes up room in both halves, hence less again.
+SIZE_T NodeMetadata::GetMinBytesAsInterior() const
+{
+  SIZE_T m=GetEntryBytesAsInterior(keysize);
+  SIZE_T p=GetMaxPrefixBytes();
+
+  return GetNumPageBytes()>3*m+p ? (GetNumPageBytes()-3*m-p)/2 : 0;
+}
+
+SIZE_T NodeMetadata::GetMinBytesAsLeaf() const
+{
+  SIZE_T m=GetEntryBytesAsLeaf(keysize,valuesize);
+
+  return GetNumPageBytes()>3*m ? (GetNumPageBytes()-3*m)/2 : 0;
+}
+
+// Both halves of a split keep the prefix of the node they came
+// from, so a node half full of the longest entries plus a prefix
+// has to be short of overfull
+SIZE_T NodeMetadata::GetMaxPrefixBytes() const
+{
+  SIZE_T m=GetEntryBytesAsInterior(keysize);
+  SIZE_T n=GetNumPageBytes()>4*m ? GetNumPageBytes()-4*m : 0;
+
+  return n<keysize ? n : keysize;
+}
+
+
+bool NodeMetadata::IsKeySize(const SIZE_T n) const
+{
+  return keytype==BTREE_KEY_VARIABLE ? n>0 && n<=keysize : n==keysize;
+}
+
+bool NodeMetadata::IsValueSize(const SIZE_T n) const
+{
+  return keytype==BTREE_KEY_VARIABLE ? n>0 && n<=valuesize : n==valuesize;
+}
+
+
+ERROR_T NodeMetadata::ParseKeyType(const string &name, int &type)
+{
+  if (name=="bytes") {
+    type=BTREE_KEY_BYTES;
+  } else if (name=="u32") {
+    type=BTREE_KEY_UINT32;
+  } else if (name=="u64") {
+    type=BTREE_KEY_UINT64;
+  } else if (name=="var") {
+    type=BTREE_KEY_VARIABLE;
+  } else {
+    return ERROR_BADCONFIG;
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T NodeMetadata::CheckKeyType(const int type, const SIZE_T keysize)
+{
+  switch (type) {
+  case BTREE_KEY_BYTES:
+    return ERROR_NOERROR;
+  case BTREE_KEY_UINT32:
+    return keysize==4 ? ERROR_NOERROR : ERROR_SIZE;
+  case BTREE_KEY_UINT64:
+    return keysize==8 ? ERROR_NOERROR : ERROR_SIZE;
+  case BTREE_KEY_VARIABLE:
+    return keysize>0 ? ERROR_NOERROR : ERROR_SIZE;
+  default:
+    return ERROR_BADCONFIG;
+  }
+}
+
+ERROR_T NodeMetadata::CheckSizes() const
+{
+  if (keytype!=BTREE_KEY_VARIABLE) {
+    return ERROR_NOERROR;
+  }
+  // offsets and lengths have to fit in a slot
+  if (blocksize<sizeof(*this)+VAR_SLOTS_OFFSET ||
+      GetNumDataBytes()>SLOT_MAX || keysize>SLOT_MAX || valuesize>SLOT_MAX) {
+    return ERROR_SIZE;
+  }
+  // and an overfull node has to split into two halves that are
+  // neither overfull nor underfull
+  if (GetNumPageBytes()<4*GetEntryBytesAsLeaf(keysize,valuesize) ||
+      GetNumPageBytes()<4*GetEntryBytesAsInterior(keysize)) {
+    return ERROR_SIZE;
+  }
+  return ERROR_NOERROR;
+}
+
 
 ostream & NodeMetadata::Print(ostream &os) const 
 {
@@ -35,20 +195,26 @@ ostream & NodeMetadata::Print(ostream &os) const
 				   nodetype==BTREE_ROOT_NODE ? "ROOT_NODE" :
 				   nodetype==BTREE_INTERIOR_NODE ? "INTERIOR_NODE" :
 				   nodetype==BTREE_LEAF_NODE ? "LEAF_NODE" : "UNKNOWN_TYPE")
+     << ", keytype="<<(keytype==BTREE_KEY_BYTES ? "bytes" :
+		       keytype==BTREE_KEY_UINT32 ? "u32" :
+		       keytype==BTREE_KEY_UINT64 ? "u64" :
+		       keytype==BTREE_KEY_VARIABLE ? "var" : "unknown")
      << ", keysize="<<keysize<<", valuesize="<<valuesize<<", blocksize="<<blocksize
-     << ", rootnode="<<rootnode<<", freelist="<<freelist<<", numkeys="<<numkeys<<")";
+     << ", rootnode="<<rootnode<<", freelist="<<freelist
+     << ", highwater="<<highwater<<", numkeys="<<numkeys<<")";
   return os;
 }
 
 BTreeNode::BTreeNode() 
 {
   info.nodetype=BTREE_UNALLOCATED_BLOCK;
+  info.keytype=BTREE_KEY_BYTES;
   data=0;
 }
 
 BTreeNode::~BTreeNode()
 {
-  if (data) { 
+  if (data && !page.IsPinned()) { 
     delete [] data;
   }
   data=0;
@@ -56,14 +222,17 @@ BTreeNode::~BTreeNode()
 }
 
 
-BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size)
+BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size,
+		     int key_type)
 {
   info.nodetype=node_type;
+  info.keytype=key_type;
   info.keysize=key_size;
   info.valuesize=value_size;
   info.blocksize=block_size;
   info.rootnode=0;
   info.freelist=0;
+  info.highwater=0;
   info.numkeys=0;				       
   data=0;
   if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
@@ -75,23 +244,42 @@ BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T b
 BTreeNode::BTreeNode(const BTreeNode &rhs) 
 {
   info.nodetype=rhs.info.nodetype;
+  info.keytype=rhs.info.keytype;
   info.keysize=rhs.info.keysize;
   info.valuesize=rhs.info.valuesize;
   info.blocksize=rhs.info.blocksize;
   info.rootnode=rhs.info.rootnode;
   info.freelist=rhs.info.freelist;
+  info.highwater=rhs.info.highwater;
   info.numkeys=rhs.info.numkeys;				       
   data=0;
-  if (rhs.data) { 
+  if (rhs.page.IsPinned()) {
+    // share the pinned block rather than copying it
+    page=rhs.page;
+    data=rhs.data;
+  } else if (rhs.data) { 
    data=new char [info.GetNumDataBytes()];
     memcpy(data,rhs.data,info.GetNumDataBytes());
   }
 }
 
 
+// Like Block, reuses our own storage when there is some of the
+// right size, which avoids an allocation
 BTreeNode & BTreeNode::operator=(const BTreeNode &rhs) 
 {
-  return *(new (this) BTreeNode(rhs));
+  if (this==&rhs) {
+    return *this;
+  }
+  if (data && rhs.data && !page.IsPinned() && !rhs.page.IsPinned() &&
+      info.GetNumDataBytes()==rhs.info.GetNumDataBytes()) {
+    info=rhs.info;
+    memcpy(data,rhs.data,info.GetNumDataBytes());
+  } else {
+    this->~BTreeNode();
+    new (this) BTreeNode(rhs);
+  }
+  return *this;
 }
 
 
@@ -112,30 +300,91 @@ ERROR_T BTreeNode::Serialize(BufferCache *b, const SIZE_T blocknum) const
 
 ERROR_T  BTreeNode::Unserialize(BufferCache *b, const SIZE_T blocknum)
 {
-  Block block;
+  PageHandle block;
+  SIZE_T oldbytes = (data && !page.IsPinned()) ? info.GetNumDataBytes() : 0;
 
   ERROR_T rc;
 
-  rc=b->ReadBlock(blocknum,block);
+  // Copy straight out of the cached block
+  rc=b->PinBlock(blocknum,block);
 
   if (rc!=ERROR_NOERROR) {
     return rc;
   }
 
-  memcpy(&info,block.data,sizeof(info));
+  if (page.IsPinned()) {
+    data=0;
+    page.Release();
+  }
+
+  memcpy(&info,block.GetData(),sizeof(info));
   
-  if (data) { 
+  assert(b->GetBlockSize()==(unsigned)info.blocksize);
+
+  if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
+    if (!data || oldbytes!=info.GetNumDataBytes()) {
+      if (data) { 
+	delete [] data;
+      }
+      data = new char [info.GetNumDataBytes()];
+    }
+    memcpy(data,block.GetData()+sizeof(info),info.GetNumDataBytes());
+  } else if (data) {
     delete [] data;
     data=0;
   }
+  
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T  BTreeNode::Pin(BufferCache *b, const SIZE_T blocknum)
+{
+  char *owned = (data && !page.IsPinned()) ? data : 0;
+
+  ERROR_T rc;
+
+  rc=b->PinBlock(blocknum,page);
+
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+
+  if (owned) {
+    delete [] owned;
+  }
+
+  memcpy(&info,page.GetData(),sizeof(info));
 
   assert(b->GetBlockSize()==(unsigned)info.blocksize);
 
   if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
-    data = new char [info.GetNumDataBytes()];
-    memcpy(data,block.data+sizeof(info),info.GetNumDataBytes());
+    data = (char *) page.GetData()+sizeof(info);
+  } else {
+    data = 0;
   }
-  
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::Unshare()
+{
+  if (!page.IsPinned()) {
+    return ERROR_NOERROR;
+  }
+  if (data) {
+    char *d;
+    try {
+      d = new char [info.GetNumDataBytes()];
+    }
+    catch (...) {
+      return ERROR_NOMEM;
+    }
+    memcpy(d,data,info.GetNumDataBytes());
+    data=d;
+  }
+  page.Release();
   return ERROR_NOERROR;
 }
 
@@ -148,10 +397,23 @@ char * BTreeNode::ResolveKey(const SIZE_T offset) const
   case BTREE_INTERIOR_NODE:
   case BTREE_ROOT_NODE:
     assert(offset<info.numkeys);
+    if (info.keytype==BTREE_KEY_VARIABLE) {
+      // just the part after what the key shares with the prefix
+      return ResolveEntry(offset)+2*sizeof(SLOT_T);
+    }
+    if (info.keytype!=BTREE_KEY_BYTES) {
+      return data+offset*info.keysize;
+    }
     return data+sizeof(SIZE_T)+offset*(sizeof(SIZE_T)+info.keysize);
     break;
   case BTREE_LEAF_NODE:
     assert(offset<info.numkeys);
+    if (info.keytype==BTREE_KEY_VARIABLE) {
+      return ResolveEntry(offset)+2*sizeof(SLOT_T);
+    }
+    if (info.keytype!=BTREE_KEY_BYTES) {
+      return data+sizeof(SIZE_T)+offset*info.keysize;
+    }
     return data+sizeof(SIZE_T)+offset*(info.keysize+info.valuesize);
     break;
   default:
@@ -166,6 +428,16 @@ char * BTreeNode::ResolvePtr(const SIZE_T offset) const
   case BTREE_INTERIOR_NODE:
   case BTREE_ROOT_NODE:
     assert(offset<=info.numkeys);
+    if (info.keytype==BTREE_KEY_VARIABLE) {
+      if (offset==0) {
+	return data;
+      }
+      char *e=ResolveEntry(offset-1);
+      return e+2*sizeof(SLOT_T)+GetSlot(e)-GetSlot(e+sizeof(SLOT_T));
+    }
+    if (info.keytype!=BTREE_KEY_BYTES) {
+      return data+info.GetNumSlotsAsInterior()*info.keysize+offset*sizeof(SIZE_T);
+    }
     return data+offset*(sizeof(SIZE_T)+info.keysize);
     break;
   case BTREE_LEAF_NODE:
@@ -184,6 +456,13 @@ char * BTreeNode::ResolveVal(const SIZE_T offset) const
   switch (info.nodetype) { 
   case BTREE_LEAF_NODE:
     assert(offset<info.numkeys);
+    if (info.keytype==BTREE_KEY_VARIABLE) {
+      char *e=ResolveEntry(offset);
+      return e+2*sizeof(SLOT_T)+GetSlot(e);
+    }
+    if (info.keytype!=BTREE_KEY_BYTES) {
+      return data+sizeof(SIZE_T)+info.GetNumSlotsAsLeaf()*info.keysize+offset*info.valuesize;
+    }
     return data+sizeof(SIZE_T)+offset*(info.keysize+info.valuesize)+info.keysize;
     break;
   default:
@@ -198,6 +477,203 @@ char * BTreeNode::ResolveKeyVal(const SIZE_T offset) const
   return ResolveKey(offset);
 }
 
+
+char * BTreeNode::ResolveKeys() const
+{
+  if (info.keytype==BTREE_KEY_VARIABLE) {
+    return 0;
+  }
+  switch (info.nodetype) { 
+  case BTREE_INTERIOR_NODE:
+  case BTREE_ROOT_NODE:
+    return info.keytype!=BTREE_KEY_BYTES ? data : data+sizeof(SIZE_T);
+    break;
+  case BTREE_LEAF_NODE:
+    return data+sizeof(SIZE_T);
+    break;
+  default:
+    return 0;
+  }
+}
+
+
+char * BTreeNode::ResolveEntry(const SIZE_T offset) const
+{
+  assert(info.keytype==BTREE_KEY_VARIABLE && offset<info.numkeys);
+  return data+GetSlot(data+VAR_SLOTS_OFFSET+offset*sizeof(SLOT_T));
+}
+
+
+// The prefix of a slotted page is at the top of its heap
+static inline SIZE_T PrefixLength(const BTreeNode &b)
+{
+  return GetSlot(b.data+VAR_PREFIX_OFFSET);
+}
+
+static inline const char *ResolvePrefix(const BTreeNode &b)
+{
+  return b.data+b.info.GetNumDataBytes()-PrefixLength(b);
+}
+
+// How many of the first bytes of k are those of p, which is n long
+static SIZE_T CommonLength(const char *p, const SIZE_T n, const KEY_T &k)
+{
+  SIZE_T i, len = n<k.length ? n : k.length;
+
+  for (i=0;i<len && p[i]==(char)k.data[i];i++) {
+  }
+  return i;
+}
+
+
+//
+// Integer keys
+//
+// The user gives us keys most significant byte first, so memcmp
+// sorts them numerically.  We store them in host order with the top
+// bit flipped so that a signed compare (which is all SSE and AVX2
+// offer) sorts them in the same way.
+//
+
+#if __BYTE_ORDER__==__ORDER_LITTLE_ENDIAN__
+#define KEY_SWAP32(x) __builtin_bswap32(x)
+#define KEY_SWAP64(x) __builtin_bswap64(x)
+#else
+#define KEY_SWAP32(x) (x)
+#define KEY_SWAP64(x) (x)
+#endif
+
+static inline int32_t EncodeKey32(const void *k)
+{
+  uint32_t x;
+
+  memcpy(&x,k,sizeof(x));
+  return (int32_t)(KEY_SWAP32(x)^0x80000000U);
+}
+
+static inline void DecodeKey32(const char *p, void *k)
+{
+  uint32_t x;
+
+  memcpy(&x,p,sizeof(x));
+  x=KEY_SWAP32(x^0x80000000U);
+  memcpy(k,&x,sizeof(x));
+}
+
+static inline int64_t EncodeKey64(const void *k)
+{
+  uint64_t x;
+
+  memcpy(&x,k,sizeof(x));
+  return (int64_t)(KEY_SWAP64(x)^0x8000000000000000ULL);
+}
+
+static inline void DecodeKey64(const char *p, void *k)
+{
+  uint64_t x;
+
+  memcpy(&x,p,sizeof(x));
+  x=KEY_SWAP64(x^0x8000000000000000ULL);
+  memcpy(k,&x,sizeof(x));
+}
+
+
+// Below this many keys the search stops halving and just compares
+// all of the remaining keys, a vector at a time.  Built without
+// BTREE_SIMD (make SIMD=1) it is a binary search all the way down.
+#if defined(BTREE_SIMD)
+#define BTREE_SEARCH_WINDOW 32
+#else
+#define BTREE_SEARCH_WINDOW 0
+#endif
+
+//
+// The number of the n sorted keys that are less than k, which is
+// the offset of the first key that isn't
+//
+static SIZE_T CountLess32(const char *keys, const SIZE_T n, const int32_t k)
+{
+  SIZE_T lo=0, hi=n, mid, i;
+  int32_t x;
+
+  while (hi-lo>BTREE_SEARCH_WINDOW) {
+    mid=lo+(hi-lo)/2;
+    memcpy(&x,keys+mid*sizeof(x),sizeof(x));
+    if (x<k) {
+      lo=mid+1;
+    } else {
+      hi=mid;
+    }
+  }
+
+  const char *p=keys+lo*sizeof(x);
+  SIZE_T m=hi-lo;
+  SIZE_T count=lo;
+
+  i=0;
+#if defined(BTREE_SIMD) && defined(__AVX2__)
+  __m256i k8=_mm256_set1_epi32(k);
+  for (;i+8<=m;i+=8) {
+    __m256i x8=_mm256_loadu_si256((const __m256i *)(p+i*sizeof(x)));
+    count+=__builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(k8,x8))));
+  }
+#endif
+#if defined(BTREE_SIMD) && defined(__SSE2__)
+  __m128i k4=_mm_set1_epi32(k);
+  for (;i+4<=m;i+=4) {
+    __m128i x4=_mm_loadu_si128((const __m128i *)(p+i*sizeof(x)));
+    count+=__builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(k4,x4))));
+  }
+#endif
+  for (;i<m;i++) {
+    memcpy(&x,p+i*sizeof(x),sizeof(x));
+    count+= x<k;
+  }
+  return count;
+}
+
+static SIZE_T CountLess64(const char *keys, const SIZE_T n, const int64_t k)
+{
+  SIZE_T lo=0, hi=n, mid, i;
+  int64_t x;
+
+  while (hi-lo>BTREE_SEARCH_WINDOW) {
+    mid=lo+(hi-lo)/2;
+    memcpy(&x,keys+mid*sizeof(x),sizeof(x));
+    if (x<k) {
+      lo=mid+1;
+    } else {
+      hi=mid;
+    }
+  }
+
+  const char *p=keys+lo*sizeof(x);
+  SIZE_T m=hi-lo;
+  SIZE_T count=lo;
+
+  i=0;
+#if defined(BTREE_SIMD) && defined(__AVX2__)
+  __m256i k4=_mm256_set1_epi64x(k);
+  for (;i+4<=m;i+=4) {
+    __m256i x4=_mm256_loadu_si256((const __m256i *)(p+i*sizeof(x)));
+    count+=__builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(k4,x4))));
+  }
+#endif
+#if defined(BTREE_SIMD) && defined(__SSE4_2__)
+  __m128i k2=_mm_set1_epi64x(k);
+  for (;i+2<=m;i+=2) {
+    __m128i x2=_mm_loadu_si128((const __m128i *)(p+i*sizeof(x)));
+    count+=__builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(k2,x2))));
+  }
+#endif
+  for (;i<m;i++) {
+    memcpy(&x,p+i*sizeof(x),sizeof(x));
+    count+= x<k;
+  }
+  return count;
+}
+
+
 ERROR_T BTreeNode::GetKey(const SIZE_T offset, KEY_T &k) const
 {
   char *p=ResolveKey(offset);
@@ -206,8 +682,29 @@ ERROR_T BTreeNode::GetKey(const SIZE_T offset, KEY_T &k) const
     return ERROR_NOMEM;
   }
   
-  k.Resize(info.keysize,false);
-  memcpy(k.data,p,info.keysize);
+  SIZE_T len = info.keytype==BTREE_KEY_VARIABLE ? GetSlot(ResolveEntry(offset)) : info.keysize;
+
+  if (k.length!=len) {
+    k.Resize(len,false);
+  }
+  switch (info.keytype) {
+  case BTREE_KEY_UINT32:
+    DecodeKey32(p,k.data);
+    break;
+  case BTREE_KEY_UINT64:
+    DecodeKey64(p,k.data);
+    break;
+  case BTREE_KEY_VARIABLE:
+    if (info.nodetype!=BTREE_LEAF_NODE) {
+      SIZE_T shared=GetSlot(ResolveEntry(offset)+sizeof(SLOT_T));
+      memcpy(k.data,ResolvePrefix(*this),shared);
+      memcpy(k.data+shared,p,len-shared);
+      break;
+    }
+    // fall through
+  default:
+    memcpy(k.data,p,len);
+  }
   return ERROR_NOERROR;
 }
 
@@ -231,8 +728,12 @@ ERROR_T BTreeNode::GetVal(const SIZE_T offset, VALUE_T &v) const
     return ERROR_NOMEM;
   }
   
-  v.Resize(info.valuesize,false);
-  memcpy(v.data,p,info.valuesize);
+  SIZE_T len = info.keytype==BTREE_KEY_VARIABLE ? GetSlot(ResolveEntry(offset)+sizeof(SLOT_T)) : info.valuesize;
+
+  if (v.length!=len) {
+    v.Resize(len,false);
+  }
+  memcpy(v.data,p,len);
   return ERROR_NOERROR;
 }
 
@@ -249,15 +750,145 @@ ERROR_T BTreeNode::GetKeyVal(const SIZE_T offset, KeyValuePair &p) const
 }
 
 
+int BTreeNode::CompareKey(const SIZE_T offset, const KEY_T &k) const
+{
+  char *p=ResolveKey(offset);
+
+  switch (info.keytype) {
+  case BTREE_KEY_UINT32: {
+    int32_t x, y=EncodeKey32(k.data);
+    memcpy(&x,p,sizeof(x));
+    return x<y ? -1 : x>y;
+  }
+  case BTREE_KEY_UINT64: {
+    int64_t x, y=EncodeKey64(k.data);
+    memcpy(&x,p,sizeof(x));
+    return x<y ? -1 : x>y;
+  }
+  case BTREE_KEY_VARIABLE: {
+    // a key that is a prefix of another sorts first
+    const char *e=ResolveEntry(offset);
+    SIZE_T len=GetSlot(e);
+    SIZE_T shared=0;
+    int c=0;
+    if (info.nodetype!=BTREE_LEAF_NODE) {
+      // an interior node's keys start with some of the prefix
+      shared=GetSlot(e+sizeof(SLOT_T));
+      c=memcmp(ResolvePrefix(*this),k.data,shared<k.length ? shared : k.length);
+    }
+    if (c==0 && shared<k.length) {
+      c=memcmp(p,k.data+shared,(len<k.length ? len : k.length)-shared);
+    }
+    return c ? c : (len<k.length ? -1 : len>k.length);
+  }
+  default:
+    return memcmp(p,k.data,info.keysize);
+  }
+}
+
+
+SIZE_T BTreeNode::UpperBound(const KEY_T &k) const
+{
+  SIZE_T lo=0, hi=info.numkeys, mid;
+
+  // the keys not greater than k are those less than k+1
+  switch (info.keytype) {
+  case BTREE_KEY_UINT32: {
+    int32_t y=EncodeKey32(k.data);
+    return y==INT32_MAX ? hi : CountLess32(ResolveKeys(),hi,y+1);
+  }
+  case BTREE_KEY_UINT64: {
+    int64_t y=EncodeKey64(k.data);
+    return y==INT64_MAX ? hi : CountLess64(ResolveKeys(),hi,y+1);
+  }
+  }
+
+  while (lo<hi) {
+    mid=lo+(hi-lo)/2;
+    if (CompareKey(mid,k)>0) {
+      hi=mid;
+    } else {
+      lo=mid+1;
+    }
+  }
+  return lo;
+}
+
+
+SIZE_T BTreeNode::LowerBound(const KEY_T &k) const
+{
+  SIZE_T lo=0, hi=info.numkeys, mid;
+
+  switch (info.keytype) {
+  case BTREE_KEY_UINT32:
+    return CountLess32(ResolveKeys(),hi,EncodeKey32(k.data));
+  case BTREE_KEY_UINT64:
+    return CountLess64(ResolveKeys(),hi,EncodeKey64(k.data));
+  }
+
+  while (lo<hi) {
+    mid=lo+(hi-lo)/2;
+    if (CompareKey(mid,k)>=0) {
+      hi=mid;
+    } else {
+      lo=mid+1;
+    }
+  }
+  return lo;
+}
+
+
 ERROR_T BTreeNode::SetKey(const SIZE_T offset, const KEY_T &k)
 {
+  if (info.keytype==BTREE_KEY_VARIABLE &&
+      (info.nodetype!=BTREE_LEAF_NODE || k.length!=GetSlot(ResolveEntry(offset)))) {
+    // The entry has to be rebuilt around a key of another length, or
+    // one that may have more or less in common with the prefix
+    ERROR_T rc;
+    if (info.nodetype==BTREE_LEAF_NODE) {
+      VALUE_T v;
+      rc=GetVal(offset,v);
+      if (rc) { return rc; }
+      rc=RemoveEntry(offset);
+      if (rc) { return rc; }
+      return InsertKeyVal(offset,k,v);
+    } else {
+      SIZE_T ptr;
+      rc=GetPtr(offset+1,ptr);
+      if (rc) { return rc; }
+      rc=RemoveEntry(offset);
+      if (rc) { return rc; }
+      return InsertKeyPtr(offset,k,ptr);
+    }
+  }
+
+  if (Unshare()!=ERROR_NOERROR) { 
+    return ERROR_NOMEM;
+  }
+
   char *p=ResolveKey(offset);
 
   if (p==0) { 
     return ERROR_NOMEM;
   }
 
-  memcpy(p,k.data,info.keysize);
+  switch (info.keytype) {
+  case BTREE_KEY_UINT32: {
+    int32_t x=EncodeKey32(k.data);
+    memcpy(p,&x,sizeof(x));
+    break;
+  }
+  case BTREE_KEY_UINT64: {
+    int64_t x=EncodeKey64(k.data);
+    memcpy(p,&x,sizeof(x));
+    break;
+  }
+  case BTREE_KEY_VARIABLE:
+    memcpy(p,k.data,k.length);
+    break;
+  default:
+    memcpy(p,k.data,info.keysize);
+  }
 
   return ERROR_NOERROR;
 }
@@ -265,6 +896,10 @@ ERROR_T BTreeNode::SetKey(const SIZE_T offset, const KEY_T &k)
 
 ERROR_T BTreeNode::SetPtr(const SIZE_T offset, const SIZE_T &ptr)
 {
+  if (Unshare()!=ERROR_NOERROR) { 
+    return ERROR_NOMEM;
+  }
+
   char *p=ResolvePtr(offset);
 
   if (p==0) { 
@@ -280,13 +915,28 @@ ERROR_T BTreeNode::SetPtr(const SIZE_T offset, const SIZE_T &ptr)
 
 ERROR_T BTreeNode::SetVal(const SIZE_T offset, const VALUE_T &v)
 {
+  if (info.keytype==BTREE_KEY_VARIABLE && v.length!=GetSlot(ResolveEntry(offset)+sizeof(SLOT_T))) {
+    // as with SetKey
+    KEY_T k;
+    ERROR_T rc;
+    rc=GetKey(offset,k);
+    if (rc) { return rc; }
+    rc=RemoveEntry(offset);
+    if (rc) { return rc; }
+    return InsertKeyVal(offset,k,v);
+  }
+
+  if (Unshare()!=ERROR_NOERROR) { 
+    return ERROR_NOMEM;
+  }
+
   char *p=ResolveVal(offset);
   
   if (p==0) { 
     return ERROR_NOMEM;
   }
   
-  memcpy(p,v.data,info.valuesize);
+  memcpy(p,v.data,info.keytype==BTREE_KEY_VARIABLE ? v.length : info.valuesize);
   
   return ERROR_NOERROR;
 }
@@ -306,6 +956,388 @@ ERROR_T BTreeNode::SetKeyVal(const SIZE_T offset, const KeyValuePair &p)
 
 
 
+//
+// With fixed size keys, the arrays that hold a node's entries, with
+// element i of each at base+i*width.  Entry i of a leaf is key i and
+// value i, and of an interior node key i and pointer i+1, which are
+// next to each other unless the keys are integers.
+//
+static SIZE_T EntryArrays(const BTreeNode &b, char *base[2], SIZE_T width[2])
+{
+  const NodeMetadata &info=b.info;
+
+  if (info.nodetype==BTREE_LEAF_NODE) {
+    base[0]=b.data+sizeof(SIZE_T);
+    if (info.keytype==BTREE_KEY_BYTES) {
+      width[0]=info.keysize+info.valuesize;
+      return 1;
+    }
+    width[0]=info.keysize;
+    base[1]=base[0]+info.GetNumSlotsAsLeaf()*info.keysize;
+    width[1]=info.valuesize;
+    return 2;
+  }
+  if (info.keytype==BTREE_KEY_BYTES) {
+    base[0]=b.data+sizeof(SIZE_T);
+    width[0]=info.keysize+sizeof(SIZE_T);
+    return 1;
+  }
+  base[0]=b.data;
+  width[0]=info.keysize;
+  base[1]=b.data+info.GetNumSlotsAsInterior()*info.keysize+sizeof(SIZE_T);
+  width[1]=sizeof(SIZE_T);
+  return 2;
+}
+
+
+// Bytes in the heap of a slotted page taken by the ith entry
+static SIZE_T EntryBytes(const BTreeNode &b, const SIZE_T offset)
+{
+  const char *e=b.ResolveEntry(offset);
+
+  if (b.info.nodetype==BTREE_LEAF_NODE) {
+    return 2*sizeof(SLOT_T)+GetSlot(e)+GetSlot(e+sizeof(SLOT_T));
+  }
+  return 2*sizeof(SLOT_T)+GetSlot(e)-GetSlot(e+sizeof(SLOT_T))+sizeof(SIZE_T);
+}
+
+// The same if the entry shared nothing with the prefix
+static SIZE_T FullEntryBytes(const BTreeNode &b, const SIZE_T offset)
+{
+  if (b.info.nodetype==BTREE_LEAF_NODE) {
+    return EntryBytes(b,offset);
+  }
+  return 2*sizeof(SLOT_T)+GetSlot(b.ResolveEntry(offset))+sizeof(SIZE_T);
+}
+
+
+//
+// Add a slot for a new ith entry of n bytes to a slotted page and
+// make room for the entry at the bottom of the heap.  Returns where
+// the entry goes, or 0 if it doesn't fit.
+//
+static char *MakeEntry(BTreeNode &b, const SIZE_T offset, const SIZE_T n)
+{
+  SIZE_T heap=GetSlot(b.data+VAR_HEAP_OFFSET);
+  SIZE_T top=b.info.GetNumDataBytes()-heap;
+  char *slot=b.data+VAR_SLOTS_OFFSET+offset*sizeof(SLOT_T);
+
+  if (top-(VAR_SLOTS_OFFSET+b.info.numkeys*sizeof(SLOT_T))<n+sizeof(SLOT_T)) {
+    return 0;
+  }
+  top-=n;
+  memmove(slot+sizeof(SLOT_T),slot,(b.info.numkeys-offset)*sizeof(SLOT_T));
+  PutSlot(slot,top);
+  PutSlot(b.data+VAR_HEAP_OFFSET,heap+n);
+  b.info.numkeys++;
+  return b.data+top;
+}
+
+
+ERROR_T BTreeNode::InsertKeyVal(const SIZE_T offset, const KEY_T &k, const VALUE_T &v)
+{
+  assert(info.nodetype==BTREE_LEAF_NODE && offset<=info.numkeys);
+
+  if (Unshare()!=ERROR_NOERROR) { 
+    return ERROR_NOMEM;
+  }
+
+  if (info.keytype==BTREE_KEY_VARIABLE) {
+    char *e=MakeEntry(*this,offset,2*sizeof(SLOT_T)+k.length+v.length);
+    if (e==0) {
+      return ERROR_NOSPACE;
+    }
+    PutSlot(e,k.length);
+    PutSlot(e+sizeof(SLOT_T),v.length);
+    memcpy(e+2*sizeof(SLOT_T),k.data,k.length);
+    memcpy(e+2*sizeof(SLOT_T)+k.length,v.data,v.length);
+    return ERROR_NOERROR;
+  }
+
+  if (info.numkeys>=info.GetNumSlotsAsLeaf()) {
+    return ERROR_NOSPACE;
+  }
+
+  char *base[2];
+  SIZE_T width[2];
+  SIZE_T n=EntryArrays(*this,base,width);
+
+  for (SIZE_T i=0;i<n;i++) {
+    memmove(base[i]+(offset+1)*width[i],base[i]+offset*width[i],(info.numkeys-offset)*width[i]);
+  }
+  info.numkeys++;
+
+  ERROR_T rc=SetKey(offset,k);
+  if (rc) { return rc; }
+  return SetVal(offset,v);
+}
+
+
+ERROR_T BTreeNode::InsertKeyPtr(const SIZE_T offset, const KEY_T &k, const SIZE_T &p)
+{
+  assert(info.nodetype!=BTREE_LEAF_NODE && offset<=info.numkeys);
+
+  if (Unshare()!=ERROR_NOERROR) { 
+    return ERROR_NOMEM;
+  }
+
+  if (info.keytype==BTREE_KEY_VARIABLE) {
+    // only what the key doesn't have in common with the prefix is kept
+    SIZE_T shared=CommonLength(ResolvePrefix(*this),PrefixLength(*this),k);
+    SIZE_T rest=k.length-shared;
+    char *e=MakeEntry(*this,offset,2*sizeof(SLOT_T)+rest+sizeof(SIZE_T));
+    if (e==0) {
+      return ERROR_NOSPACE;
+    }
+    PutSlot(e,k.length);
+    PutSlot(e+sizeof(SLOT_T),shared);
+    memcpy(e+2*sizeof(SLOT_T),k.data+shared,rest);
+    memcpy(e+2*sizeof(SLOT_T)+rest,&p,sizeof(SIZE_T));
+    return ERROR_NOERROR;
+  }
+
+  if (info.numkeys>=info.GetNumSlotsAsInterior()) {
+    return ERROR_NOSPACE;
+  }
+
+  char *base[2];
+  SIZE_T width[2];
+  SIZE_T n=EntryArrays(*this,base,width);
+
+  for (SIZE_T i=0;i<n;i++) {
+    memmove(base[i]+(offset+1)*width[i],base[i]+offset*width[i],(info.numkeys-offset)*width[i]);
+  }
+  info.numkeys++;
+
+  ERROR_T rc=SetKey(offset,k);
+  if (rc) { return rc; }
+  return SetPtr(offset+1,p);
+}
+
+
+ERROR_T BTreeNode::RemoveEntry(const SIZE_T offset)
+{
+  assert(offset<info.numkeys);
+
+  if (Unshare()!=ERROR_NOERROR) { 
+    return ERROR_NOMEM;
+  }
+
+  if (info.keytype==BTREE_KEY_VARIABLE) {
+    // Keep the heap packed: the entries below this one move up over
+    // it, and so do the offsets of any of them
+    SIZE_T heap=GetSlot(data+VAR_HEAP_OFFSET);
+    SIZE_T top=info.GetNumDataBytes()-heap;
+    SIZE_T at=ResolveEntry(offset)-data;
+    SIZE_T n=EntryBytes(*this,offset);
+    char *slot=data+VAR_SLOTS_OFFSET+offset*sizeof(SLOT_T);
+
+    memmove(data+top+n,data+top,at-top);
+    for (SIZE_T i=0;i<info.numkeys;i++) {
+      char *p=data+VAR_SLOTS_OFFSET+i*sizeof(SLOT_T);
+      if (GetSlot(p)<at) {
+	PutSlot(p,GetSlot(p)+n);
+      }
+    }
+    memmove(slot,slot+sizeof(SLOT_T),(info.numkeys-offset-1)*sizeof(SLOT_T));
+    PutSlot(data+VAR_HEAP_OFFSET,heap-n);
+    info.numkeys--;
+    return ERROR_NOERROR;
+  }
+
+  char *base[2];
+  SIZE_T width[2];
+  SIZE_T n=EntryArrays(*this,base,width);
+
+  for (SIZE_T i=0;i<n;i++) {
+    memmove(base[i]+offset*width[i],base[i]+(offset+1)*width[i],(info.numkeys-offset-1)*width[i]);
+  }
+  info.numkeys--;
+  return ERROR_NOERROR;
+}
+
+
+SIZE_T BTreeNode::GetUsedBytes() const
+{
+  return info.numkeys*sizeof(SLOT_T)+GetSlot(data+VAR_HEAP_OFFSET);
+}
+
+
+SIZE_T BTreeNode::GetFullBytes() const
+{
+  SIZE_T n=info.numkeys*sizeof(SLOT_T);
+
+  if (info.nodetype==BTREE_LEAF_NODE) {
+    return GetUsedBytes();
+  }
+  for (SIZE_T i=0;i<info.numkeys;i++) {
+    n+=FullEntryBytes(*this,i);
+  }
+  return n;
+}
+
+
+bool BTreeNode::IsOverfull() const
+{
+  bool leaf=info.nodetype==BTREE_LEAF_NODE;
+
+  if (info.keytype==BTREE_KEY_VARIABLE) {
+    return info.GetNumPageBytes()-GetUsedBytes() <
+      (leaf ? info.GetEntryBytesAsLeaf(info.keysize,info.valuesize) :
+       info.GetEntryBytesAsInterior(info.keysize));
+  }
+  return info.numkeys>=(leaf ? info.GetNumSlotsAsLeaf() : info.GetNumSlotsAsInterior());
+}
+
+
+bool BTreeNode::IsUnderfull() const
+{
+  bool leaf=info.nodetype==BTREE_LEAF_NODE;
+
+  if (info.keytype==BTREE_KEY_VARIABLE) {
+    return GetFullBytes()<(leaf ? info.GetMinBytesAsLeaf() : info.GetMinBytesAsInterior());
+  }
+  return info.numkeys<(leaf ? info.GetMinKeysAsLeaf() : info.GetMinKeysAsInterior());
+}
+
+
+bool BTreeNode::CanLend(const SIZE_T offset) const
+{
+  bool leaf=info.nodetype==BTREE_LEAF_NODE;
+
+  if (info.keytype==BTREE_KEY_VARIABLE) {
+    return offset<info.numkeys &&
+      GetFullBytes()-sizeof(SLOT_T)-FullEntryBytes(*this,offset)>=
+      (leaf ? info.GetMinBytesAsLeaf() : info.GetMinBytesAsInterior());
+  }
+  return info.numkeys>(leaf ? info.GetMinKeysAsLeaf() : info.GetMinKeysAsInterior());
+}
+
+
+SIZE_T BTreeNode::SplitPoint() const
+{
+  SIZE_T half, left, i, n;
+
+  if (info.keytype!=BTREE_KEY_VARIABLE) {
+    return info.numkeys/2;
+  }
+
+  // As many entries as fit in half of the bytes.  Both halves then
+  // end up within an entry of half.
+  half=(GetUsedBytes()-PrefixLength(*this))/2;
+  for (left=0,i=0;i<info.numkeys;i++) {
+    n=sizeof(SLOT_T)+EntryBytes(*this,i);
+    if (left+n>half) {
+      break;
+    }
+    left+=n;
+  }
+  if (i<1) {
+    i=1;
+  }
+  // an interior node's right half needs a key after the one that goes up
+  n = info.nodetype==BTREE_LEAF_NODE ? info.numkeys-1 : info.numkeys-2;
+  return i<n ? i : n;
+}
+
+
+ERROR_T BTreeNode::GetPrefix(KEY_T &p) const
+{
+  SIZE_T n=PrefixLength(*this);
+
+  if (p.length!=n) {
+    p.Resize(n,false);
+  }
+  memcpy(p.data,ResolvePrefix(*this),n);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::SetPrefix(const KEY_T &p)
+{
+  assert(info.keytype==BTREE_KEY_VARIABLE && info.nodetype!=BTREE_LEAF_NODE);
+
+  BTreeNode b(info.nodetype,info.keysize,info.valuesize,info.blocksize,info.keytype);
+  SIZE_T top=info.GetNumDataBytes()-p.length;
+  KEY_T k;
+  SIZE_T ptr;
+  ERROR_T rc;
+
+  if (p.length>info.GetMaxPrefixBytes()) {
+    return ERROR_SIZE;
+  }
+  PutSlot(b.data+VAR_PREFIX_OFFSET,p.length);
+  PutSlot(b.data+VAR_HEAP_OFFSET,p.length);
+  memcpy(b.data+top,p.data,p.length);
+
+  // Put the entries in again, which works them out afresh
+  rc=GetPtr(0,ptr);
+  if (rc) { return rc; }
+  rc=b.SetPtr(0,ptr);
+  if (rc) { return rc; }
+  for (SIZE_T i=0;i<info.numkeys;i++) {
+    rc=GetKey(i,k);
+    if (rc) { return rc; }
+    rc=GetPtr(i+1,ptr);
+    if (rc) { return rc; }
+    rc=b.InsertKeyPtr(i,k,ptr);
+    if (rc) { return rc; }
+  }
+
+  b.info=info;
+  *this=b;
+  return ERROR_NOERROR;
+}
+
+
+//
+// The candidates are the prefix the node has now, none at all, and
+// as much as all of its keys (so the first and last) have in common.
+// Each is weighed by what it and the rest of the keys take up.
+//
+ERROR_T BTreeNode::Rebase()
+{
+  KEY_T candidate[3];
+  SIZE_T size[3];
+  SIZE_T i, j, best;
+  KEY_T k;
+  ERROR_T rc;
+
+  assert(info.keytype==BTREE_KEY_VARIABLE && info.nodetype!=BTREE_LEAF_NODE);
+
+  if (info.numkeys==0) {
+    return ERROR_NOERROR;
+  }
+
+  rc=GetPrefix(candidate[0]);
+  if (rc) { return rc; }
+  rc=GetKey(0,candidate[2]);
+  if (rc) { return rc; }
+  rc=GetKey(info.numkeys-1,k);
+  if (rc) { return rc; }
+  j=CommonLength((char*)k.data,k.length,candidate[2]);
+  candidate[2].Resize(j<info.GetMaxPrefixBytes() ? j : info.GetMaxPrefixBytes());
+
+  for (j=0;j<3;j++) {
+    size[j]=candidate[j].length;
+  }
+  for (i=0;i<info.numkeys;i++) {
+    rc=GetKey(i,k);
+    if (rc) { return rc; }
+    for (j=0;j<3;j++) {
+      size[j]+=k.length-CommonLength((char*)candidate[j].data,candidate[j].length,k);
+    }
+  }
+
+  for (best=0,j=1;j<3;j++) {
+    if (size[j]<size[best]) {
+      best=j;
+    }
+  }
+  return best==0 ? ERROR_NOERROR : SetPrefix(candidate[best]);
+}
+
+
 ostream & BTreeNode::Print(ostream &os) const 
 {
   os << "BTreeNode(info="<<info;
@@ -2,8 +2,10 @@
 #define _btree_ds
 
 #include <iostream>
+#include <string>
 #include "global.h"
 #include "block.h"
+#include "buffercache.h"
 
 using namespace std;
 
@@ -14,6 +16,14 @@ using namespace std;
 #define BTREE_INTERIOR_NODE 3
 #define BTREE_LEAF_NODE 4
 
+// How keys are stored and compared
+#define BTREE_KEY_BYTES 0   // any bytes, compared with memcmp
+#define BTREE_KEY_UINT32 1  // 4 byte unsigned integers, most significant byte first
+#define BTREE_KEY_UINT64 2  // 8 byte unsigned integers, most significant byte first
+#define BTREE_KEY_VARIABLE 3 // any bytes up to keysize long, with values up to
+                             // valuesize long, compared with memcmp and then
+                             // by length
+
 
 typedef Block Buffer;
 typedef Buffer KeyOrValue;
@@ -21,21 +31,53 @@ typedef KeyOrValue KEY_T;
 typedef KeyOrValue VALUE_T;
 
 
-class BufferCache;
 struct KeyValuePair;
 
 struct NodeMetadata {
   int nodetype;
+  int keytype;
   SIZE_T keysize; 
   SIZE_T valuesize;
   SIZE_T blocksize;
   SIZE_T rootnode; //meaningful only for superblock
   SIZE_T freelist; //meaningful only for superblock or a free block
+  SIZE_T highwater; //meaningful only for superblock, blocks from here on were never allocated
   SIZE_T numkeys;
 
   SIZE_T GetNumDataBytes() const;
   SIZE_T GetNumSlotsAsInterior() const;
   SIZE_T GetNumSlotsAsLeaf() const;
+  // The fewest keys a node other than the root may have.  Splits
+  // never leave less, and Delete borrows or merges to keep to it.
+  SIZE_T GetMinKeysAsInterior() const;
+  SIZE_T GetMinKeysAsLeaf() const;
+
+  // With variable length keys, what fits in a node depends on the
+  // lengths rather than on a count.  The room a node has for slots
+  // and entries, the room an entry with keys and values of the given
+  // lengths takes up, and the least a node other than the root may
+  // use.  Splits never leave less, and Delete borrows or merges to
+  // keep to it.
+  SIZE_T GetNumPageBytes() const;
+  SIZE_T GetEntryBytesAsInterior(const SIZE_T keylen) const;
+  SIZE_T GetEntryBytesAsLeaf(const SIZE_T keylen, const SIZE_T vallen) const;
+  SIZE_T GetMinBytesAsInterior() const;
+  SIZE_T GetMinBytesAsLeaf() const;
+  // The longest prefix an interior node may have
+  SIZE_T GetMaxPrefixBytes() const;
+
+  // Whether a key or value n bytes long can go in the index
+  bool IsKeySize(const SIZE_T n) const;
+  bool IsValueSize(const SIZE_T n) const;
+
+  // returns one of ERROR_NOERROR or ERROR_BADCONFIG if name is not
+  // one of bytes, u32, u64, or var
+  static ERROR_T ParseKeyType(const string &name, int &type);
+  // ERROR_SIZE if keys of type can't be keysize bytes long
+  static ERROR_T CheckKeyType(const int type, const SIZE_T keysize);
+  // ERROR_SIZE if a block of blocksize can't hold enough of the
+  // longest entries for splits and merges to work
+  ERROR_T CheckSizes() const;
 
   ostream &Print(ostream &rhs) const;
 			  
@@ -55,7 +97,42 @@ inline ostream & operator<< (ostream &os, const NodeMetadata &node) { return nod
 //
 // PTR* KEY VALUE KEY VALUE KEY VALUE
 //
-// *Here this pointer is not used
+// *Here this pointer is the next leaf to the right (0 if none)
+//
+// With integer keys (keytype other than BTREE_KEY_BYTES) the keys
+// are instead kept together so that they can be searched with vector
+// instructions, each as a host order integer with its top bit
+// flipped, which orders the same way as the user's bytes do:
+//
+// Interior node:
+//
+// KEY KEY KEY ... PTR PTR PTR PTR ...
+//
+// Leaf:
+//
+// PTR* KEY KEY KEY ... VALUE VALUE VALUE ...
+//
+// With variable length keys (BTREE_KEY_VARIABLE) a node is a slotted
+// page.  After the first pointer come the number of bytes in the
+// heap of entries, which grows down from the end of the node, the
+// length of the node's prefix, and then an array of the offsets of
+// the entries in key order, which grows up toward the heap.  The
+// offsets, lengths and sizes are 2 bytes each.  The ith entry of an
+// interior node has key i and the pointer after it.
+//
+// An interior node keeps a prefix at the top of its heap, and each
+// key only has what follows the first SHARED bytes of it, which are
+// those of the prefix.  Any key can go in, whatever it has in common
+// with the prefix.  Leaves have no prefix.
+//
+// Interior node:
+//
+// PTR HEAP PLEN OFF OFF ... free ... LEN SHARED REST PTR ... PREFIX
+//
+// Leaf:
+//
+// PTR* HEAP 0 OFF OFF ... free ... KEYLEN VALLEN KEY VALUE ...
+//
 
 
 struct BTreeNode {
@@ -65,6 +142,11 @@ struct BTreeNode {
   // unallocated or superblock => blank
   // interior => array of keys
   // leaf => array of key/value pairs
+  //
+  // After Pin, data points into the cached block held by page
+  // rather than at our own copy.  The first Set* makes a private
+  // copy, so a pinned node can still be modified and Serialized.
+  PageHandle    page;
 
 
   BTreeNode();
@@ -74,29 +156,80 @@ struct BTreeNode {
   //         because we will serialize it directly to disk
   //
   ~BTreeNode();
-  BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size);
+  BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size,
+	    int key_type=BTREE_KEY_BYTES);
   BTreeNode(const BTreeNode &rhs);
   BTreeNode & operator=(const BTreeNode &rhs);
   
   ERROR_T Serialize(BufferCache *b, const SIZE_T block) const;
   ERROR_T Unserialize(BufferCache *b, const SIZE_T block);
+  // Like Unserialize, but without copying (see page above)
+  ERROR_T Pin(BufferCache *b, const SIZE_T block);
+  // Make sure data is our own copy
+  ERROR_T Unshare();
 
   char *ResolveKey(const SIZE_T offset) const; // Gives a pointer to the ith key  (interior or leaf)
   char *ResolvePtr(const SIZE_T offset) const; // Gives a pointer to the ith pointer (interior)
   char *ResolveVal(const SIZE_T offset) const; // Gives a pointer to the ith value (leaf)
   char *ResolveKeyVal(const SIZE_T offset) const ; // Gives a pointer to the ith keyvalue pair (leaf)
+  char *ResolveKeys() const; // Gives a pointer to the first key  (interior or leaf, fixed size keys)
+  char *ResolveEntry(const SIZE_T offset) const; // Gives a pointer to the ith entry (variable length keys)
 
   ERROR_T GetKey(const SIZE_T offset, KEY_T &k) const ; // Gives the ith key  (interior or leaf)
   ERROR_T GetPtr(const SIZE_T offset, SIZE_T &p) const ;   // Gives the ith pointer (interior)
   ERROR_T GetVal(const SIZE_T offset, VALUE_T &v) const ; // Gives  the ith value (leaf)
   ERROR_T GetKeyVal(const SIZE_T offset, KeyValuePair &p) const; // Gives  the ith key value pair (leaf)
 
+  // <0, 0, >0 as the ith key is less than, equal to, or greater
+  // than k, in the same order as KEY_T::operator<, without copying
+  int CompareKey(const SIZE_T offset, const KEY_T &k) const;
+  // Binary searches of the sorted keys, also without copying, and
+  // using vector compares for integer keys.
+  // The first offset whose key is greater than k (LowerBound: not
+  // less than k), or numkeys if there is none.
+  SIZE_T UpperBound(const KEY_T &k) const;
+  SIZE_T LowerBound(const KEY_T &k) const;
+
 
   ERROR_T SetKey(const SIZE_T offset, const KEY_T &k); // Writesthe ith key  (interior or leaf)
   ERROR_T SetPtr(const SIZE_T offset, const SIZE_T &p);   // Writes the ith pointer (interior)
   ERROR_T SetVal(const SIZE_T offset, const VALUE_T &v); // Writes the ith value (leaf)
   ERROR_T SetKeyVal(const SIZE_T offset, const KeyValuePair &p); // Writes the ith key value pair (leaf)
 
+  // Move the entries from the ith on up one and put a new ith entry
+  // in the gap: a key and value (leaf), or a key and the pointer
+  // after it (interior).  There is always room in a node that isn't
+  // overfull, otherwise these may fail with ERROR_NOSPACE.
+  ERROR_T InsertKeyVal(const SIZE_T offset, const KEY_T &k, const VALUE_T &v);
+  ERROR_T InsertKeyPtr(const SIZE_T offset, const KEY_T &k, const SIZE_T &p);
+  // Take out the ith entry (interior: key i and pointer i+1) and
+  // close up the gap
+  ERROR_T RemoveEntry(const SIZE_T offset);
+
+  // An overfull node can't take another entry of the largest size,
+  // and has to be split.  Nodes at rest never are.  An underfull
+  // one has less than the minimum, which only the root may have.
+  bool IsOverfull() const;
+  bool IsUnderfull() const;
+  // Whether the node would still not be underfull without the ith entry
+  bool CanLend(const SIZE_T offset) const;
+  // How to split an overfull node: the first entry of the right
+  // half (leaf), or the entry whose key goes up (interior)
+  SIZE_T SplitPoint() const;
+  // Bytes used by slots and entries (variable length keys only)
+  SIZE_T GetUsedBytes() const;
+  // The same as if an interior node had no prefix, which is what
+  // IsUnderfull and CanLend go by
+  SIZE_T GetFullBytes() const;
+
+  // The prefix of an interior node (variable length keys only), and
+  // putting the entries in again around another one, which fails
+  // with ERROR_NOSPACE, leaving the node as it was, if they no
+  // longer fit.  Rebase picks the prefix that takes up least room.
+  ERROR_T GetPrefix(KEY_T &p) const;
+  ERROR_T SetPrefix(const KEY_T &p);
+  ERROR_T Rebase();
+
   ostream &Print(ostream &rhs) const;
 };
 
@@ -4,7 +4,7 @@
 
 void usage() 
 {
-  cerr << "usage: btree_init filestem cachesize keysize valuesize\n";
+  cerr << "usage: btree_init filestem cachesize keysize valuesize [bytes|u32|u64|var]\n";
 }
 
 
@@ -13,8 +13,9 @@ int main(int argc, char **argv)
   char *filestem;
   SIZE_T cachesize, keysize, valuesize;
   SIZE_T superblocknum;
+  int keytype=BTREE_KEY_BYTES;
 
-  if (argc!=5) { 
+  if (argc!=5 && argc!=6) { 
     usage();
     return -1;
   }
@@ -23,10 +24,14 @@ int main(int argc, char **argv)
   cachesize=atoi(argv[2]);
   keysize=atoi(argv[3]);
   valuesize=atoi(argv[4]);
+  if (argc==6 && NodeMetadata::ParseKeyType(argv[5],keytype)!=ERROR_NOERROR) {
+    usage();
+    return -1;
+  }
 
   DiskSystem disk(filestem);
   BufferCache cache(&disk,cachesize);
-  BTreeIndex btree(keysize,valuesize,&cache);
+  BTreeIndex btree(keysize,valuesize,&cache,true,keytype);
   
   ERROR_T rc;
 
@@ -1,9 +1,10 @@
 #include <stdlib.h>
+#include <unistd.h>
 #include "btree.h"
 
 void usage() 
 {
-  cerr << "usage: btree_lookup filestem cachesize key\n";
+  cerr << "usage: btree_lookup [-m normal|random|sequential] filestem cachesize key\n";
 }
 
 
@@ -13,15 +14,26 @@ int main(int argc, char **argv)
   SIZE_T cachesize;
   SIZE_T superblocknum;
   char *key;
+  bool map=false;
+  DiskAccessPattern pattern=DISK_ACCESS_RANDOM;
+  int opt;
 
-  if (argc!=4) { 
+  while ((opt=getopt(argc,argv,"m:"))!=-1) {
+    if (opt!='m' || DiskSystem::ParseAccessPattern(optarg,pattern)!=ERROR_NOERROR) {
+      usage();
+      return -1;
+    }
+    map=true;
+  }
+
+  if (argc-optind!=3) { 
     usage();
     return -1;
   }
 
-  filestem=argv[1];
-  cachesize=atoi(argv[2]);
-  key=argv[3];
+  filestem=argv[optind];
+  cachesize=atoi(argv[optind+1]);
+  key=argv[optind+2];
 
   DiskSystem disk(filestem);
   BufferCache cache(&disk,cachesize);
@@ -29,6 +41,10 @@ int main(int argc, char **argv)
   
   ERROR_T rc;
 
+  if (map && (rc=disk.Map(pattern))!=ERROR_NOERROR) {
+    cerr << "Can't map disk due to error "<<rc<<endl;
+    return -1;
+  }
 
   if ((rc=cache.Attach())!=ERROR_NOERROR) { 
     cerr << "Can't attach buffer cache due to error"<<rc<<endl;
@@ -1,92 +1,610 @@
+#include <vector>
+#include <algorithm>
+
 #include "buffercache.h"
 
-ERROR_T BufferCache::CheckDeleteOldest()
+
+CacheShard::CacheShard(const SIZE_T cs, const CachePolicyType pt) :
+  cachesize(cs), frames(cs), policy(CachePolicy::Create(pt,cs)),
+  dirtyhead(0), dirtytail(0), numdirty(0), writeseq(0), inflight(0),
+  reads(0), writes(0), diskreads(0), diskwrites(0), writerequests(0),
+  hits(0), misses(0), prefetches(0), prefetchhits(0), backgroundwrites(0)
+{
+  pthread_mutex_init(&lock,0);
+}
+
+CacheShard::~CacheShard()
 {
-  // In a real buffer cache, we would use a priority queue to make this O(1)
+  delete policy;
+  pthread_mutex_destroy(&lock);
+}
 
-  map<SIZE_T, Block, cache_compare_lessthan>::iterator oldestptr=blockmap.end();
-  double oldest = curtime+1;
 
-  // Only delete if the cache is full
-  if (blockmap.size() < cachesize) {
-    return ERROR_NOERROR;
+CacheShard *BufferCache::ShardOf(const SIZE_T blocknum) const
+{
+  return shards[(blocknum/BUFFERCACHE_SHARD_RUN) % shards.size()];
+}
+
+void BufferCache::LockAll() const
+{
+  for (SIZE_T i=0;i<shards.size();i++) {
+    pthread_mutex_lock(&(shards[i]->lock));
+  }
+}
+
+void BufferCache::UnlockAll() const
+{
+  for (SIZE_T i=shards.size();i>0;i--) {
+    pthread_mutex_unlock(&(shards[i-1]->lock));
   }
+}
 
-  // Find oldest
+SIZE_T BufferCache::Sum(SIZE_T CacheShard::*counter) const
+{
+  SIZE_T total=0;
 
-  for (map<SIZE_T, Block, cache_compare_lessthan>::iterator i=blockmap.begin();
-	 i!=blockmap.end();
-	 ++i) {
-       if ((*i).second.lastaccessed<oldest) { 
-	 oldestptr=i;
-	 oldest=(*i).second.lastaccessed;
-       }
+  for (SIZE_T i=0;i<shards.size();i++) {
+    MutexHolder l(&(shards[i]->lock));
+    total+=shards[i]->*counter;
   }
-  
-  // write and delete it if it exists
- 
-  if (oldestptr!=blockmap.end()) { 
-    if ((*oldestptr).second.dirty) {
-      double reqtime;
-      int rc=disk->Write((*oldestptr).first,
-			 (*oldestptr).second,
-			 reqtime);
-      curtime+=reqtime;
-      diskwrites++;
-      if (rc!=ERROR_NOERROR) { 
+  return total;
+}
+
+double BufferCache::Now() const
+{
+  MutexHolder d(&disklock);
+  return curtime;
+}
+
+//
+// The disk serves one request at a time.  diskfree is the time at
+// which it finishes the work it has been given so far.  A new
+// request starts once that work is done (or now, if the disk is
+// idle).  Foreground requests stall the caller until they are
+// done; background ones (prefetches) only occupy the disk.
+// Returns the completion time of the request.  Call with disklock
+// held.
+//
+double BufferCache::ChargeDisk(const double reqtime, const bool background)
+{
+  double start = diskfree>curtime ? diskfree : curtime;
+
+  diskfree=start+reqtime;
+  if (!background) {
+    curtime=diskfree;
+  }
+  return diskfree;
+}
+
+// Called on a hit: wait for the block if it is still being read
+void BufferCache::WaitForFrame(CacheShard *s, CacheFrame *f)
+{
+  if (f->prefetched) {
+    pthread_mutex_lock(&disklock);
+    if (f->readytime>curtime) {
+      curtime=f->readytime;
+    }
+    pthread_mutex_unlock(&disklock);
+    f->prefetched=false;
+    s->prefetchhits++;
+    s->inflight--;
+  }
+}
+
+// Wait for the real read of a prefetched block, if it is still in
+// flight.  Call before the frame is used or reused.
+ERROR_T BufferCache::WaitForRead(CacheFrame *f)
+{
+  ERROR_T rc=ERROR_NOERROR;
+
+  if (f->pending) {
+    rc=disk->Wait(*(f->pending));
+    delete f->pending;
+    f->pending=0;
+  }
+  return rc;
+}
+
+// Returns false, and forgets the block, if its prefetch failed
+bool BufferCache::FinishPrefetch(CacheShard *s, CacheFrame *f)
+{
+  if (WaitForRead(f)==ERROR_NOERROR) {
+    return true;
+  }
+  s->inflight--;
+  s->policy->Remove(f);
+  s->frames.Erase(f);
+  return false;
+}
+
+//
+// Dirty blocks are kept on a list in the order in which they became
+// dirty, so that the flusher can find the oldest one in O(1).
+// version changes on every write, which lets the flusher tell
+// whether the copy it wrote out is still the current one.
+//
+void BufferCache::MarkDirty(CacheShard *s, CacheFrame *f)
+{
+  if (f->dirtyprev==0 && s->dirtyhead!=f) {
+    f->dirtytime=Now();
+    f->dirtyprev=0;
+    f->dirtynext=s->dirtyhead;
+    if (s->dirtyhead) {
+      s->dirtyhead->dirtyprev=f;
+    } else {
+      s->dirtytail=f;
+    }
+    s->dirtyhead=f;
+    s->numdirty++;
+  }
+  f->block.dirty=true;
+  f->version=++s->writeseq;
+}
+
+void BufferCache::MarkClean(CacheShard *s, CacheFrame *f)
+{
+  f->block.dirty=false;
+  if (f->dirtyprev==0 && s->dirtyhead!=f) {
+    return;
+  }
+  if (f->dirtyprev) {
+    f->dirtyprev->dirtynext=f->dirtynext;
+  } else {
+    s->dirtyhead=f->dirtynext;
+  }
+  if (f->dirtynext) {
+    f->dirtynext->dirtyprev=f->dirtyprev;
+  } else {
+    s->dirtytail=f->dirtyprev;
+  }
+  f->dirtyprev=f->dirtynext=0;
+  f->dirtytime=0;
+  s->numdirty--;
+}
+
+//
+// Add the bytes of f to a batch of blocks to be written.  A block
+// that lives in the mapped disk is already where it is going, so the
+// batch only borrows it, and a concurrent write of the frame can't
+// be overwritten by an older copy.  blocks must have room reserved,
+// since moving a borrowing Block would make a real copy.
+//
+static void AddToBatch(vector<Block> &blocks, const CacheFrame *f)
+{
+  if (f->block.IsBorrowed()) {
+    blocks.push_back(Block());
+    blocks.back().Borrow(f->block.data,f->block.length);
+  } else {
+    blocks.push_back(f->block);
+  }
+}
+
+//
+// A frame for a block that is not resident.  On a mapped disk its
+// Block borrows the block's mapped bytes, so reading it in costs
+// neither a copy nor a system call, and writes to it go straight to
+// the mapping.  Otherwise it needs storage of its own, aligned the
+// way the disk wants it so that direct I/O goes straight into it.
+//
+CacheFrame *BufferCache::NewFrame(CacheShard *s, const SIZE_T blocknum)
+{
+  CacheFrame *f=s->frames.Insert(blocknum);
+  BYTE_T *m=disk->GetMappedBlock(blocknum);
+
+  if (m) {
+    f->block.Borrow(m,GetBlockSize());
+  } else {
+    f->block.Align(disk->GetAlignment());
+    if (f->block.IsBorrowed()) {
+      f->block.Resize(GetBlockSize(),false);
+    }
+  }
+  return f;
+}
+
+//
+// A frame to take f's place, for a write while f is pinned.  The
+// pins keep f, and the bytes they point at, until the last of them
+// goes (see Unpin).  The new frame has storage of its own even on a
+// mapped disk, since the mapping is what the pins are looking at;
+// the new bytes get there when the block is written back.  It takes
+// f's place on the dirty list too, so the block keeps its age.
+//
+CacheFrame *BufferCache::ReplaceFrame(CacheShard *s, CacheFrame *f)
+{
+  CacheFrame *n=s->frames.Replace(f);
+
+  n->block.Align(disk->GetAlignment());
+  if (n->block.IsBorrowed()) {
+    n->block.Resize(GetBlockSize(),false);
+  }
+  n->block.lastaccessed=f->block.lastaccessed;
+  n->readytime=f->readytime;
+  n->version=f->version;
+  if (f->dirtyprev || s->dirtyhead==f) {
+    n->dirtyprev=f->dirtyprev;
+    n->dirtynext=f->dirtynext;
+    n->dirtytime=f->dirtytime;
+    if (f->dirtyprev) {
+      f->dirtyprev->dirtynext=n;
+    } else {
+      s->dirtyhead=n;
+    }
+    if (f->dirtynext) {
+      f->dirtynext->dirtyprev=n;
+    } else {
+      s->dirtytail=n;
+    }
+    f->dirtyprev=f->dirtynext=0;
+    f->dirtytime=0;
+  }
+  n->block.dirty=f->block.dirty;
+  f->block.dirty=false;
+  // f is pinned, so it is off the policy's lists
+  n->queue=f->queue;
+  n->referenced=f->referenced;
+  s->policy->Unpin(n);
+  return n;
+}
+
+// Tell the policy about a hit.  A pinned frame is off its lists, so
+// it goes back on just long enough to be touched.
+void BufferCache::Touch(CacheShard *s, CacheFrame *f)
+{
+  if (f->pincount>0) {
+    s->policy->Unpin(f);
+    s->policy->Touch(f);
+    s->policy->Pin(f);
+  } else {
+    s->policy->Touch(f);
+  }
+}
+
+//
+// Write blocks[i] to blocknums[i], which must be in ascending order,
+// using one multiblock request for each run of consecutive block
+// numbers.  The runs are found before anything is reordered, so a
+// run that straddles the head position stays one request; the
+// scheduler only moves whole requests.  When there are several,
+// they go to the disk as one batch, which it serves in the order
+// its scheduler picks, and the device sees all of them at once.
+// Only the disk lock is needed, and it is held until they are done
+// so that batches don't overtake each other.
+//
+ERROR_T BufferCache::WriteRuns(const vector<SIZE_T> &blocknums,
+			       const vector<Block> &blocks,
+			       const bool background,
+			       SIZE_T &numrequests)
+{
+  vector<DiskRequest> reqs;
+  SIZE_T i, j;
+  double reqtime;
+  ERROR_T rc=ERROR_NOERROR, rc2;
+
+  for (i=0;i<blocknums.size();i=j) {
+    for (j=i+1;j<blocknums.size() && blocknums[j]==blocknums[j-1]+1;j++) {
+    }
+    DiskRequest req;
+    req.write=true;
+    req.offblock=blocknums[i];
+    req.numblock=j-i;
+    // only read from
+    req.blocks=const_cast<Block *>(&(blocks[i]));
+    reqs.push_back(req);
+  }
+
+  MutexHolder d(&disklock);
+
+  if (reqs.size()==1) {
+    // nothing to overlap with
+    rc=disk->Write(reqs[0].offblock,reqs[0].numblock,blocks,reqtime);
+    numrequests=1;
+    ChargeDisk(reqtime,background);
+    return rc;
+  }
+
+  rc=disk->Submit(reqs);
+  if (rc!=ERROR_NOERROR) {
+    numrequests=0;
+    return rc;
+  }
+  numrequests=reqs.size();
+  reqtime=0;
+  for (i=0;i<reqs.size();i++) {
+    reqtime+=reqs[i].reqtime;
+    rc2=disk->Wait(reqs[i]);
+    if (rc==ERROR_NOERROR) {
+      rc=rc2;
+    }
+  }
+  ChargeDisk(reqtime,background);
+  return rc;
+}
+
+//
+// Write out the given resident blocks of shard s and mark them
+// clean.  They stay in the cache.
+//
+ERROR_T BufferCache::WriteDirty(CacheShard *s, vector<SIZE_T> &blocknums, const bool background)
+{
+  vector<Block> blocks;
+  SIZE_T numrequests;
+  ERROR_T rc;
+  SIZE_T i;
+
+  sort(blocknums.begin(),blocknums.end());
+  blocks.reserve(blocknums.size());
+  for (i=0;i<blocknums.size();i++) {
+    AddToBatch(blocks,s->frames.Find(blocknums[i]));
+  }
+  rc=WriteRuns(blocknums,blocks,background,numrequests);
+  s->diskwrites+=blocknums.size();
+  s->writerequests+=numrequests;
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+  for (i=0;i<blocknums.size();i++) {
+    MarkClean(s,s->frames.Find(blocknums[i]));
+  }
+  return ERROR_NOERROR;
+}
+
+ERROR_T BufferCache::CheckEvict(CacheShard *s, const SIZE_T incoming, const bool background)
+{
+  CacheFrame *victim;
+
+  // Only delete if the cache is full.  It may be over full if
+  // everything was pinned the last time we tried.
+  while (s->frames.GetSize() >= s->cachesize) {
+    victim=s->policy->Victim(incoming);
+    if (!victim) {
+      // nothing resident, or all of it is pinned
+      break;
+    }
+
+    // write and delete it
+    if (victim->block.dirty) {
+      // Any dirty neighbors ride along in the same request, which
+      // costs next to nothing once the head is there
+      vector<SIZE_T> blocknums;
+      CacheFrame *n;
+      SIZE_T first, last;
+
+      for (first=victim->blocknum; first>0 && ShardOf(first-1)==s; first--) {
+	n=s->frames.Find(first-1);
+	if (!n || !n->block.dirty) {
+	  break;
+	}
+      }
+      for (last=victim->blocknum; ShardOf(last+1)==s; last++) {
+	n=s->frames.Find(last+1);
+	if (!n || !n->block.dirty) {
+	  break;
+	}
+      }
+      for (SIZE_T i=first;i<=last;i++) {
+	blocknums.push_back(i);
+      }
+      ERROR_T rc=WriteDirty(s,blocknums,background);
+      if (rc!=ERROR_NOERROR) {
+	// keep it around, we still have the only copy
+	s->policy->Reinstate(victim);
 	return rc;
       }
     }
-    blockmap.erase(oldestptr);
+    if (victim->prefetched) {
+      // never used, so the prefetch was wasted
+      WaitForRead(victim);
+      s->inflight--;
+    }
+    s->frames.Erase(victim);
   }
   return ERROR_NOERROR;
 }
 
 BufferCache::BufferCache(DiskSystem *d,
-			 SIZE_T cs) : 
-   disk(d), cachesize(cs), curtime(0),
-   allocs(0), deallocs(0), reads(0), writes(0),
-   diskreads(0), diskwrites(0)
-{}
+			 SIZE_T cs,
+			 const CachePolicyType pt,
+			 const SIZE_T ns) :
+   disk(d), cachesize(cs), curtime(0), diskfree(0),
+   allocs(0), deallocs(0),
+   flusherstarted(false), flusherrunning(false), flusherstop(false),
+   flushpending(false), flushing(false), flushpasses(0),
+   flusherror(ERROR_NOERROR),
+   dirtyratio(1), maxdirtyage(0), nextflushcheck(0)
+{
+  SIZE_T n=ns;
+
+  if (n>cs) {
+    n=cs;
+  }
+  if (n==0) {
+    n=1;
+  }
+  // the first cs%n shards get one block more than the rest
+  for (SIZE_T i=0;i<n;i++) {
+    shards.push_back(new CacheShard(cs/n + (i<cs%n ? 1 : 0),pt));
+  }
+  pthread_mutex_init(&disklock,0);
+  pthread_mutex_init(&flushlock,0);
+  pthread_cond_init(&flushwake,0);
+  pthread_cond_init(&flushdone,0);
+}
 
 
 BufferCache::~BufferCache()
 {
-  if (disk) { 
+  StopFlusher();
+  if (disk) {
     Detach();
   }
+  for (SIZE_T i=0;i<shards.size();i++) {
+    delete shards[i];
+  }
+  shards.clear();
   disk=0; cachesize=0; curtime=0;
+  pthread_cond_destroy(&flushwake);
+  pthread_cond_destroy(&flushdone);
+  pthread_mutex_destroy(&flushlock);
+  pthread_mutex_destroy(&disklock);
 }
 
 ERROR_T BufferCache::Attach()
 {
-  blockmap.clear();
-  return ERROR_NOERROR;
+  vector<CacheFrame *> resident;
+  CacheFrame *f;
+  SIZE_T pos;
+  ERROR_T rc=ERROR_NOERROR;
+
+  LockAll();
+  for (SIZE_T i=0;i<shards.size();i++) {
+    CacheShard *s=shards[i];
+    resident.clear();
+    // retired frames aren't in the table, and stay for their pins
+    for (pos=0; (f=s->frames.Next(pos)); ) {
+      resident.push_back(f);
+    }
+    for (pos=0;pos<resident.size();pos++) {
+      f=resident[pos];
+      if (f->pincount>0) {
+	// Pinned blocks have to stay where they are
+	rc=ERROR_CONFLICT;
+	continue;
+      }
+      if (f->prefetched) {
+	s->inflight--;
+      }
+      WaitForRead(f);
+      MarkClean(s,f);
+      s->policy->Remove(f);
+      s->frames.Erase(f);
+    }
+  }
+  UnlockAll();
+  return rc;
 }
 
 ERROR_T BufferCache::Detach()
 {
   // write out all of our data and then throw it away
 
-  for (map<SIZE_T, Block, cache_compare_lessthan>::iterator i=blockmap.begin();
-	 i!=blockmap.end();
-	 ++i) {
-    if ((*i).second.dirty) { 
-      double reqtime;
-      int rc=disk->Write((*i).first,
-			 (*i).second,
-			 reqtime);
-      curtime+=reqtime;
-      diskwrites++;
-      if (rc!=ERROR_NOERROR) { 
-	return rc;
+  vector<CacheFrame *> resident;
+  CacheFrame *f;
+  SIZE_T pos;
+  ERROR_T flushrc;
+
+  // a write the flusher couldn't do is reported once
+  pthread_mutex_lock(&flushlock);
+  flushrc=flusherror;
+  flusherror=ERROR_NOERROR;
+  pthread_mutex_unlock(&flushlock);
+
+  LockAll();
+
+  ERROR_T rc=WriteAllDirty();
+  if (rc!=ERROR_NOERROR) {
+    UnlockAll();
+    return rc;
+  }
+  for (SIZE_T i=0;i<shards.size();i++) {
+    CacheShard *s=shards[i];
+    resident.clear();
+    for (pos=0; (f=s->frames.Next(pos)); ) {
+      resident.push_back(f);
+    }
+    for (pos=0;pos<resident.size();pos++) {
+      f=resident[pos];
+      if (f->pincount>0) {
+	// Pinned blocks have to stay where they are
+	rc=ERROR_CONFLICT;
+      } else {
+	if (f->prefetched) {
+	  WaitForRead(f);
+	  s->inflight--;
+	}
+	s->policy->Remove(f);
+	s->frames.Erase(f);
       }
     }
   }
-  blockmap.clear();
+  // a mapped disk has to get the writes to the file
+  ERROR_T rc2=disk->Sync();
+  if (rc==ERROR_NOERROR) {
+    rc=rc2;
+  }
+  // anything still outstanding on the disk has to finish as well
+  pthread_mutex_lock(&disklock);
+  if (diskfree>curtime) {
+    curtime=diskfree;
+  }
+  pthread_mutex_unlock(&disklock);
+
+  UnlockAll();
+  if (rc==ERROR_NOERROR) {
+    rc=flushrc;
+  }
+  return rc;
+}
+
+
+// Call with all of the shards locked
+ERROR_T BufferCache::WriteAllDirty()
+{
+  vector<SIZE_T> blocknums;
+  vector<Block> blocks;
+  SIZE_T i, numrequests;
+  CacheShard *s;
+  CacheFrame *f;
+  ERROR_T rc;
+
+  for (i=0;i<shards.size();i++) {
+    for (f=shards[i]->dirtyhead; f; f=f->dirtynext) {
+      blocknums.push_back(f->blocknum);
+    }
+  }
+  if (blocknums.empty()) {
+    return ERROR_NOERROR;
+  }
+
+  // One batch for all of the shards together
+  sort(blocknums.begin(),blocknums.end());
+  blocks.reserve(blocknums.size());
+  for (i=0;i<blocknums.size();i++) {
+    AddToBatch(blocks,ShardOf(blocknums[i])->frames.Find(blocknums[i]));
+  }
+  rc=WriteRuns(blocknums,blocks,false,numrequests);
+  // charge the requests to the first shard, the totals are what matter
+  shards[0]->diskwrites+=blocknums.size();
+  shards[0]->writerequests+=numrequests;
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+  for (i=0;i<blocknums.size();i++) {
+    s=ShardOf(blocknums[i]);
+    MarkClean(s,s->frames.Find(blocknums[i]));
+  }
   return ERROR_NOERROR;
 }
 
+ERROR_T BufferCache::Checkpoint()
+{
+  LockAll();
+
+  ERROR_T rc=WriteAllDirty();
+  if (rc==ERROR_NOERROR) {
+    rc=disk->Sync();
+  }
+  // everything, including any background work, is on disk
+  pthread_mutex_lock(&disklock);
+  if (diskfree>curtime) {
+    curtime=diskfree;
+  }
+  pthread_mutex_unlock(&disklock);
+
+  UnlockAll();
+  return rc;
+}
+
 
 SIZE_T BufferCache::GetCacheSize() const
 {
@@ -106,17 +624,31 @@ SIZE_T BufferCache::GetNumBlocks() const
 
 double BufferCache::GetCurrentTime() const
 {
-  return curtime;
+  return Now();
+}
+
+SIZE_T BufferCache::GetNumAllocs() const
+{
+  MutexHolder d(&disklock);
+  return allocs;
+}
+
+SIZE_T BufferCache::GetNumDeallocs() const
+{
+  MutexHolder d(&disklock);
+  return deallocs;
 }
 
 ERROR_T BufferCache::NotifyAllocateBlock(const SIZE_T outblocknum)
 {
+  MutexHolder d(&disklock);
   allocs++;
   return disk->NotifyAllocateBlocks(outblocknum,1);
 }
 
 ERROR_T BufferCache::NotifyDeallocateBlock(const SIZE_T inblocknum)
 {
+  MutexHolder d(&disklock);
   deallocs++;
   return disk->NotifyDeallocateBlocks(inblocknum,1);
 }
@@ -124,135 +656,621 @@ ERROR_T BufferCache::NotifyDeallocateBlock(const SIZE_T inblocknum)
 
 bool  BufferCache::IsBlockAllocated(const SIZE_T inblocknum)
 {
+  MutexHolder d(&disklock);
   return disk->IsBlockAllocated(inblocknum);
 }
 
 
-ERROR_T BufferCache::ReadBlock(const SIZE_T inblocknum, Block &outblock) 
+//
+// Find the frame holding a block, reading it in if it isn't
+// resident.  s must be the block's shard, and locked.  who is only
+// used for error messages.
+//
+ERROR_T BufferCache::Fetch(CacheShard *s, const SIZE_T inblocknum, CacheFrame *&f, const char *who)
 {
-  map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
+  f = s->frames.Find(inblocknum);
 
-  b = blockmap.find(inblocknum);
+  if (f && !FinishPrefetch(s,f)) {
+    // read it again below
+    f=0;
+  }
 
-  if (b!=blockmap.end()) {
-    // It's in  cache, just update its lastaccessed and return it
-    outblock=(*b).second;
-    (*b).second.lastaccessed=curtime;
-    reads++;
+  if (f) {
+    // It's in  cache, just tell the replacement policy, and
+    // return it
+    WaitForFrame(s,f);
+    Touch(s,f);
+    s->reads++;
+    s->hits++;
     return ERROR_NOERROR;
   } else {
     // It's not in cache, so time to allocate it
-    CheckDeleteOldest();
-    // read it from disk
-    if (!(disk->IsBlockAllocated(inblocknum))) { 
+    CheckEvict(s,inblocknum);
+    // read it from disk straight into a frame.  The disk is
+    // thread safe, so only the clock needs disklock, and misses in
+    // other shards can be on the device at the same time.
+    if (!(disk->IsBlockAllocated(inblocknum))) {
       if (PRINT_BUFFERCACHE_ALLOCATION_ERRORS) {
-	cerr << "BufferCache::ReadBlock: Attempt to read unallocated block " << inblocknum<<endl;
+	cerr << who << ": Attempt to read unallocated block " << inblocknum<<endl;
       }
     }
-    double reqtime;
+    f=NewFrame(s,inblocknum);
+    double reqtime, now=0;
     int rc = disk->Read(inblocknum,
-			outblock,
+			f->block,
 			reqtime);
-    curtime+=reqtime;
-    diskreads++;
-    if (rc!=ERROR_NOERROR) { 
+    if (rc==ERROR_NOERROR) {
+      pthread_mutex_lock(&disklock);
+      now=ChargeDisk(reqtime);
+      pthread_mutex_unlock(&disklock);
+    }
+    s->diskreads++;
+    if (rc!=ERROR_NOERROR) {
+      s->frames.Erase(f);
+      f=0;
       return rc;
     } else {
-      outblock.lastaccessed=curtime;
-      outblock.dirty=false;
-      blockmap[inblocknum]=outblock;
-      reads++;
+      f->block.lastaccessed=now;
+      f->block.dirty=false;
+      f->readytime=now;
+      f->prefetched=false;
+      s->policy->Insert(f);
+      s->reads++;
+      s->misses++;
       return ERROR_NOERROR;
     }
   }
-} 
- 
+}
+
+ERROR_T BufferCache::ReadBlock(const SIZE_T inblocknum, Block &outblock)
+{
+  CacheShard *s=ShardOf(inblocknum);
+  CacheFrame *f;
+  bool wake;
+
+  pthread_mutex_lock(&(s->lock));
+  ERROR_T rc=Fetch(s,inblocknum,f,"BufferCache::ReadBlock");
+  if (rc==ERROR_NOERROR) {
+    outblock=f->block;
+  }
+  wake=FlushDue(s);
+  pthread_mutex_unlock(&(s->lock));
+
+  if (wake) {
+    WakeFlusher();
+  }
+  return rc;
+}
+
+ERROR_T BufferCache::PinBlock(const SIZE_T inblocknum, PageHandle &handle)
+{
+  CacheShard *s=ShardOf(inblocknum);
+  CacheFrame *f;
+  ERROR_T rc;
+  bool wake;
+
+  pthread_mutex_lock(&(s->lock));
+  rc=Fetch(s,inblocknum,f,"BufferCache::PinBlock");
+  if (rc==ERROR_NOERROR && f->pincount++==0) {
+    s->policy->Pin(f);
+  }
+  wake=FlushDue(s);
+  pthread_mutex_unlock(&(s->lock));
+
+  if (wake) {
+    WakeFlusher();
+  }
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+  // The old pin may be in another shard, so drop it separately
+  handle.Release();
+  handle.cache=this;
+  handle.frame=f;
+  return ERROR_NOERROR;
+}
+
+void BufferCache::Unpin(CacheFrame *f)
+{
+  CacheShard *s=ShardOf(f->blocknum);
+  MutexHolder l(&(s->lock));
+
+  if (--f->pincount==0) {
+    if (f->retired) {
+      s->frames.Release(f);
+    } else {
+      s->policy->Unpin(f);
+    }
+  }
+}
+
+void BufferCache::Repin(CacheFrame *f)
+{
+  MutexHolder l(&(ShardOf(f->blocknum)->lock));
+
+  f->pincount++;
+}
+
+
+PageHandle::PageHandle(const PageHandle &rhs) : cache(rhs.cache), frame(rhs.frame)
+{
+  if (frame) {
+    cache->Repin(frame);
+  }
+}
+
+PageHandle & PageHandle::operator=(const PageHandle &rhs)
+{
+  if (rhs.frame) {
+    rhs.cache->Repin(rhs.frame);
+  }
+  Release();
+  cache=rhs.cache;
+  frame=rhs.frame;
+  return *this;
+}
+
+void PageHandle::Release()
+{
+  if (frame) {
+    cache->Unpin(frame);
+  }
+  cache=0;
+  frame=0;
+}
+
+
 ERROR_T BufferCache::WriteBlock(const SIZE_T inblocknum, const Block &inblock)
 {
-  map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
-  
-  b = blockmap.find(inblocknum);
+  CacheShard *s=ShardOf(inblocknum);
+  CacheFrame *f;
+  bool wake;
+
+  pthread_mutex_lock(&(s->lock));
+
+  f = s->frames.Find(inblocknum);
+
+  if (f && !FinishPrefetch(s,f)) {
+    f=0;
+  }
 
-  if (b!=blockmap.end()) {
+  if (f) {
     // It's in  cache, so just replace the block
-    (*b).second=inblock;
-    (*b).second.lastaccessed=curtime;
-    (*b).second.dirty=true;
-    writes++;
-    return ERROR_NOERROR;
+    WaitForFrame(s,f);
+    if (f->pincount>0) {
+      // the pinned bytes have to stay as they are
+      f=ReplaceFrame(s,f);
+    }
+    f->block=inblock;
+    f->block.lastaccessed=Now();
+    MarkDirty(s,f);
+    s->policy->Touch(f);
+    s->writes++;
+    s->hits++;
   } else {
     // It's not in cache, so time to allocate it
-    CheckDeleteOldest();
-    if (!(disk->IsBlockAllocated(inblocknum))) { 
+    CheckEvict(s,inblocknum);
+    pthread_mutex_lock(&disklock);
+    if (!(disk->IsBlockAllocated(inblocknum))) {
       if (PRINT_BUFFERCACHE_ALLOCATION_ERRORS) {
 	cerr << "BufferCache::WriteBlock: Attempt to write unallocated block " << inblocknum << endl;
       }
     }
-    Block myblock=inblock;
-    myblock.lastaccessed=curtime;
-    myblock.dirty=true;
-    blockmap[inblocknum]=myblock;
-    writes++;
-    return ERROR_NOERROR;
+    pthread_mutex_unlock(&disklock);
+    f=NewFrame(s,inblocknum);
+    f->block=inblock;
+    f->block.lastaccessed=Now();
+    MarkDirty(s,f);
+    f->readytime=f->block.lastaccessed;
+    f->prefetched=false;
+    s->policy->Insert(f);
+    s->writes++;
+    s->misses++;
+  }
+  wake=FlushDue(s);
+  pthread_mutex_unlock(&(s->lock));
+
+  if (wake) {
+    WakeFlusher();
   }
+  return ERROR_NOERROR;
 }
-  
+
 ERROR_T BufferCache::PrefetchBlock (const SIZE_T blocknum)
 {
-  // Not implemented yet
-  return ERROR_IMPLBUG;
+  return PrefetchBlocks(vector<SIZE_T>(1,blocknum));
 }
-  
+
+ERROR_T BufferCache::PrefetchBlocks(const vector<SIZE_T> &blocknums)
+{
+  vector<bool> involved(shards.size(),false);
+  vector<DiskRequest *> reqs;
+  ERROR_T rc=ERROR_NOERROR, rc2;
+  CacheShard *s;
+  CacheFrame *f;
+  SIZE_T i;
+
+  for (i=0;i<blocknums.size();i++) {
+    involved[(blocknums[i]/BUFFERCACHE_SHARD_RUN)%shards.size()]=true;
+  }
+  // in index order, as LockAll does
+  for (i=0;i<shards.size();i++) {
+    if (involved[i]) {
+      pthread_mutex_lock(&(shards[i]->lock));
+    }
+  }
+
+  for (i=0;i<blocknums.size();i++) {
+    s=ShardOf(blocknums[i]);
+    if (s->frames.Find(blocknums[i])) {
+      // Already here or on its way
+      continue;
+    }
+    // Don't let speculation push out more than half of the cache.
+    // Making room is part of the background work.
+    if (s->cachesize==0 || s->inflight>=(s->cachesize+1)/2 ||
+	CheckEvict(s,blocknums[i],true)!=ERROR_NOERROR) {
+      rc=ERROR_NOFETCH;
+      continue;
+    }
+    // The read goes straight into a frame, which stays off the
+    // policy's lists (and so can't be chosen for eviction by the
+    // rest of the batch) until the read has been submitted
+    f=NewFrame(s,blocknums[i]);
+    if (f->block.length!=GetBlockSize()) {
+      f->block.Resize(GetBlockSize(),false);
+    }
+    DiskRequest *req=new DiskRequest;
+    req->write=false;
+    req->offblock=blocknums[i];
+    req->numblock=1;
+    req->blocks=&(f->block);
+    f->pending=req;
+    s->inflight++;
+    reqs.push_back(req);
+  }
+
+  // The reads are left in flight.  Whoever uses or evicts a block
+  // first waits for it.  The simulated requests complete only once
+  // the disk gets to them, in the order the scheduler serves them.
+  rc2=ERROR_NOERROR;
+  if (reqs.size()>0) {
+    pthread_mutex_lock(&disklock);
+    for (i=0;i<reqs.size();i++) {
+      if (!(disk->IsBlockAllocated(reqs[i]->offblock))) {
+	if (PRINT_BUFFERCACHE_ALLOCATION_ERRORS) {
+	  cerr << "BufferCache::PrefetchBlock: Attempt to prefetch unallocated block " << reqs[i]->offblock<<endl;
+	}
+      }
+    }
+    rc2=disk->Submit(reqs);
+    if (rc2==ERROR_NOERROR) {
+      for (i=0;i<reqs.size();i++) {
+	f=ShardOf(reqs[i]->offblock)->frames.Find(reqs[i]->offblock);
+	f->readytime=ChargeDisk(reqs[i]->reqtime,true);
+	f->block.lastaccessed=f->readytime;
+      }
+    }
+    pthread_mutex_unlock(&disklock);
+  }
+
+  for (i=0;i<reqs.size();i++) {
+    s=ShardOf(reqs[i]->offblock);
+    f=s->frames.Find(reqs[i]->offblock);
+    if (rc2!=ERROR_NOERROR) {
+      delete reqs[i];
+      f->pending=0;
+      s->inflight--;
+      s->frames.Erase(f);
+      continue;
+    }
+    s->diskreads++;
+    s->prefetches++;
+    f->block.dirty=false;
+    f->prefetched=true;
+    s->policy->Insert(f);
+  }
+
+  for (i=shards.size();i>0;i--) {
+    if (involved[i-1]) {
+      pthread_mutex_unlock(&(shards[i-1]->lock));
+    }
+  }
+
+  return rc2!=ERROR_NOERROR ? rc2 : rc;
+}
+
 ERROR_T BufferCache::FlushBlock(const SIZE_T blocknum)
 {
-  map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
-  
-  b = blockmap.find(blocknum);
+  CacheShard *s=ShardOf(blocknum);
+  CacheFrame *f;
+
+  MutexHolder l(&(s->lock));
+
+  f = s->frames.Find(blocknum);
 
-  if (b==blockmap.end()) { 
+  if (!f) {
     return ERROR_NOERROR;
   } else {
-    if ((*b).second.dirty) { 
+    if (f->block.dirty) {
       double reqtime;
       int rc;
-      rc=disk->Write((*b).first,
-		     (*b).second,
+      pthread_mutex_lock(&disklock);
+      rc=disk->Write(blocknum,
+		     f->block,
 		     reqtime);
-      diskwrites++;
-      curtime+=reqtime;
-      if (rc!=ERROR_NOERROR) { 
+      ChargeDisk(reqtime);
+      pthread_mutex_unlock(&disklock);
+      s->diskwrites++;
+      s->writerequests++;
+      if (rc==ERROR_NOERROR) {
+	rc=disk->Sync(blocknum,1);
+      }
+      if (rc!=ERROR_NOERROR) {
 	return rc;
       }
     }
-    blockmap.erase(b);
+    MarkClean(s,f);
+    if (f->pincount>0) {
+      // written, but someone is still looking at it
+      return ERROR_NOERROR;
+    }
+    if (f->prefetched) {
+      WaitForRead(f);
+      s->inflight--;
+    }
+    s->policy->Remove(f);
+    s->frames.Erase(f);
     return ERROR_NOERROR;
   }
 }
-  
+
+
+// Call with s locked.  maxdirtyage is zero unless the flusher is
+// running.
+bool BufferCache::FlushNeeded(const CacheShard *s) const
+{
+  if (!s->dirtytail || maxdirtyage<=0) {
+    return false;
+  }
+  return s->numdirty > dirtyratio*s->cachesize
+    || Now() - s->dirtytail->dirtytime >= maxdirtyage;
+}
+
+// Call with s locked, after using a block in it.  The flusher is
+// woken if s needs it, or if half of maxdirtyage has gone by on the
+// simulated clock since it was last woken for age, since by then a
+// block in some other shard may be too old.
+bool BufferCache::FlushDue(const CacheShard *s)
+{
+  if (maxdirtyage<=0) {
+    return false;
+  }
+  if (FlushNeeded(s)) {
+    return true;
+  }
+  MutexHolder d(&disklock);
+  if (curtime<nextflushcheck) {
+    return false;
+  }
+  nextflushcheck=curtime+maxdirtyage/2;
+  return true;
+}
+
+// Call with no shard locked.  Waits for a pass that starts after
+// now, so that what is written depends on when in simulated time
+// the flusher was woken and not on how the threads ran.
+void BufferCache::WakeFlusher()
+{
+  MutexHolder fl(&flushlock);
+  SIZE_T until=flushpasses+(flushing ? 2 : 1);
+
+  if (!flusherrunning) {
+    return;
+  }
+  flushpending=true;
+  pthread_cond_signal(&flushwake);
+  while (flusherrunning && flushpasses<until) {
+    pthread_cond_wait(&flushdone,&flushlock);
+  }
+}
+
+//
+// When a shard has too much dirty data, the flusher writes the
+// blocks that have been dirty longest until only half of the allowed
+// amount is left, along with anything that is too old.  Each batch
+// goes to the disk's scheduler with adjacent blocks coalesced.  The
+// shard's lock is dropped while the disk is busy so that readers and
+// writers are not held up.  A block that is written again in the
+// meantime stays dirty, as does every block of a batch that fails.
+//
+ERROR_T BufferCache::FlushShard(CacheShard *s)
+{
+  vector<SIZE_T> blocknums, versions;
+  vector<Block> blocks;
+  SIZE_T i, numrequests;
+  double now;
+  ERROR_T rc;
+  CacheFrame *f;
+
+  MutexHolder l(&(s->lock));
+
+  if (!FlushNeeded(s)) {
+    return ERROR_NOERROR;
+  }
+
+  now=Now();
+  for (f=s->dirtytail, i=s->numdirty;
+       f && (i>dirtyratio*s->cachesize/2 || now-f->dirtytime>=maxdirtyage);
+       f=f->dirtyprev, i--) {
+    blocknums.push_back(f->blocknum);
+  }
+  sort(blocknums.begin(),blocknums.end());
+  blocks.reserve(blocknums.size());
+  for (i=0;i<blocknums.size();i++) {
+    f=s->frames.Find(blocknums[i]);
+    AddToBatch(blocks,f);
+    versions.push_back(f->version);
+  }
+
+  pthread_mutex_unlock(&(s->lock));
+  rc=WriteRuns(blocknums,blocks,true,numrequests);
+  pthread_mutex_lock(&(s->lock));
+
+  s->diskwrites+=blocknums.size();
+  s->writerequests+=numrequests;
+  s->backgroundwrites+=blocknums.size();
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+  for (i=0;i<blocknums.size();i++) {
+    f=s->frames.Find(blocknums[i]);
+    if (f && f->version==versions[i]) {
+      MarkClean(s,f);
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+void BufferCache::FlusherLoop()
+{
+  ERROR_T rc;
+
+  pthread_mutex_lock(&flushlock);
+  while (1) {
+    // Simulated time only moves when the cache is used, and each
+    // use checks whether we are needed (FlushDue)
+    while (!flushpending && !flusherstop) {
+      pthread_cond_wait(&flushwake,&flushlock);
+    }
+    if (flusherstop) {
+      break;
+    }
+    flushpending=false;
+    flushing=true;
+    pthread_mutex_unlock(&flushlock);
+    rc=ERROR_NOERROR;
+    for (SIZE_T i=0;i<shards.size() && rc==ERROR_NOERROR;i++) {
+      rc=FlushShard(shards[i]);
+    }
+    pthread_mutex_lock(&flushlock);
+    flushing=false;
+    flushpasses++;
+    pthread_cond_broadcast(&flushdone);
+    if (rc!=ERROR_NOERROR) {
+      // The blocks stay dirty for the foreground to write, and
+      // StopFlusher or Detach reports what happened
+      flusherror=rc;
+      break;
+    }
+  }
+  flusherrunning=false;
+  pthread_cond_broadcast(&flushdone);
+  pthread_mutex_unlock(&flushlock);
+}
+
+void *BufferCache::FlusherThread(void *cache)
+{
+  ((BufferCache *)cache)->FlusherLoop();
+  return 0;
+}
+
+ERROR_T BufferCache::StartFlusher(const double ratio, const double maxage)
+{
+  MutexHolder fl(&flushlock);
+
+  if (flusherstarted) {
+    return ERROR_CONFLICT;
+  }
+  if (ratio<0 || ratio>1 || maxage<=0) {
+    return ERROR_BADCONFIG;
+  }
+  // The shards read these, so change them with the shards locked
+  LockAll();
+  dirtyratio=ratio;
+  maxdirtyage=maxage;
+  pthread_mutex_lock(&disklock);
+  nextflushcheck=curtime+maxdirtyage/2;
+  pthread_mutex_unlock(&disklock);
+  UnlockAll();
+  flusherstop=false;
+  flushpending=false;
+  flusherror=ERROR_NOERROR;
+  if (pthread_create(&flusher,0,FlusherThread,this)) {
+    return ERROR_GENERAL;
+  }
+  flusherstarted=true;
+  flusherrunning=true;
+  return ERROR_NOERROR;
+}
+
+ERROR_T BufferCache::StopFlusher()
+{
+  ERROR_T rc;
+
+  pthread_mutex_lock(&flushlock);
+  if (!flusherstarted) {
+    pthread_mutex_unlock(&flushlock);
+    return ERROR_NOERROR;
+  }
+  flusherstop=true;
+  pthread_cond_signal(&flushwake);
+  pthread_mutex_unlock(&flushlock);
+  // can't hold the lock here, the flusher needs it to notice
+  pthread_join(flusher,0);
+  pthread_mutex_lock(&flushlock);
+  flusherstarted=false;
+  rc=flusherror;
+  flusherror=ERROR_NOERROR;
+  pthread_mutex_unlock(&flushlock);
+  LockAll();
+  dirtyratio=1;
+  maxdirtyage=0;
+  UnlockAll();
+  return rc;
+}
+
 ostream & BufferCache::Print(ostream &os) const
 {
   os << "BufferCache(cachesize="<<cachesize
+     << ", shards="<<shards.size()
+     << ", policy="<<GetPolicyName()
      << ", blocksize="<<GetBlockSize()
-     << ", curtime="<<curtime
-     << ", allocs="<<allocs
-     << ", deallocs="<<deallocs
-     << ", reads="<<reads
-     << ", writes="<<writes
-     << ", diskreads="<<diskreads
-     << ", diskwrites="<<diskwrites
+     << ", curtime="<<GetCurrentTime()
+     << ", allocs="<<GetNumAllocs()
+     << ", deallocs="<<GetNumDeallocs()
+     << ", reads="<<GetNumReads()
+     << ", writes="<<GetNumWrites()
+     << ", diskreads="<<GetNumDiskReads()
+     << ", diskwrites="<<GetNumDiskWrites()
+     << ", writerequests="<<GetNumDiskWriteRequests()
+     << ", hits="<<GetNumHits()
+     << ", misses="<<GetNumMisses()
+     << ", prefetches="<<GetNumPrefetches()
+     << ", prefetchhits="<<GetNumPrefetchHits()
      << ", blocks = {";
 
-  
-  for (map<SIZE_T, Block, cache_compare_lessthan>::const_iterator b=blockmap.begin(); 
-       b!=blockmap.end(); 
-       ++b) {
-    if (b!=blockmap.begin()) { 
+  // print in block order, not hash order
+  vector<pair<SIZE_T,bool> > all;
+  CacheFrame *f;
+  SIZE_T pos;
+
+  LockAll();
+  for (SIZE_T i=0;i<shards.size();i++) {
+    for (pos=0; (f=shards[i]->frames.Next(pos)); ) {
+      all.push_back(make_pair(f->blocknum,f->block.dirty));
+    }
+  }
+  UnlockAll();
+  sort(all.begin(),all.end());
+
+  for (SIZE_T i=0;i<all.size();i++) {
+    if (i>0) {
       os << ", ";
     }
-    os << (*b).first << ((*b).second.dirty ? "(dirty)" : "");
+    os << all[i].first << (all[i].second ? "(dirty)" : "");
   }
   os << "}, disk="<<*disk<<")";
-  
+
   return os;
 }
-  
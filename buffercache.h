@@ -2,39 +2,177 @@
 #define _buffercache
 
 #include <iostream>
-#include <map>
+#include <vector>
+#include <pthread.h>
 
 #include "global.h"
 #include "block.h"
 #include "disksystem.h"
+#include "cachepolicy.h"
+#include "frametable.h"
 
 using namespace std;
 
-struct cache_compare_lessthan {
-  bool operator()(const SIZE_T s1, const SIZE_T s2) const {
-    return s1<s2;
-  }
+
+class BufferCache;
+
+//
+// A pin on a resident block.  While any handle to a block exists,
+// the block stays in the cache and GetData points straight at the
+// cached bytes, so nothing is copied.  Copying a handle adds a pin
+// and destroying one removes it.  The bytes must not be modified
+// through the handle; write the block with WriteBlock instead.
+// Writing a pinned block leaves the pinned bytes as they were, and
+// later reads and pins see the new ones.
+//
+class PageHandle {
+ private:
+  BufferCache *cache;
+  CacheFrame  *frame;
+ public:
+  PageHandle() : cache(0), frame(0) {}
+  PageHandle(const PageHandle &rhs);
+  PageHandle & operator=(const PageHandle &rhs);
+  ~PageHandle() { Release(); }
+
+  void Release();
+  bool IsPinned() const { return frame!=0; }
+  SIZE_T GetBlockNum() const { return frame->blocknum; }
+  SIZE_T GetLength() const { return frame->block.length; }
+  const BYTE_T *GetData() const { return frame->block.data; }
+
+  friend class BufferCache;
+};
+
+
+// Blocks are spread over the shards in runs of this many
+// consecutive block numbers, so that a run of dirty neighbors can
+// still be written in a single request
+#define BUFFERCACHE_SHARD_RUN 16
+
+//
+// One partition of the cache, with its own replacement policy,
+// dirty list and counters.  All of it is protected by lock.
+//
+struct CacheShard {
+  pthread_mutex_t lock;
+  SIZE_T          cachesize;
+  FrameTable      frames;
+  CachePolicy    *policy;
+  CacheFrame     *dirtyhead, *dirtytail;
+  SIZE_T          numdirty, writeseq, inflight;
+  SIZE_T          reads, writes, diskreads, diskwrites, writerequests;
+  SIZE_T          hits, misses, prefetches, prefetchhits, backgroundwrites;
+
+  CacheShard(const SIZE_T cachesize, const CachePolicyType policy);
+  ~CacheShard();
 };
 
 
 //
-// LRU block cache with single step prefetch
+// Block cache with single step prefetch
 //
 // Write Back
 // Write Allocate
+// Replacement is LRU unless another CachePolicy is chosen
+// when the cache is constructed
+//
+// Dirty blocks are normally written only when they are evicted,
+// flushed, checkpointed, or at Detach.  Groups of them go to the disk
+// as one batch for its scheduler to order (DiskSystem::SetSchedule),
+// and adjacent blocks go out as one multiblock request.
+// StartFlusher starts a background thread that writes them out
+// earlier so that evictions find clean blocks.
+//
+// The cache may be split into shards by block number, each with its
+// own lock and its own share of the blocks, so that threads working
+// on different blocks don't wait for each other.  Replacement is
+// done within each shard.  disklock protects the disk, the simulated
+// clock, and the allocation counters.  Lock order is shard, then
+// disklock.  Operations on the whole cache lock the shards in order.
+// Hits don't touch the clock unless they have to wait for a
+// prefetch, so lastaccessed is only set when a block comes in or is
+// written.
+//
+// A miss reads its block without holding disklock, so misses in
+// different shards overlap on the device.  Prefetches are submitted
+// asynchronously and left in flight until the block is used or
+// evicted, and a batch of dirty blocks is written with all of its
+// requests outstanding at once.
+//
+// If the disk is mapped (DiskSystem::Map), frames use the mapped
+// bytes of their blocks directly, so a miss copies nothing and makes
+// no system call, and pinned handles point into the mapping.  Dirty
+// blocks are still tracked and charged to the disk as usual, and the
+// mapping is synced by Checkpoint, FlushBlock and Detach.
+//
+// If the disk does direct I/O (DiskSystem::EnableDirectIO), frame
+// storage is aligned for it and blocks move straight between the
+// device and the frames.  The kernel keeps no second copy, so
+// cachesize blocks is then all the memory the data takes.
 class BufferCache {
  private:
   DiskSystem *disk;
   SIZE_T cachesize;
-  map<SIZE_T, Block, cache_compare_lessthan> blockmap;
+  vector<CacheShard *> shards;
   double curtime;
-  SIZE_T allocs, deallocs, reads, writes, diskreads, diskwrites;
+  double diskfree;
+  SIZE_T allocs, deallocs;
+  mutable pthread_mutex_t disklock;
+  pthread_mutex_t flushlock;
+  pthread_cond_t flushwake, flushdone;
+  pthread_t flusher;
+  // flusherstarted until StopFlusher joins the thread, and
+  // flusherrunning until the thread stops, which it does by itself
+  // if a write fails.  flusherror is the first error it got.
+  // flushpasses counts the passes it has finished, and flushing
+  // says one is under way.
+  bool flusherstarted, flusherrunning, flusherstop, flushpending, flushing;
+  SIZE_T flushpasses;
+  ERROR_T flusherror;
+  double dirtyratio, maxdirtyage;
+  // When the flusher is next woken just for age, in simulated time
+  double nextflushcheck;
  protected:
-  ERROR_T CheckDeleteOldest();
+  CacheShard *ShardOf(const SIZE_T blocknum) const;
+  void    LockAll() const;
+  void    UnlockAll() const;
+  SIZE_T  Sum(SIZE_T CacheShard::*counter) const;
+  double  Now() const;
+  double  ChargeDisk(const double reqtime, const bool background=false);
+  CacheFrame *NewFrame(CacheShard *s, const SIZE_T blocknum);
+  CacheFrame *ReplaceFrame(CacheShard *s, CacheFrame *f);
+  void    Touch(CacheShard *s, CacheFrame *f);
+  void    WaitForFrame(CacheShard *s, CacheFrame *f);
+  ERROR_T WaitForRead(CacheFrame *f);
+  bool    FinishPrefetch(CacheShard *s, CacheFrame *f);
+  void    MarkDirty(CacheShard *s, CacheFrame *f);
+  void    MarkClean(CacheShard *s, CacheFrame *f);
+  ERROR_T CheckEvict(CacheShard *s, const SIZE_T incoming, const bool background=false);
+  ERROR_T Fetch(CacheShard *s, const SIZE_T inblocknum, CacheFrame *&f, const char *who);
+  void    Unpin(CacheFrame *f);
+  void    Repin(CacheFrame *f);
+  ERROR_T WriteRuns(const vector<SIZE_T> &blocknums,
+		    const vector<Block> &blocks,
+		    const bool background,
+		    SIZE_T &numrequests);
+  ERROR_T WriteDirty(CacheShard *s, vector<SIZE_T> &blocknums, const bool background=false);
+  ERROR_T WriteAllDirty();
+  bool    FlushNeeded(const CacheShard *s) const;
+  bool    FlushDue(const CacheShard *s);
+  void    WakeFlusher();
+  ERROR_T FlushShard(CacheShard *s);
+  void    FlusherLoop();
+  static void *FlusherThread(void *cache);
  public:
-  // Cache size is in number of blocks
+  friend class PageHandle;
+
+  // Cache size is in number of blocks.  There are at most as many
+  // shards as blocks.
   BufferCache(DiskSystem *disk,
-	      const SIZE_T cachesize);
+	      const SIZE_T cachesize,
+	      const CachePolicyType policy=CACHE_POLICY_LRU,
+	      const SIZE_T numshards=1);
   BufferCache() { throw 0; }
   BufferCache(const BufferCache &rhs) { throw 0; } 
   BufferCache & operator=(const BufferCache &rhs) { throw 0; return *this; } 
@@ -47,6 +185,7 @@ class BufferCache {
 
   // Number of blocks in the cache
   SIZE_T GetCacheSize() const;
+  SIZE_T GetNumShards() const { return shards.size(); }
   // Number of bytes per block
   SIZE_T GetBlockSize() const;
   // Number of blocks in the underlying device
@@ -65,29 +204,79 @@ class BufferCache {
   // returns one of ERROR_NOERROR  (zero)
   // ERROR_NOSUCHBLOCK or other nonzero error codes
   ERROR_T ReadBlock(const SIZE_T inblocknum, Block &outblock);
+
+  // Like ReadBlock, but instead of copying the block out, pins it
+  // in the cache and points handle at it.  Whatever handle pinned
+  // before is released.  Pinned blocks are never evicted, so the
+  // cache may hold more than cachesize blocks while everything in it
+  // is pinned, or while the old bytes of a pinned block that has
+  // been written are kept for its handles.  All handles must be
+  // released before Attach or Detach, which otherwise keep the
+  // pinned blocks and return ERROR_CONFLICT.
+  ERROR_T PinBlock(const SIZE_T inblocknum, PageHandle &handle);
   
   // returns one of ERROR_NOERROR  (zero)
   // ERROR_NOSUCHBLOCK
-  // ERROR_WRONGSIZEBLOCK or other nonzero error codes
+  // or other nonzero error codes
   ERROR_T WriteBlock(const SIZE_T inblocknum, const Block &inblock);
   
   // Request that a block be read into the cache
   // This returns immediately.
   // ERROR_NOFETCH means that there is no room currently
   // to prefetch the block and it was not prefetched.
+  //
+  // The read is queued on the disk behind any work already
+  // outstanding and does not advance the current time.  A later
+  // read or write of the block waits only for whatever part of the
+  // request has not yet completed.  At most half of the cache may
+  // be holding prefetched blocks that have not been used yet.
   ERROR_T PrefetchBlock (const SIZE_T blocknum);
-  
+  // The same for several blocks, whose reads go to the disk as one
+  // batch so that the scheduler can order them.  Blocks there is no
+  // room for are skipped, and ERROR_NOFETCH is returned if there
+  // were any.
+  ERROR_T PrefetchBlocks(const vector<SIZE_T> &blocknums);
+
   // Request that a block be flushed to disk
   // Note that this blocks until the block is finished.
   ERROR_T FlushBlock(const SIZE_T blocknum);
+
+  // Write every dirty block to disk, keeping them in the cache.
+  // The writes are sorted and adjacent blocks go out as one request.
+  // Returns once the disk is idle.
+  ERROR_T Checkpoint();
+
+  // Start writing dirty blocks back in the background whenever
+  // more than dirtyratio (0..1) of the cache is dirty or some block
+  // has been dirty for more than maxage milliseconds of simulated
+  // time.  The writes occupy the simulated disk but do not advance
+  // the current time.  The flusher only looks when the cache is used,
+  // and the thread that wakes it waits for it, so what it does
+  // depends on the simulated clock alone and runs repeat.  Returns
+  // ERROR_CONFLICT if already started.
+  ERROR_T StartFlusher(const double dirtyratio, const double maxage);
+  // Returns the error that stopped the flusher, if a write failed.
+  // Detach returns it too, if StopFlusher hasn't.
+  ERROR_T StopFlusher();
   
  
-  SIZE_T GetNumAllocs() const { return allocs; }
-  SIZE_T GetNumDeallocs() const { return deallocs; }
-  SIZE_T GetNumReads() const { return reads;}
-  SIZE_T GetNumWrites() const { return writes;}
-  SIZE_T GetNumDiskReads() const { return diskreads;}
-  SIZE_T GetNumDiskWrites() const { return diskwrites;}
+  SIZE_T GetNumAllocs() const;
+  SIZE_T GetNumDeallocs() const;
+  SIZE_T GetNumReads() const { return Sum(&CacheShard::reads);}
+  SIZE_T GetNumWrites() const { return Sum(&CacheShard::writes);}
+  SIZE_T GetNumDiskReads() const { return Sum(&CacheShard::diskreads);}
+  SIZE_T GetNumDiskWrites() const { return Sum(&CacheShard::diskwrites);}
+  // Multiblock write requests issued (diskwrites counts blocks)
+  SIZE_T GetNumDiskWriteRequests() const { return Sum(&CacheShard::writerequests);}
+  // Reads and writes that found / did not find their block resident
+  SIZE_T GetNumHits() const { return Sum(&CacheShard::hits);}
+  SIZE_T GetNumMisses() const { return Sum(&CacheShard::misses);}
+  // Prefetches issued, and how many of them were later used
+  SIZE_T GetNumPrefetches() const { return Sum(&CacheShard::prefetches);}
+  SIZE_T GetNumPrefetchHits() const { return Sum(&CacheShard::prefetchhits);}
+  // Disk writes done by the background flusher
+  SIZE_T GetNumBackgroundWrites() const { return Sum(&CacheShard::backgroundwrites);}
+  const char *GetPolicyName() const { return shards[0]->policy->GetName(); }
 
   ostream & Print(ostream &os) const;
   
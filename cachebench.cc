@@ -0,0 +1,145 @@
+#include <string>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <pthread.h>
+
+#include "buffercache.h"
+
+
+void usage()
+{
+  cerr << "usage: cachebench filestem cachesize nummisses [numthreads [numshards]]\n";
+  cerr << "  the disk must have at least cachesize+nummisses blocks\n";
+}
+
+static double now()
+{
+  struct timeval tv;
+  gettimeofday(&tv,0);
+  return tv.tv_sec+tv.tv_usec/1e6;
+}
+
+struct HitThread {
+  BufferCache *cache;
+  SIZE_T       cachesize;
+  SIZE_T       numhits;
+  SIZE_T       seed;
+  ERROR_T      rc;
+};
+
+// Pin and release random resident blocks
+static void *Hits(void *arg)
+{
+  HitThread *t=(HitThread *)arg;
+  PageHandle handle;
+  SIZE_T x=t->seed;
+
+  t->rc=ERROR_NOERROR;
+  for (SIZE_T i=0;i<t->numhits;i++) {
+    x=x*1103515245+12345;
+    if ((t->rc=t->cache->PinBlock((x>>8)%t->cachesize,handle))!=ERROR_NOERROR) {
+      break;
+    }
+  }
+  return 0;
+}
+
+//
+// Microbenchmark for the buffer cache miss path
+//
+// The cache is first filled with cachesize distinct blocks.  Then
+// nummisses further distinct blocks are read, each of which misses
+// and forces a (clean) eviction.  We report the wall clock cost
+// per miss, which includes the disk read itself.
+//
+// If numthreads is given, then before the misses that many threads
+// each pin nummisses random blocks out of the full cache, and we
+// report the rate of hits for all of the threads together.
+//
+int main(int argc, char *argv[])
+{
+  if (argc<4) {
+    usage();
+    exit(-1);
+  }
+  SIZE_T cachesize=atoi(argv[2]);
+  SIZE_T nummisses=atoi(argv[3]);
+  SIZE_T numthreads = argc>4 ? atoi(argv[4]) : 0;
+  SIZE_T numshards = argc>5 ? atoi(argv[5]) : 1;
+
+  DiskSystem disk(argv[1]);
+  BufferCache cache(&disk,cachesize,CACHE_POLICY_LRU,numshards);
+
+  if (cachesize+nummisses > disk.GetNumBlocks()) {
+    usage();
+    exit(-1);
+  }
+
+  SIZE_T blocksize = disk.GetBlockSize();
+
+  cache.Attach();
+
+  Block block(blocksize);
+  ERROR_T rc;
+
+  for (SIZE_T i=0;i<cachesize;i++) {
+    if ((rc=cache.ReadBlock(i,block))!=ERROR_NOERROR) {
+      cerr << "Error " << rc <<" occured when reading block "<< i << endl;
+      return -1;
+    }
+  }
+
+  double start;
+
+  if (numthreads>0) {
+    vector<HitThread> threads(numthreads);
+    vector<pthread_t> ids(numthreads);
+
+    start=now();
+    for (SIZE_T i=0;i<numthreads;i++) {
+      threads[i].cache=&cache;
+      threads[i].cachesize=cachesize;
+      threads[i].numhits=nummisses;
+      threads[i].seed=i+1;
+      pthread_create(&ids[i],0,Hits,&threads[i]);
+    }
+    for (SIZE_T i=0;i<numthreads;i++) {
+      pthread_join(ids[i],0);
+      if (threads[i].rc!=ERROR_NOERROR) {
+	cerr << "Error " << threads[i].rc <<" occured when pinning"<< endl;
+	return -1;
+      }
+    }
+    double hitelapsed=now()-start;
+
+    cerr << "numthreads      = "<<numthreads<<endl;
+    cerr << "numshards       = "<<cache.GetNumShards()<<endl;
+    cerr << "hits per usec   = "<<(numthreads*nummisses/(hitelapsed*1e6))<<endl;
+  }
+
+  start=now();
+
+  for (SIZE_T i=cachesize;i<cachesize+nummisses;i++) {
+    if ((rc=cache.ReadBlock(i,block))!=ERROR_NOERROR) {
+      cerr << "Error " << rc <<" occured when reading block "<< i << endl;
+      return -1;
+    }
+  }
+
+  double elapsed=now()-start;
+
+  cache.Detach();
+
+  cerr << "cachesize       = "<<cachesize<<endl;
+  cerr << "nummisses       = "<<nummisses<<endl;
+  cerr << "usec per miss   = "<<(elapsed*1e6/nummisses)<<endl;
+  cerr << endl;
+  cerr << "numreads        = "<<cache.GetNumReads()<<endl;
+  cerr << "numdiskreads    = "<<cache.GetNumDiskReads()<<endl;
+  cerr << "numdiskwrites   = "<<cache.GetNumDiskWrites()<<endl;
+  cerr << endl;
+
+  cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+
+  return 0;
+}
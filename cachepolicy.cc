@@ -0,0 +1,420 @@
+#include "cachepolicy.h"
+
+
+void FrameList::PushFront(CacheFrame *f)
+{
+  f->prev=0;
+  f->next=head;
+  if (head) {
+    head->prev=f;
+  } else {
+    tail=f;
+  }
+  head=f;
+  size++;
+}
+
+void FrameList::PushBack(CacheFrame *f)
+{
+  f->next=0;
+  f->prev=tail;
+  if (tail) {
+    tail->next=f;
+  } else {
+    head=f;
+  }
+  tail=f;
+  size++;
+}
+
+void FrameList::InsertBefore(CacheFrame *pos, CacheFrame *f)
+{
+  f->next=pos;
+  f->prev=pos->prev;
+  if (pos->prev) {
+    pos->prev->next=f;
+  } else {
+    head=f;
+  }
+  pos->prev=f;
+  size++;
+}
+
+void FrameList::Unlink(CacheFrame *f)
+{
+  if (f->prev) {
+    f->prev->next=f->next;
+  } else {
+    head=f->next;
+  }
+  if (f->next) {
+    f->next->prev=f->prev;
+  } else {
+    tail=f->prev;
+  }
+  f->prev=f->next=0;
+  size--;
+}
+
+void GhostList::PushFront(const SIZE_T blocknum)
+{
+  Erase(blocknum);
+  order.push_front(blocknum);
+  where[blocknum]=order.begin();
+}
+
+void GhostList::Erase(const SIZE_T blocknum)
+{
+  unordered_map<SIZE_T, list<SIZE_T>::iterator, cache_hash>::iterator i=where.find(blocknum);
+  if (i!=where.end()) {
+    order.erase((*i).second);
+    where.erase(i);
+  }
+}
+
+void GhostList::PopBack()
+{
+  if (!order.empty()) {
+    where.erase(order.back());
+    order.pop_back();
+  }
+}
+
+
+CachePolicy *CachePolicy::Create(const CachePolicyType type, const SIZE_T cachesize)
+{
+  switch (type) {
+  case CACHE_POLICY_CLOCK:
+    return new ClockPolicy();
+  case CACHE_POLICY_2Q:
+    return new TwoQPolicy(cachesize);
+  case CACHE_POLICY_ARC:
+    return new ARCPolicy(cachesize);
+  case CACHE_POLICY_LRU:
+  default:
+    return new LRUPolicy();
+  }
+}
+
+ERROR_T CachePolicy::ParseType(const string &name, CachePolicyType &type)
+{
+  if (name=="lru") {
+    type=CACHE_POLICY_LRU;
+  } else if (name=="clock") {
+    type=CACHE_POLICY_CLOCK;
+  } else if (name=="2q") {
+    type=CACHE_POLICY_2Q;
+  } else if (name=="arc") {
+    type=CACHE_POLICY_ARC;
+  } else {
+    return ERROR_BADCONFIG;
+  }
+  return ERROR_NOERROR;
+}
+
+
+//
+// LRU
+//
+
+void LRUPolicy::Touch(CacheFrame *f)
+{
+  lru.Unlink(f);
+  lru.PushFront(f);
+}
+
+void LRUPolicy::Insert(CacheFrame *f)
+{
+  lru.PushFront(f);
+}
+
+void LRUPolicy::Remove(CacheFrame *f)
+{
+  lru.Unlink(f);
+}
+
+CacheFrame *LRUPolicy::Victim(const SIZE_T incoming)
+{
+  CacheFrame *f=lru.tail;
+  if (f) {
+    lru.Unlink(f);
+  }
+  return f;
+}
+
+void LRUPolicy::Reinstate(CacheFrame *f)
+{
+  lru.PushBack(f);
+}
+
+void LRUPolicy::Unpin(CacheFrame *f)
+{
+  lru.PushFront(f);
+}
+
+
+//
+// CLOCK
+//
+
+void ClockPolicy::Touch(CacheFrame *f)
+{
+  f->referenced=true;
+}
+
+void ClockPolicy::Insert(CacheFrame *f)
+{
+  // New frames go just behind the hand so that they get a full
+  // revolution before they are considered
+  f->referenced=false;
+  if (hand) {
+    ring.InsertBefore(hand,f);
+  } else {
+    ring.PushFront(f);
+    hand=f;
+  }
+}
+
+void ClockPolicy::Remove(CacheFrame *f)
+{
+  if (hand==f) {
+    hand = f->next ? f->next : ring.head;
+    if (hand==f) {
+      hand=0;
+    }
+  }
+  ring.Unlink(f);
+}
+
+CacheFrame *ClockPolicy::Victim(const SIZE_T incoming)
+{
+  if (!hand) {
+    return 0;
+  }
+  // At most one revolution, since it clears every bit it passes
+  while (hand->referenced) {
+    hand->referenced=false;
+    hand = hand->next ? hand->next : ring.head;
+  }
+  CacheFrame *f=hand;
+  Remove(f);
+  return f;
+}
+
+void ClockPolicy::Reinstate(CacheFrame *f)
+{
+  // Just behind the hand, which is where Victim took it from
+  if (hand) {
+    ring.InsertBefore(hand,f);
+  } else {
+    ring.PushFront(f);
+    hand=f;
+  }
+}
+
+
+//
+// 2Q
+//
+
+#define TWOQ_A1IN 1
+#define TWOQ_AM   2
+
+TwoQPolicy::TwoQPolicy(const SIZE_T cachesize)
+{
+  // The tuning suggested in the paper
+  kin = cachesize/4 > 0 ? cachesize/4 : 1;
+  kout = cachesize/2 > 0 ? cachesize/2 : 1;
+}
+
+void TwoQPolicy::Touch(CacheFrame *f)
+{
+  // A hit in A1in is deliberately ignored - it is most likely
+  // a correlated reference
+  if (f->queue==TWOQ_AM) {
+    am.Unlink(f);
+    am.PushFront(f);
+  }
+}
+
+void TwoQPolicy::Insert(CacheFrame *f)
+{
+  if (a1out.Contains(f->blocknum)) {
+    a1out.Erase(f->blocknum);
+    f->queue=TWOQ_AM;
+    am.PushFront(f);
+  } else {
+    f->queue=TWOQ_A1IN;
+    a1in.PushFront(f);
+  }
+}
+
+void TwoQPolicy::Remove(CacheFrame *f)
+{
+  if (f->queue==TWOQ_AM) {
+    am.Unlink(f);
+  } else {
+    a1in.Unlink(f);
+  }
+}
+
+CacheFrame *TwoQPolicy::Victim(const SIZE_T incoming)
+{
+  CacheFrame *in=a1in.tail;
+  CacheFrame *m=am.tail;
+  CacheFrame *f;
+
+  if (in && (a1in.size>kin || !m)) {
+    f=in;
+    a1in.Unlink(f);
+    a1out.PushFront(f->blocknum);
+    while (a1out.GetSize()>kout) {
+      a1out.PopBack();
+    }
+  } else {
+    f=m;
+    if (f) {
+      am.Unlink(f);
+    }
+  }
+  return f;
+}
+
+void TwoQPolicy::Reinstate(CacheFrame *f)
+{
+  if (f->queue==TWOQ_AM) {
+    am.PushBack(f);
+  } else {
+    a1out.Erase(f->blocknum);
+    a1in.PushBack(f);
+  }
+}
+
+void TwoQPolicy::Unpin(CacheFrame *f)
+{
+  if (f->queue==TWOQ_AM) {
+    am.PushFront(f);
+  } else {
+    a1in.PushFront(f);
+  }
+}
+
+
+//
+// ARC
+//
+
+#define ARC_T1 1
+#define ARC_T2 2
+
+ARCPolicy::ARCPolicy(const SIZE_T cachesize) :
+  c(cachesize), p(0), adapted(false), adaptedfor(0)
+{}
+
+void ARCPolicy::Adapt(const SIZE_T incoming)
+{
+  double delta;
+
+  if (b1.Contains(incoming)) {
+    delta = b1.GetSize()>=b2.GetSize() ? 1 : (double)b2.GetSize()/(double)b1.GetSize();
+    p = (p+delta > c) ? c : p+delta;
+  } else if (b2.Contains(incoming)) {
+    delta = b2.GetSize()>=b1.GetSize() ? 1 : (double)b1.GetSize()/(double)b2.GetSize();
+    p = (p-delta < 0) ? 0 : p-delta;
+  }
+  adapted=true;
+  adaptedfor=incoming;
+}
+
+void ARCPolicy::Touch(CacheFrame *f)
+{
+  if (f->queue==ARC_T1) {
+    t1.Unlink(f);
+  } else {
+    t2.Unlink(f);
+  }
+  f->queue=ARC_T2;
+  t2.PushFront(f);
+}
+
+void ARCPolicy::Insert(CacheFrame *f)
+{
+  SIZE_T x=f->blocknum;
+
+  // Victim() has usually adapted p for this block already
+  if (!adapted || adaptedfor!=x) {
+    Adapt(x);
+  }
+  adapted=false;
+
+  if (b1.Contains(x) || b2.Contains(x)) {
+    b1.Erase(x);
+    b2.Erase(x);
+    f->queue=ARC_T2;
+    t2.PushFront(f);
+    return;
+  }
+
+  // A complete miss, so keep the directory within 2c entries
+  while (t1.size+b1.GetSize()>=c && b1.GetSize()>0) {
+    b1.PopBack();
+  }
+  while (t1.size+t2.size+b1.GetSize()+b2.GetSize()>=2*c && b2.GetSize()>0) {
+    b2.PopBack();
+  }
+  f->queue=ARC_T1;
+  t1.PushFront(f);
+}
+
+void ARCPolicy::Remove(CacheFrame *f)
+{
+  if (f->queue==ARC_T1) {
+    t1.Unlink(f);
+  } else {
+    t2.Unlink(f);
+  }
+}
+
+CacheFrame *ARCPolicy::Victim(const SIZE_T incoming)
+{
+  CacheFrame *f1=t1.tail;
+  CacheFrame *f2=t2.tail;
+  CacheFrame *f;
+
+  Adapt(incoming);
+
+  if (f1 &&
+      (t1.size>p || !f2 || (b2.Contains(incoming) && t1.size==p))) {
+    f=f1;
+    t1.Unlink(f);
+    b1.PushFront(f->blocknum);
+  } else {
+    f=f2;
+    if (f) {
+      t2.Unlink(f);
+      b2.PushFront(f->blocknum);
+    }
+  }
+  return f;
+}
+
+// p stays adapted for the block that is coming in, which still is
+void ARCPolicy::Reinstate(CacheFrame *f)
+{
+  if (f->queue==ARC_T1) {
+    b1.Erase(f->blocknum);
+    t1.PushBack(f);
+  } else {
+    b2.Erase(f->blocknum);
+    t2.PushBack(f);
+  }
+}
+
+void ARCPolicy::Unpin(CacheFrame *f)
+{
+  if (f->queue==ARC_T1) {
+    t1.PushFront(f);
+  } else {
+    t2.PushFront(f);
+  }
+}
@@ -0,0 +1,217 @@
+#ifndef _cachepolicy
+#define _cachepolicy
+
+#include <list>
+#include <string>
+#include <unordered_map>
+
+#include "global.h"
+#include "block.h"
+
+using namespace std;
+
+struct DiskRequest;
+
+
+// A resident block along with the bookkeeping that the replacement
+// policies need.  The list links are intrusive so that moving a
+// block between or within lists is O(1).  Which list the frame is
+// on (if the policy has more than one) is recorded in queue.
+struct CacheFrame {
+  SIZE_T      blocknum;
+  Block       block;
+  CacheFrame *prev;        // toward the head (most recent) of its list
+  CacheFrame *next;        // toward the tail (least recent) of its list
+  int         queue;       // policy specific list identifier
+  bool        referenced;  // reference bit (CLOCK)
+  double      readytime;   // when an asynchronous read of the block completes
+  bool        prefetched;  // brought in by a prefetch and not yet used
+  CacheFrame *dirtyprev;   // toward the most recently dirtied block
+  CacheFrame *dirtynext;   // toward the block that has been dirty longest
+  double      dirtytime;   // when the block went from clean to dirty
+  SIZE_T      version;     // changes on every write of the block
+  SIZE_T      pincount;    // outstanding PageHandles, never evicted if >0
+  DiskRequest *pending;    // the real read of block, if still in flight
+  bool        retired;     // replaced by a newer frame while pinned
+
+  CacheFrame() : blocknum(0), prev(0), next(0), queue(0), referenced(false),
+		 readytime(0), prefetched(false), dirtyprev(0), dirtynext(0),
+		 dirtytime(0), version(0), pincount(0), pending(0), retired(false) {}
+};
+
+
+struct cache_hash {
+  size_t operator()(const SIZE_T s) const {
+    return s;
+  }
+};
+
+
+enum CachePolicyType {CACHE_POLICY_LRU, CACHE_POLICY_CLOCK, CACHE_POLICY_2Q, CACHE_POLICY_ARC};
+
+
+//
+// A replacement policy decides which resident block to throw
+// out when the cache is full.  The buffer cache tells the policy
+// about every hit (Touch), every block that comes in (Insert) and
+// every block that leaves other than by eviction (Remove).
+// Pinned frames can't be evicted, so they are taken off the
+// policy's lists while pinned (Pin, Unpin) and choosing a victim
+// never has to pass over them.
+//
+class CachePolicy {
+ public:
+  virtual ~CachePolicy() {}
+
+  // f is resident and was just read or written
+  virtual void Touch(CacheFrame *f)=0;
+  // f was just filled with a block that was not resident
+  virtual void Insert(CacheFrame *f)=0;
+  // f is leaving the cache but was not chosen by Victim
+  virtual void Remove(CacheFrame *f)=0;
+  // Choose a frame to evict to make room for block incoming,
+  // and forget about it.  Returns 0 if nothing unpinned is resident.
+  virtual CacheFrame *Victim(const SIZE_T incoming)=0;
+  // f was chosen by Victim but could not be evicted after all, so
+  // put it back where it was.  It is not a new block, so it must not
+  // be taken for a hit in a ghost list.
+  virtual void Reinstate(CacheFrame *f)=0;
+  // f, which is on the lists, was just pinned, so take it off them.
+  // Touch, Remove and Victim are never given a pinned frame.
+  virtual void Pin(CacheFrame *f)=0;
+  // The last pin on f is gone, so put it back as the most recent
+  // frame of the list it was on
+  virtual void Unpin(CacheFrame *f)=0;
+
+  virtual const char *GetName() const=0;
+
+  static CachePolicy *Create(const CachePolicyType type, const SIZE_T cachesize);
+  // returns one of ERROR_NOERROR or ERROR_BADCONFIG if name is not
+  // one of lru, clock, 2q, or arc
+  static ERROR_T ParseType(const string &name, CachePolicyType &type);
+};
+
+
+// An intrusive doubly-linked list of frames
+struct FrameList {
+  CacheFrame *head;
+  CacheFrame *tail;
+  SIZE_T      size;
+
+  FrameList() : head(0), tail(0), size(0) {}
+
+  void PushFront(CacheFrame *f);
+  void PushBack(CacheFrame *f);
+  void InsertBefore(CacheFrame *pos, CacheFrame *f);
+  void Unlink(CacheFrame *f);
+};
+
+
+// A list of block numbers that were recently evicted (no data)
+class GhostList {
+ private:
+  list<SIZE_T> order;
+  unordered_map<SIZE_T, list<SIZE_T>::iterator, cache_hash> where;
+ public:
+  bool   Contains(const SIZE_T blocknum) const { return where.find(blocknum)!=where.end(); }
+  SIZE_T GetSize() const { return order.size(); }
+  void   PushFront(const SIZE_T blocknum);
+  void   Erase(const SIZE_T blocknum);
+  void   PopBack();
+};
+
+
+class LRUPolicy : public CachePolicy {
+ private:
+  FrameList lru;
+ public:
+  void Touch(CacheFrame *f);
+  void Insert(CacheFrame *f);
+  void Remove(CacheFrame *f);
+  CacheFrame *Victim(const SIZE_T incoming);
+  void Reinstate(CacheFrame *f);
+  void Pin(CacheFrame *f) { Remove(f); }
+  void Unpin(CacheFrame *f);
+  const char *GetName() const { return "lru"; }
+};
+
+
+//
+// Second chance: frames sit on a circular list and the hand clears
+// reference bits until it finds an unreferenced frame
+//
+class ClockPolicy : public CachePolicy {
+ private:
+  FrameList   ring;
+  CacheFrame *hand;
+ public:
+  ClockPolicy() : hand(0) {}
+  void Touch(CacheFrame *f);
+  void Insert(CacheFrame *f);
+  void Remove(CacheFrame *f);
+  CacheFrame *Victim(const SIZE_T incoming);
+  void Reinstate(CacheFrame *f);
+  void Pin(CacheFrame *f) { Remove(f); }
+  void Unpin(CacheFrame *f) { Reinstate(f); }
+  const char *GetName() const { return "clock"; }
+};
+
+
+//
+// Full 2Q (Johnson and Shasha, VLDB '94).  New blocks go to the FIFO
+// A1in.  Only blocks that are referenced again after falling out of
+// A1in (and are remembered in the ghost list A1out) are promoted to
+// the LRU list Am.  A single scan therefore can't flush Am.
+//
+class TwoQPolicy : public CachePolicy {
+ private:
+  FrameList a1in;
+  FrameList am;
+  GhostList a1out;
+  SIZE_T    kin;
+  SIZE_T    kout;
+ public:
+  TwoQPolicy(const SIZE_T cachesize);
+  void Touch(CacheFrame *f);
+  void Insert(CacheFrame *f);
+  void Remove(CacheFrame *f);
+  CacheFrame *Victim(const SIZE_T incoming);
+  void Reinstate(CacheFrame *f);
+  void Pin(CacheFrame *f) { Remove(f); }
+  void Unpin(CacheFrame *f);
+  const char *GetName() const { return "2q"; }
+};
+
+
+//
+// Adaptive Replacement Cache (Megiddo and Modha, FAST '03).
+// T1 holds blocks seen once recently, T2 blocks seen at least twice.
+// B1 and B2 are ghosts of what was evicted from each, and hits
+// in them move the target size p of T1.
+//
+class ARCPolicy : public CachePolicy {
+ private:
+  FrameList t1;
+  FrameList t2;
+  GhostList b1;
+  GhostList b2;
+  SIZE_T    c;
+  double    p;
+  bool      adapted;
+  SIZE_T    adaptedfor;
+ protected:
+  void Adapt(const SIZE_T incoming);
+ public:
+  ARCPolicy(const SIZE_T cachesize);
+  void Touch(CacheFrame *f);
+  void Insert(CacheFrame *f);
+  void Remove(CacheFrame *f);
+  CacheFrame *Victim(const SIZE_T incoming);
+  void Reinstate(CacheFrame *f);
+  void Pin(CacheFrame *f) { Remove(f); }
+  void Unpin(CacheFrame *f);
+  const char *GetName() const { return "arc"; }
+};
+
+
+#endif
@@ -0,0 +1,413 @@
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+#include "diskqueue.h"
+
+#if DISKQUEUE_USE_URING && defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define HAVE_URING 1
+#endif
+#endif
+
+
+SIZE_T DiskTransfer(const int fd, const off_t off, struct iovec *iov, int iovcnt, const bool write)
+{
+  SIZE_T done=0;
+  ssize_t n;
+
+  while (iovcnt>0) {
+    int cnt = iovcnt<IOV_MAX ? iovcnt : IOV_MAX;
+    if (write) {
+      n=pwritev(fd,iov,cnt,off+done);
+    } else {
+      n=preadv(fd,iov,cnt,off+done);
+    }
+    if (n<0) {
+      if (errno==EINTR) {
+	continue;
+      }
+      break;
+    }
+    if (n==0) {
+      if (write) {
+	break;
+      }
+      // EOF
+      for (int i=0;i<iovcnt;i++) {
+	memset(iov[i].iov_base,0,iov[i].iov_len);
+	done+=iov[i].iov_len;
+      }
+      break;
+    }
+    done+=n;
+    while (iovcnt>0 && (SIZE_T)n>=iov[0].iov_len) {
+      n-=iov[0].iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt>0) {
+      iov[0].iov_base=(BYTE_T*)iov[0].iov_base+n;
+      iov[0].iov_len-=n;
+    }
+  }
+  return done;
+}
+
+
+// Account for n more bytes of req having been transferred
+static void Advance(DiskRequest *req, SIZE_T n)
+{
+  req->pos+=n;
+  while (req->firstiov<req->iov.size() && n>=req->iov[req->firstiov].iov_len) {
+    n-=req->iov[req->firstiov].iov_len;
+    req->firstiov++;
+  }
+  if (req->firstiov<req->iov.size()) {
+    req->iov[req->firstiov].iov_base=(BYTE_T*)req->iov[req->firstiov].iov_base+n;
+    req->iov[req->firstiov].iov_len-=n;
+  }
+}
+
+
+// Carry out the rest of req with blocking I/O
+static ERROR_T Transfer(const int fd, DiskRequest *req)
+{
+  SIZE_T len=0;
+
+  for (SIZE_T i=req->firstiov;i<req->iov.size();i++) {
+    len+=req->iov[i].iov_len;
+  }
+  if (DiskTransfer(fd,req->pos,&(req->iov[req->firstiov]),req->iov.size()-req->firstiov,req->write)!=len) {
+    return ERROR_IMPLBUG;
+  }
+  return ERROR_NOERROR;
+}
+
+
+DiskQueue *DiskQueue::Create(const int fd)
+{
+#ifdef HAVE_URING
+  UringDiskQueue *u=new UringDiskQueue(fd);
+
+  if (u->IsReady()) {
+    return u;
+  }
+  delete u;
+#endif
+  return new ThreadDiskQueue(fd,DISKQUEUE_THREADS);
+}
+
+
+UringDiskQueue::UringDiskQueue(const int fd) :
+  datafd(fd), ringfd(-1), sqmap(0), cqmap(0), sqemap(0),
+  sqmaplen(0), cqmaplen(0), sqemaplen(0),
+  sqhead(0), sqtail(0), sqmask(0), sqarray(0), cqhead(0), cqtail(0), cqmask(0),
+  sqes(0), cqes(0), entries(0), inflight(0), reaping(false)
+{
+  pthread_mutex_init(&lock,0);
+  pthread_cond_init(&reaped,0);
+
+#ifdef HAVE_URING
+  struct io_uring_params p;
+  int fd2;
+
+  memset(&p,0,sizeof(p));
+  if ((fd2=syscall(__NR_io_uring_setup,DISKQUEUE_DEPTH,&p))<0) {
+    // too old a kernel, or not allowed here
+    return;
+  }
+
+  sqmaplen=p.sq_off.array+p.sq_entries*sizeof(unsigned);
+  cqmaplen=p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+  sqemaplen=p.sq_entries*sizeof(struct io_uring_sqe);
+
+  sqmap=mmap(0,sqmaplen,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd2,IORING_OFF_SQ_RING);
+  cqmap=mmap(0,cqmaplen,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd2,IORING_OFF_CQ_RING);
+  sqemap=mmap(0,sqemaplen,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd2,IORING_OFF_SQES);
+
+  if (sqmap==MAP_FAILED || cqmap==MAP_FAILED || sqemap==MAP_FAILED) {
+    if (sqmap!=MAP_FAILED) { munmap(sqmap,sqmaplen); }
+    if (cqmap!=MAP_FAILED) { munmap(cqmap,cqmaplen); }
+    if (sqemap!=MAP_FAILED) { munmap(sqemap,sqemaplen); }
+    sqmap=cqmap=sqemap=0;
+    close(fd2);
+    return;
+  }
+
+  sqhead=(unsigned*)((BYTE_T*)sqmap+p.sq_off.head);
+  sqtail=(unsigned*)((BYTE_T*)sqmap+p.sq_off.tail);
+  sqmask=(unsigned*)((BYTE_T*)sqmap+p.sq_off.ring_mask);
+  sqarray=(unsigned*)((BYTE_T*)sqmap+p.sq_off.array);
+  cqhead=(unsigned*)((BYTE_T*)cqmap+p.cq_off.head);
+  cqtail=(unsigned*)((BYTE_T*)cqmap+p.cq_off.tail);
+  cqmask=(unsigned*)((BYTE_T*)cqmap+p.cq_off.ring_mask);
+  sqes=sqemap;
+  cqes=(BYTE_T*)cqmap+p.cq_off.cqes;
+  // The completion queue is at least this big, so it can't overflow
+  entries=p.sq_entries;
+  ringfd=fd2;
+#endif
+}
+
+// Every request must have been waited for
+UringDiskQueue::~UringDiskQueue()
+{
+#ifdef HAVE_URING
+  if (ringfd>=0) {
+    munmap(sqmap,sqmaplen);
+    munmap(cqmap,cqmaplen);
+    munmap(sqemap,sqemaplen);
+    close(ringfd);
+  }
+#endif
+  ringfd=-1;
+  pthread_cond_destroy(&reaped);
+  pthread_mutex_destroy(&lock);
+}
+
+//
+// Queue the rest of req and tell the kernel about it.  Call with lock
+// held and fewer than entries requests in flight.  If the kernel
+// won't take it, it is done here with blocking I/O instead.
+//
+void UringDiskQueue::Push(DiskRequest *req)
+{
+#ifdef HAVE_URING
+  unsigned tail=*sqtail;
+  unsigned idx=tail & *sqmask;
+  struct io_uring_sqe *sqe=&(((struct io_uring_sqe *)sqes)[idx]);
+  SIZE_T left=req->iov.size()-req->firstiov;
+
+  memset(sqe,0,sizeof(*sqe));
+  sqe->opcode=req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+  sqe->fd=datafd;
+  sqe->off=req->pos;
+  sqe->addr=(unsigned long)&(req->iov[req->firstiov]);
+  // anything beyond IOV_MAX goes as a short transfer
+  sqe->len=left<IOV_MAX ? left : IOV_MAX;
+  sqe->user_data=(unsigned long)req;
+  sqarray[idx]=idx;
+  __atomic_store_n(sqtail,tail+1,__ATOMIC_RELEASE);
+  inflight++;
+
+  // Anything a failed call left behind goes in too
+  while (syscall(__NR_io_uring_enter,ringfd,
+		 *sqtail-__atomic_load_n(sqhead,__ATOMIC_ACQUIRE),0,0,0,0)<0) {
+    if (errno==EINTR || errno==EAGAIN) {
+      continue;
+    }
+    if (errno==EBUSY) {
+      // Completions are backed up, and nothing more goes in until
+      // they are out.  GETEVENTS moves any the kernel is holding
+      // back onto the completion queue.
+      syscall(__NR_io_uring_enter,ringfd,0,0,IORING_ENTER_GETEVENTS,0,0);
+      Reap();
+      continue;
+    }
+    if (__atomic_load_n(sqhead,__ATOMIC_ACQUIRE)==tail && *sqtail==tail+1) {
+      // The kernel never looked at it, so take it back
+      __atomic_store_n(sqtail,tail,__ATOMIC_RELEASE);
+      inflight--;
+      req->rc=Transfer(datafd,req);
+      req->done=true;
+    }
+    break;
+  }
+#endif
+}
+
+//
+// Handle everything on the completion queue.  Short transfers are
+// resubmitted; a read that hits the end of the file is finished with
+// zeros, as in DiskTransfer.  Call with lock held.
+//
+void UringDiskQueue::Reap()
+{
+#ifdef HAVE_URING
+  vector<DiskRequest *> again;
+  unsigned head=*cqhead;
+  unsigned tail=__atomic_load_n(cqtail,__ATOMIC_ACQUIRE);
+
+  for (;head!=tail;head++) {
+    struct io_uring_cqe *cqe=&(((struct io_uring_cqe *)cqes)[head & *cqmask]);
+    DiskRequest *req=(DiskRequest *)(unsigned long)cqe->user_data;
+    int res=cqe->res;
+
+    inflight--;
+    if (res==-EINTR || res==-EAGAIN) {
+      again.push_back(req);
+    } else if (res<0 || (res==0 && req->write)) {
+      req->rc=ERROR_IMPLBUG;
+      req->done=true;
+    } else if (res==0) {
+      for (SIZE_T i=req->firstiov;i<req->iov.size();i++) {
+	memset(req->iov[i].iov_base,0,req->iov[i].iov_len);
+      }
+      req->done=true;
+    } else {
+      Advance(req,res);
+      if (req->firstiov==req->iov.size()) {
+	req->done=true;
+      } else {
+	again.push_back(req);
+      }
+    }
+  }
+  __atomic_store_n(cqhead,head,__ATOMIC_RELEASE);
+
+  for (SIZE_T i=0;i<again.size();i++) {
+    Push(again[i]);
+  }
+#endif
+}
+
+//
+// Block until the kernel has completed something, then reap it for
+// everyone.  Call with lock held and nobody else reaping.  The lock
+// is dropped while we sleep so that others can submit.
+//
+void UringDiskQueue::WaitForCompletion()
+{
+#ifdef HAVE_URING
+  reaping=true;
+  pthread_mutex_unlock(&lock);
+  while (syscall(__NR_io_uring_enter,ringfd,0,1,IORING_ENTER_GETEVENTS,0,0)<0
+	 && errno==EINTR) {
+  }
+  pthread_mutex_lock(&lock);
+  Reap();
+  reaping=false;
+  pthread_cond_broadcast(&reaped);
+#endif
+}
+
+void UringDiskQueue::Start(DiskRequest *req)
+{
+  MutexHolder l(&lock);
+
+  while (inflight>=entries) {
+    if (reaping) {
+      pthread_cond_wait(&reaped,&lock);
+    } else {
+      WaitForCompletion();
+    }
+  }
+  Push(req);
+}
+
+void UringDiskQueue::Wait(DiskRequest *req)
+{
+  MutexHolder l(&lock);
+
+  while (!req->done) {
+    if (reaping) {
+      pthread_cond_wait(&reaped,&lock);
+    } else {
+      WaitForCompletion();
+    }
+  }
+}
+
+
+ThreadDiskQueue::ThreadDiskQueue(const int fd, const SIZE_T numthreads) :
+  datafd(fd), head(0), tail(0), stop(false)
+{
+  pthread_t t;
+
+  pthread_mutex_init(&lock,0);
+  pthread_cond_init(&work,0);
+  pthread_cond_init(&finished,0);
+  for (SIZE_T i=0;i<numthreads;i++) {
+    if (pthread_create(&t,0,ServeThread,this)) {
+      // Start copes with having none at all
+      break;
+    }
+    threads.push_back(t);
+  }
+}
+
+// Every request must have been waited for
+ThreadDiskQueue::~ThreadDiskQueue()
+{
+  pthread_mutex_lock(&lock);
+  stop=true;
+  pthread_cond_broadcast(&work);
+  pthread_mutex_unlock(&lock);
+  for (SIZE_T i=0;i<threads.size();i++) {
+    pthread_join(threads[i],0);
+  }
+  pthread_cond_destroy(&finished);
+  pthread_cond_destroy(&work);
+  pthread_mutex_destroy(&lock);
+}
+
+void ThreadDiskQueue::Serve()
+{
+  DiskRequest *req;
+  ERROR_T rc;
+
+  pthread_mutex_lock(&lock);
+  while (1) {
+    while (!head && !stop) {
+      pthread_cond_wait(&work,&lock);
+    }
+    if (!head) {
+      break;
+    }
+    req=head;
+    head=req->next;
+    if (!head) {
+      tail=0;
+    }
+    pthread_mutex_unlock(&lock);
+
+    rc=Transfer(datafd,req);
+
+    pthread_mutex_lock(&lock);
+    req->rc=rc;
+    req->done=true;
+    pthread_cond_broadcast(&finished);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void *ThreadDiskQueue::ServeThread(void *queue)
+{
+  ((ThreadDiskQueue *)queue)->Serve();
+  return 0;
+}
+
+void ThreadDiskQueue::Start(DiskRequest *req)
+{
+  MutexHolder l(&lock);
+
+  if (threads.empty()) {
+    req->rc=Transfer(datafd,req);
+    req->done=true;
+    return;
+  }
+  req->next=0;
+  if (tail) {
+    tail->next=req;
+  } else {
+    head=req;
+  }
+  tail=req;
+  pthread_cond_signal(&work);
+}
+
+void ThreadDiskQueue::Wait(DiskRequest *req)
+{
+  MutexHolder l(&lock);
+
+  while (!req->done) {
+    pthread_cond_wait(&finished,&lock);
+  }
+}
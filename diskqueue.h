@@ -0,0 +1,147 @@
+#ifndef _diskqueue
+#define _diskqueue
+
+#include <vector>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "global.h"
+#include "block.h"
+
+using namespace std;
+
+
+// Requests the io_uring queue keeps in the kernel at once
+#define DISKQUEUE_DEPTH 64
+// Threads that carry out requests when io_uring is not available
+#define DISKQUEUE_THREADS 4
+// Set to 0 to always use the threads
+#ifndef DISKQUEUE_USE_URING
+#define DISKQUEUE_USE_URING 1
+#endif
+
+
+//
+// One transfer between consecutive blocks of the disk and an array
+// of Blocks.  Fill in the first four fields and hand it to
+// DiskSystem::Submit.  From then until DiskSystem::Wait returns, the
+// request belongs to the disk: it and its blocks must not be touched,
+// moved, or resized.
+//
+struct DiskRequest {
+  bool    write;
+  SIZE_T  offblock;
+  SIZE_T  numblock;
+  Block  *blocks;      // numblock of them, each one block long
+  double  reqtime;     // modeled time, set by Submit
+  ERROR_T rc;          // set when the request is done
+
+  // The rest belongs to the queue
+  bool    done;
+  off_t   pos;         // file offset of the part not yet transferred
+  vector<struct iovec> iov;
+  SIZE_T  firstiov;    // first buffer not yet completely transferred
+  DiskRequest *next;
+
+  DiskRequest() : write(false), offblock(0), numblock(0), blocks(0),
+		  reqtime(0), rc(ERROR_NOERROR), done(false), pos(0),
+		  firstiov(0), next(0) {}
+};
+
+
+// Transfer iov to or from fd starting at off, resuming after short
+// transfers.  Reading past the end of the file yields zeros.
+// Returns the number of bytes transferred.
+SIZE_T DiskTransfer(const int fd, const off_t off, struct iovec *iov, int iovcnt, const bool write);
+
+
+//
+// Carries out DiskRequests against a file descriptor, many at a time,
+// in whatever order the device finishes them.  Start and Wait may be
+// called from any thread.
+//
+class DiskQueue {
+ public:
+  virtual ~DiskQueue() {}
+
+  // req->pos and req->iov describe the transfer
+  virtual void Start(DiskRequest *req)=0;
+  // Returns once req is done
+  virtual void Wait(DiskRequest *req)=0;
+
+  virtual const char *GetName() const=0;
+
+  // io_uring if the kernel lets us have one, threads otherwise
+  static DiskQueue *Create(const int fd);
+};
+
+
+//
+// Requests go straight into an io_uring submission queue.  Whoever
+// waits first reaps the completion queue on behalf of everyone else
+// and resubmits the rest of any short transfer.  All of the ring
+// state is protected by lock.
+//
+class UringDiskQueue : public DiskQueue {
+ private:
+  int       datafd, ringfd;
+  void     *sqmap, *cqmap, *sqemap;
+  size_t    sqmaplen, cqmaplen, sqemaplen;
+  unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+  unsigned *cqhead, *cqtail, *cqmask;
+  void     *sqes, *cqes;
+  unsigned  entries, inflight;
+  bool      reaping;
+  pthread_mutex_t lock;
+  pthread_cond_t  reaped;
+
+  void Push(DiskRequest *req);
+  void Reap();
+  void WaitForCompletion();
+ public:
+  UringDiskQueue(const int fd);
+  UringDiskQueue() { throw GenericException(); }
+  UringDiskQueue(const UringDiskQueue &rhs) { throw GenericException(); }
+  UringDiskQueue & operator=(const UringDiskQueue &rhs) { throw GenericException(); return *this; }
+  ~UringDiskQueue();
+
+  // false if the kernel would not give us a ring
+  bool IsReady() const { return ringfd>=0; }
+
+  void Start(DiskRequest *req);
+  void Wait(DiskRequest *req);
+  const char *GetName() const { return "io_uring"; }
+};
+
+
+//
+// A fixed set of threads take requests off a list and carry them out
+// with blocking positional I/O.  lock protects the list and the done
+// flags.
+//
+class ThreadDiskQueue : public DiskQueue {
+ private:
+  int          datafd;
+  DiskRequest *head, *tail;
+  bool         stop;
+  vector<pthread_t> threads;
+  pthread_mutex_t lock;
+  pthread_cond_t  work, finished;
+
+  void Serve();
+  static void *ServeThread(void *queue);
+ public:
+  ThreadDiskQueue(const int fd, const SIZE_T numthreads);
+  ThreadDiskQueue() { throw GenericException(); }
+  ThreadDiskQueue(const ThreadDiskQueue &rhs) { throw GenericException(); }
+  ThreadDiskQueue & operator=(const ThreadDiskQueue &rhs) { throw GenericException(); return *this; }
+  ~ThreadDiskQueue();
+
+  void Start(DiskRequest *req);
+  void Wait(DiskRequest *req);
+  const char *GetName() const { return "threads"; }
+};
+
+
+#endif
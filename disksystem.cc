@@ -1,12 +1,18 @@
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <math.h>
 
+#include <algorithm>
+
 #include "disksystem.h"
 
 
@@ -83,7 +89,7 @@ DiskSystem::DiskSystem(const string &filestem,
 		       const double trackseek,
 		       const double rotlat) :
   bitmap(0),
-  datafilefd(0),
+  datafilefd(-1),
   configfilefd(0),
   bitmapfilefd(0),
   diskfilestem(filestem), 
@@ -97,8 +103,16 @@ DiskSystem::DiskSystem(const string &filestem,
   last_sector(0),
   averageseeklatency(avgseek),
   trackseeklatency(trackseek),
-  rotationallatency(rotlat)
+  rotationallatency(rotlat),
+  queue(0),
+  mapbase(0),
+  maplen(0),
+  mapped(0),
+  dioalign(0),
+  schedule(DISK_SCHEDULE_CLOOK),
+  sweepup(true)
 {
+  pthread_mutex_init(&lock,0);
   if (create) { 
     // Only in this case are the parameters used:
     InitFromInMemoryConfig();
@@ -113,8 +127,11 @@ DiskSystem::~DiskSystem()
   WriteBitMap();
   fclose(configfilefd);
   fclose(bitmapfilefd);
-  fclose(datafilefd);
+  Unmap();
+  delete queue;
+  close(datafilefd);
   delete [] bitmap;
+  pthread_mutex_destroy(&lock);
 }
 
 ERROR_T DiskSystem::SanityCheckConfig()
@@ -257,9 +274,9 @@ ERROR_T DiskSystem::InitFromConfigFile()
     return rc;
   }
 
-  if (datafilefd) { fclose(datafilefd);}
+  if (datafilefd>=0) { close(datafilefd);}
 
-  if ((datafilefd = fopen(dataname.c_str(),"r+"))==0) { 
+  if ((datafilefd = open(dataname.c_str(),O_RDWR))<0) { 
     return ERROR_NOFILE;
   }
 
@@ -348,18 +365,11 @@ ERROR_T DiskSystem::InitFromInMemoryConfig()
   // notice that we will REUSE an existing data file if it exists
   // The idea is that we will write only from offset to offset+blocksize*numblocks
 
-  if (datafilefd) { fclose(datafilefd);}
+  if (datafilefd>=0) { close(datafilefd);}
 
-  if (stat(dataname.c_str(),&s)!=-1) { 
-    // reuse existing datafile
-    if ((datafilefd = fopen(dataname.c_str(),"r+"))==0) { 
-      return ERROR_NOFILE;
-    }
-  } else {
-    // create new data file
-    if ((datafilefd = fopen(dataname.c_str(),"w+"))==0) { 
-      return ERROR_NOFILE;
-    }
+  // reuses an existing datafile
+  if ((datafilefd = open(dataname.c_str(),O_RDWR|O_CREAT,0666))<0) { 
+    return ERROR_NOFILE;
   }
 
   return ERROR_NOERROR;
@@ -373,7 +383,9 @@ ERROR_T DiskSystem::InitFromInMemoryConfig()
 // Note, this assumes disk is kept continously busy
 // or that time does not advance except during a disk op
 //
-double DiskSystem::ModelAccess(const SIZE_T offblock, const SIZE_T numblock) 
+double DiskSystem::AccessTime(const SIZE_T fromtrack, const SIZE_T fromsector,
+			      const SIZE_T offblock, const SIZE_T numblock,
+			      SIZE_T &totrack, SIZE_T &tosector) const
 {
 
   SIZE_T req_trackstart = (offblock) / (numheads*blockspertrack);
@@ -382,7 +394,7 @@ double DiskSystem::ModelAccess(const SIZE_T offblock, const SIZE_T numblock)
   SIZE_T req_trackend = (offblock+numblock-1) / (numheads*blockspertrack);
   SIZE_T req_sectorend=  (offblock+numblock-1) % (numheads*blockspertrack);
 
-  SIZE_T trackhop = (SIZE_T) fabs((double)req_trackstart-(double)last_track);
+  SIZE_T trackhop = (SIZE_T) fabs((double)req_trackstart-(double)fromtrack);
   double trackhopfrac = (double)trackhop/(double)numtracks;
 
   // This is a simplistic model.  
@@ -393,7 +405,7 @@ double DiskSystem::ModelAccess(const SIZE_T offblock, const SIZE_T numblock)
   // Now we are on the first track and we need to wait for the first
   // sector to show up
 
-  SIZE_T sectorhop = (req_sectorstart >= last_sector) ? (req_sectorstart-last_sector) : (blockspertrack - (last_sector - req_sectorstart));
+  SIZE_T sectorhop = (req_sectorstart >= fromsector) ? (req_sectorstart-fromsector) : (blockspertrack - (fromsector - req_sectorstart));
   double sectorhopfrac = (double)sectorhop/(double)blockspertrack;
   double timeinrotation=rotationallatency*sectorhopfrac;
 
@@ -406,39 +418,162 @@ double DiskSystem::ModelAccess(const SIZE_T offblock, const SIZE_T numblock)
   // The total number of sectors read
   double timeinreadsectors = rotationallatency*((double)numblock/(double)blockspertrack);
 
-  last_track=req_trackend;
-  last_sector=req_sectorend;
+  totrack=req_trackend;
+  tosector=req_sectorend;
 
   return timeinseek+timeinrotation+timeintrackbytrackhops+timeinreadsectors;
 }
 
 
-ERROR_T DiskSystem::Read(const SIZE_T   inoffblock,
-			 const SIZE_T   numblock,
-			 vector<Block> &blocks,
-			 double        &reqtime)
+double DiskSystem::ModelAccess(const SIZE_T offblock, const SIZE_T numblock) 
+{
+  return AccessTime(last_track,last_sector,offblock,numblock,last_track,last_sector);
+}
+
+
+static bool StartsBefore(const DiskRequest *a, const DiskRequest *b)
+{
+  return a->offblock<b->offblock;
+}
+
+//
+// Put a batch in the order it will be served, starting from where
+// the head is now.  Call with lock held.
+//
+void DiskSystem::Schedule(vector<DiskRequest *> &reqs)
+{
+  SIZE_T head=last_track*numheads*blockspertrack+last_sector;
+  SIZE_T i, j, best, track, sector, besttrack=0, bestsector=0;
+  double t, besttime;
+  vector<DiskRequest *>::iterator mid;
+
+  switch (schedule) {
+  case DISK_SCHEDULE_SSTF:
+    // O(n^2), but batches are a cache's worth of runs at most
+    track=last_track;
+    sector=last_sector;
+    for (i=0;i<reqs.size();i++) {
+      best=i;
+      besttime=-1;
+      for (j=i;j<reqs.size();j++) {
+	SIZE_T tt, ts;
+	t=AccessTime(track,sector,reqs[j]->offblock,reqs[j]->numblock,tt,ts);
+	if (besttime<0 || t<besttime) {
+	  best=j;
+	  besttime=t;
+	  besttrack=tt;
+	  bestsector=ts;
+	}
+      }
+      swap(reqs[i],reqs[best]);
+      track=besttrack;
+      sector=bestsector;
+    }
+    break;
+  case DISK_SCHEDULE_SCAN:
+    stable_sort(reqs.begin(),reqs.end(),StartsBefore);
+    // the first request at or beyond the head
+    for (mid=reqs.begin(); mid!=reqs.end() && (*mid)->offblock<head; mid++) {
+    }
+    if (sweepup) {
+      // up from the head, then down from below it
+      reverse(reqs.begin(),mid);
+      rotate(reqs.begin(),mid,reqs.end());
+      if (mid!=reqs.begin()) {
+	sweepup=false;
+      }
+    } else {
+      // down from the head, then up from beyond it
+      reverse(reqs.begin(),mid);
+      if (mid!=reqs.end()) {
+	sweepup=true;
+      }
+    }
+    break;
+  case DISK_SCHEDULE_CLOOK:
+    stable_sort(reqs.begin(),reqs.end(),StartsBefore);
+    for (mid=reqs.begin(); mid!=reqs.end() && (*mid)->offblock<head; mid++) {
+    }
+    rotate(reqs.begin(),mid,reqs.end());
+    break;
+  case DISK_SCHEDULE_FIFO:
+  default:
+    break;
+  }
+}
+
+
+//
+// Check the range, charge the seek model and warn about unallocated
+// blocks.  Only this part of a request is serialized.  The request
+// is a batch of one as far as the scheduler is concerned, so that
+// scan keeps track of which way the head is going.
+//
+ERROR_T DiskSystem::StartAccess(const char *who, const SIZE_T inoffblock, const SIZE_T numblock, double &reqtime)
 {
   reqtime=0;
 
   if (inoffblock+numblock > numblocks) { 
-    cerr << "DiskSystem::Read: Attempt to read blocks "<<inoffblock<<" to "<<(inoffblock+numblock-1)<<", but maxmimum block is only "<<(numblocks-1)<<endl;
+    cerr << "DiskSystem::"<<who<<": Attempt to access blocks "<<inoffblock<<" to "<<(inoffblock+numblock-1)<<", but maxmimum block is only "<<(numblocks-1)<<endl;
     return ERROR_NOSPACE;
   }
 
+  DiskRequest req;
+  vector<DiskRequest *> reqs(1,&req);
+
+  req.offblock=inoffblock;
+  req.numblock=numblock;
+
+  pthread_mutex_lock(&lock);
+  Schedule(reqs);
   reqtime=ModelAccess(inoffblock,numblock);
+  pthread_mutex_unlock(&lock);
 
-  for (SIZE_T i=0;i<numblock;i++) { 
-    Block b(blocksize);
-    if (!IsBlockAllocated(inoffblock+i)) { 
-      if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
-	cerr <<"DiskSystem::Read: reading unallocated block "<<(i+inoffblock)<<endl;
+  if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
+    for (SIZE_T i=0;i<numblock;i++) { 
+      if (!IsBlockAllocated(inoffblock+i)) { 
+	cerr <<"DiskSystem::"<<who<<": accessing unallocated block "<<(i+inoffblock)<<endl;
       }
     }
-    if (myread(datafilefd,offset+(inoffblock+i)*blocksize,b.data,blocksize,true)!=blocksize) { 
-      cerr << "DiskSystem::Read: myread has failed"<<endl;
-      return ERROR_IMPLBUG;
+  }
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T DiskSystem::Read(const SIZE_T   inoffblock,
+			 const SIZE_T   numblock,
+			 vector<Block> &blocks,
+			 double        &reqtime)
+{
+  ERROR_T rc=StartAccess("Read",inoffblock,numblock,reqtime);
+
+  if (rc!=ERROR_NOERROR) { 
+    return rc;
+  }
+
+  SIZE_T first=blocks.size();
+
+  blocks.resize(first+numblock,Block(blocksize,dioalign));
+
+  if (mapped) {
+    for (SIZE_T i=0;i<numblock;i++) { 
+      memcpy(blocks[first+i].data,GetMappedBlock(inoffblock+i),blocksize);
     }
-    blocks.push_back(b);
+    return ERROR_NOERROR;
+  }
+
+  vector<struct iovec> iov(numblock);
+
+  for (SIZE_T i=0;i<numblock;i++) { 
+    iov[i].iov_base=blocks[first+i].data;
+    iov[i].iov_len=blocksize;
+  }
+
+  if (DiskTransfer(datafilefd,offset+inoffblock*blocksize,&(iov[0]),numblock,false)!=numblock*blocksize) { 
+    cerr << "DiskSystem::Read: preadv has failed"<<endl;
+    blocks.resize(first);
+    return ERROR_IMPLBUG;
   }
 
   return ERROR_NOERROR;
@@ -449,58 +584,468 @@ ERROR_T DiskSystem::Write(const SIZE_T   inoffblock,
 			  const vector<Block> &blocks,
 			  double        &reqtime)
 {
-  reqtime=0;
+  ERROR_T rc=StartAccess("Write",inoffblock,numblock,reqtime);
 
-  if (inoffblock+numblock > numblocks) { 
-    cerr << "DiskSystem::Write: Attempt to write blocks "<<inoffblock<<" to "<<(inoffblock+numblock-1)<<", but maxmimum block is only "<<(numblocks-1)<<endl;
-    return ERROR_NOSPACE;
+  if (rc!=ERROR_NOERROR) { 
+    return rc;
   }
 
-  reqtime=ModelAccess(inoffblock,numblock);
+  if (mapped) {
+    for (SIZE_T i=0;i<numblock;i++) { 
+      // a block that borrows its mapped storage is already there
+      if (blocks[i].data!=GetMappedBlock(inoffblock+i)) {
+	memcpy(GetMappedBlock(inoffblock+i),blocks[i].data,blocksize);
+      }
+    }
+    return ERROR_NOERROR;
+  }
+
+  vector<struct iovec> iov(numblock);
+  vector<Block> bounce;
 
+  bounce.reserve(numblock);
   for (SIZE_T i=0;i<numblock;i++) { 
-    if (!IsBlockAllocated(inoffblock+i)) { 
-      if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
-	cerr <<"DiskSystem::Write: writing unallocated block "<<(i+inoffblock)<<endl;
+    iov[i].iov_base=blocks[i].data;
+    iov[i].iov_len=blocksize;
+    if (!IsAligned(blocks[i].data)) {
+      bounce.push_back(blocks[i]);
+      if ((rc=bounce.back().Align(dioalign))!=ERROR_NOERROR) {
+	return rc;
       }
+      iov[i].iov_base=bounce.back().data;
     }
-    if (mywrite(datafilefd,offset+(inoffblock+i)*blocksize,blocks[i].data,blocksize)!=blocksize) {  
-      cerr << "DiskSystem::Write: mywrite has failed"<<endl;
-      return ERROR_IMPLBUG;
-    }
+  }
+
+  if (DiskTransfer(datafilefd,offset+inoffblock*blocksize,&(iov[0]),numblock,true)!=numblock*blocksize) {  
+    cerr << "DiskSystem::Write: pwritev has failed"<<endl;
+    return ERROR_IMPLBUG;
   }
 
   return ERROR_NOERROR;
 }
 
 
-ERROR_T DiskSystem::Read(const SIZE_T inoffblock, Block &blocks, double &reqtime)
+// The single block forms transfer directly to and from the caller's
+// block, which must be (or is resized to be) one block long
+ERROR_T DiskSystem::Read(const SIZE_T inoffblock, Block &block, double &reqtime)
 {
-  vector<Block> bl;
+  ERROR_T rc=StartAccess("Read",inoffblock,1,reqtime);
+
+  if (rc!=ERROR_NOERROR) { 
+    return rc;
+  }
+
+  if (block.length!=blocksize) {
+    if ((rc=block.Resize(blocksize,false))!=ERROR_NOERROR) {
+      return rc;
+    }
+  }
+  if (!IsAligned(block.data)) {
+    if ((rc=block.Align(dioalign))!=ERROR_NOERROR) {
+      return rc;
+    }
+  }
+
+  if (mapped) {
+    if (block.data!=GetMappedBlock(inoffblock)) {
+      memcpy(block.data,GetMappedBlock(inoffblock),blocksize);
+    }
+    return ERROR_NOERROR;
+  }
+
+  struct iovec iov;
+
+  iov.iov_base=block.data;
+  iov.iov_len=blocksize;
+
+  if (DiskTransfer(datafilefd,offset+inoffblock*blocksize,&iov,1,false)!=blocksize) { 
+    cerr << "DiskSystem::Read: pread has failed"<<endl;
+    return ERROR_IMPLBUG;
+  }
+
+  return ERROR_NOERROR;
+}
 
-  ERROR_T rc = Read(inoffblock,1,bl,reqtime);
+ERROR_T DiskSystem::Write(const SIZE_T inoffblock, const Block &block, double &reqtime)
+{
+  ERROR_T rc=StartAccess("Write",inoffblock,1,reqtime);
 
   if (rc!=ERROR_NOERROR) { 
     return rc;
   }
 
-  blocks = bl[0];
+  if (block.length!=blocksize) {
+    return ERROR_WRONGSIZEBLOCK;
+  }
+
+  if (mapped) {
+    if (block.data!=GetMappedBlock(inoffblock)) {
+      memcpy(GetMappedBlock(inoffblock),block.data,blocksize);
+    }
+    return ERROR_NOERROR;
+  }
+
+  struct iovec iov;
+  Block bounce;
+
+  iov.iov_base=block.data;
+  iov.iov_len=blocksize;
+  if (!IsAligned(block.data)) {
+    bounce=block;
+    if ((rc=bounce.Align(dioalign))!=ERROR_NOERROR) {
+      return rc;
+    }
+    iov.iov_base=bounce.data;
+  }
+
+  if (DiskTransfer(datafilefd,offset+inoffblock*blocksize,&iov,1,true)!=blocksize) {  
+    cerr << "DiskSystem::Write: pwrite has failed"<<endl;
+    return ERROR_IMPLBUG;
+  }
 
   return ERROR_NOERROR;
 }
 
-ERROR_T DiskSystem::Write(const SIZE_T inoffblock, const Block &blocks, double &reqtime)
+
+ERROR_T DiskSystem::Submit(DiskRequest &req)
 {
-  vector<Block> bl;
+  vector<DiskRequest *> reqs(1,&req);
+
+  return SubmitBatch(reqs);
+}
 
-  bl.push_back(blocks);
+ERROR_T DiskSystem::Submit(vector<DiskRequest> &reqs)
+{
+  vector<DiskRequest *> p(reqs.size());
 
-  ERROR_T rc = Write(inoffblock,1,bl,reqtime);
+  for (SIZE_T i=0;i<reqs.size();i++) {
+    p[i]=&(reqs[i]);
+  }
+  return SubmitBatch(p);
+}
 
-  if (rc!=ERROR_NOERROR) { 
+ERROR_T DiskSystem::Submit(vector<DiskRequest *> &reqs)
+{
+  return SubmitBatch(reqs);
+}
+
+//
+// Check every request of the batch before any of it is charged, so
+// that it is accepted or refused as a whole.  Then order it, charge
+// it to the model in that order and start the transfers.
+//
+ERROR_T DiskSystem::SubmitBatch(vector<DiskRequest *> &reqs)
+{
+  ERROR_T rc;
+  SIZE_T i, j;
+
+  for (i=0;i<reqs.size();i++) {
+    DiskRequest &req=*(reqs[i]);
+    if (req.offblock+req.numblock > numblocks) {
+      cerr << "DiskSystem::"<<(req.write ? "Write" : "Read")<<": Attempt to access blocks "<<req.offblock<<" to "<<(req.offblock+req.numblock-1)<<", but maxmimum block is only "<<(numblocks-1)<<endl;
+      return ERROR_NOSPACE;
+    }
+    for (j=0;j<req.numblock;j++) { 
+      if (req.blocks[j].length!=blocksize) {
+	return ERROR_WRONGSIZEBLOCK;
+      }
+      if (!IsAligned(req.blocks[j].data)) {
+	if ((rc=req.blocks[j].Align(dioalign))!=ERROR_NOERROR) {
+	  return rc;
+	}
+      }
+    }
+  }
+
+  pthread_mutex_lock(&lock);
+  Schedule(reqs);
+  for (i=0;i<reqs.size();i++) {
+    reqs[i]->reqtime=ModelAccess(reqs[i]->offblock,reqs[i]->numblock);
+  }
+  if (!mapped && !queue) {
+    // started the first time it is needed, so that tools that only
+    // use the synchronous calls don't pay for threads or a ring
+    queue=DiskQueue::Create(datafilefd);
+  }
+  pthread_mutex_unlock(&lock);
+
+  for (i=0;i<reqs.size();i++) {
+    if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
+      for (j=0;j<reqs[i]->numblock;j++) { 
+	if (!IsBlockAllocated(reqs[i]->offblock+j)) { 
+	  cerr <<"DiskSystem::"<<(reqs[i]->write ? "Write" : "Read")<<": accessing unallocated block "<<(reqs[i]->offblock+j)<<endl;
+	}
+      }
+    }
+    StartTransfer(*(reqs[i]));
+  }
+
+  return ERROR_NOERROR;
+}
+
+void DiskSystem::StartTransfer(DiskRequest &req)
+{
+  req.rc=ERROR_NOERROR;
+
+  if (mapped) {
+    // nothing to wait for
+    for (SIZE_T i=0;i<req.numblock;i++) { 
+      BYTE_T *m=GetMappedBlock(req.offblock+i);
+      if (req.blocks[i].data!=m) {
+	if (req.write) {
+	  memcpy(m,req.blocks[i].data,blocksize);
+	} else {
+	  memcpy(req.blocks[i].data,m,blocksize);
+	}
+      }
+    }
+    req.done=true;
+    return;
+  }
+
+  req.iov.resize(req.numblock);
+  for (SIZE_T i=0;i<req.numblock;i++) { 
+    req.iov[i].iov_base=req.blocks[i].data;
+    req.iov[i].iov_len=blocksize;
+  }
+  req.pos=offset+(off_t)req.offblock*blocksize;
+  req.firstiov=0;
+  req.done=false;
+
+  queue->Start(&req);
+}
+
+ERROR_T DiskSystem::Wait(DiskRequest &req)
+{
+  if (!mapped) {
+    queue->Wait(&req);
+  }
+
+  return req.rc;
+}
+
+
+ERROR_T DiskSystem::Map(const DiskAccessPattern pattern)
+{
+  if (mapped || dioalign) {
+    return ERROR_CONFLICT;
+  }
+
+  // mmap wants a page aligned file offset
+  off_t  pagesize=sysconf(_SC_PAGESIZE);
+  off_t  start=offset-offset%pagesize;
+  off_t  end=offset+(off_t)numblocks*blocksize;
+
+  // touching a mapped page past the end of the file is a SIGBUS
+  if (ExtendDataFile()!=ERROR_NOERROR) {
+    return ERROR_NOFILE;
+  }
+
+  void *p=mmap(0,end-start,PROT_READ|PROT_WRITE,MAP_SHARED,datafilefd,start);
+
+  if (p==MAP_FAILED) {
+    return ERROR_NOMEM;
+  }
+  mapbase=(BYTE_T*)p;
+  maplen=end-start;
+  mapped=mapbase+(offset-start);
+
+  return Advise(pattern);
+}
+
+ERROR_T DiskSystem::Advise(const DiskAccessPattern pattern)
+{
+  int advice;
+
+  if (!mapped) {
+    return ERROR_NOERROR;
+  }
+  switch (pattern) {
+  case DISK_ACCESS_RANDOM:
+    advice=MADV_RANDOM;
+    break;
+  case DISK_ACCESS_SEQUENTIAL:
+    advice=MADV_SEQUENTIAL;
+    break;
+  case DISK_ACCESS_NORMAL:
+  default:
+    advice=MADV_NORMAL;
+    break;
+  }
+  // only a hint
+  madvise(mapbase,maplen,advice);
+  return ERROR_NOERROR;
+}
+
+ERROR_T DiskSystem::Unmap()
+{
+  if (!mapped) {
+    return ERROR_NOERROR;
+  }
+
+  ERROR_T rc=Sync();
+
+  munmap(mapbase,maplen);
+  mapbase=mapped=0;
+  maplen=0;
+  return rc;
+}
+
+BYTE_T *DiskSystem::GetMappedBlock(const SIZE_T block) const
+{
+  if (!mapped || block>=numblocks) {
+    return 0;
+  }
+  return mapped+(size_t)block*blocksize;
+}
+
+ERROR_T DiskSystem::Sync(const SIZE_T offblock, const SIZE_T numblock)
+{
+  if (!mapped) {
+    return ERROR_NOERROR;
+  }
+
+  SIZE_T num = numblock ? numblock : numblocks;
+
+  if (offblock+num > numblocks) {
+    return ERROR_NOSPACE;
+  }
+
+  // msync wants a page aligned start
+  size_t pagesize=sysconf(_SC_PAGESIZE);
+  size_t from=(GetMappedBlock(offblock)-mapbase)/pagesize*pagesize;
+  size_t to=(GetMappedBlock(offblock)-mapbase)+(size_t)num*blocksize;
+
+  if (msync(mapbase+from,to-from,MS_SYNC)) {
+    cerr << "DiskSystem::Sync: msync has failed"<<endl;
+    return ERROR_IMPLBUG;
+  }
+  return ERROR_NOERROR;
+}
+
+// Make the data file long enough to hold every block
+ERROR_T DiskSystem::ExtendDataFile()
+{
+  off_t  end=offset+(off_t)numblocks*blocksize;
+  struct stat st;
+
+  if (fstat(datafilefd,&st) || (st.st_size<end && ftruncate(datafilefd,end))) {
+    return ERROR_NOFILE;
+  }
+  return ERROR_NOERROR;
+}
+
+
+//
+// What direct I/O on fd needs buffers (mem) and file offsets and
+// lengths (off) to be aligned to.  Kernels that can't say get the
+// page size, which is enough for any device we know of.
+//
+static ERROR_T DirectIOAlignment(const int fd, SIZE_T &mem, SIZE_T &off)
+{
+#ifdef STATX_DIOALIGN
+  struct statx stx;
+
+  if (statx(fd,"",AT_EMPTY_PATH,STATX_DIOALIGN,&stx)==0 && (stx.stx_mask & STATX_DIOALIGN)) {
+    if (!stx.stx_dio_offset_align) {
+      // the file system does not do direct I/O on this file
+      return ERROR_NOFILE;
+    }
+    mem=stx.stx_dio_mem_align;
+    off=stx.stx_dio_offset_align;
+    // posix_memalign won't go below this
+    if (mem<sizeof(void*)) {
+      mem=sizeof(void*);
+    }
+    return ERROR_NOERROR;
+  }
+#endif
+  mem=off=sysconf(_SC_PAGESIZE);
+  return ERROR_NOERROR;
+}
+
+ERROR_T DiskSystem::EnableDirectIO()
+{
+  SIZE_T mem, off;
+  int    flags;
+  ERROR_T rc;
+
+  if (mapped) {
+    return ERROR_CONFLICT;
+  }
+  if (dioalign) {
+    return ERROR_NOERROR;
+  }
+  if ((rc=DirectIOAlignment(datafilefd,mem,off))!=ERROR_NOERROR) {
     return rc;
   }
+  if (blocksize%off || offset%off) {
+    cerr << "DiskSystem::EnableDirectIO: block size "<<blocksize<<" and offset "<<offset<<" must be multiples of "<<off<<" for direct I/O"<<endl;
+    return ERROR_BADCONFIG;
+  }
+  // A direct read that stops short at the end of the file can't be
+  // resumed, since the rest of it starts at an unaligned offset
+  if (ExtendDataFile()!=ERROR_NOERROR) {
+    return ERROR_NOFILE;
+  }
+  if ((flags=fcntl(datafilefd,F_GETFL))<0 || fcntl(datafilefd,F_SETFL,flags|O_DIRECT)) {
+    return ERROR_NOFILE;
+  }
+  // whatever the page cache already holds of the disk is now dead
+  // weight, though only clean pages can be dropped
+  fdatasync(datafilefd);
+  posix_fadvise(datafilefd,offset,(off_t)numblocks*blocksize,POSIX_FADV_DONTNEED);
+  dioalign=mem;
+  return ERROR_NOERROR;
+}
+
+ERROR_T DiskSystem::DisableDirectIO()
+{
+  int flags;
+
+  if (!dioalign) {
+    return ERROR_NOERROR;
+  }
+  if ((flags=fcntl(datafilefd,F_GETFL))<0 || fcntl(datafilefd,F_SETFL,flags&~O_DIRECT)) {
+    return ERROR_NOFILE;
+  }
+  dioalign=0;
+  return ERROR_NOERROR;
+}
+
+void DiskSystem::SetSchedule(const DiskSchedule sched)
+{
+  MutexHolder l(&lock);
+  schedule=sched;
+}
+
+ERROR_T DiskSystem::ParseSchedule(const string &name, DiskSchedule &sched)
+{
+  if (name=="fifo") {
+    sched=DISK_SCHEDULE_FIFO;
+  } else if (name=="sstf") {
+    sched=DISK_SCHEDULE_SSTF;
+  } else if (name=="scan") {
+    sched=DISK_SCHEDULE_SCAN;
+  } else if (name=="clook") {
+    sched=DISK_SCHEDULE_CLOOK;
+  } else {
+    return ERROR_BADCONFIG;
+  }
+  return ERROR_NOERROR;
+}
 
+ERROR_T DiskSystem::ParseAccessPattern(const string &name, DiskAccessPattern &pattern)
+{
+  if (name=="normal") {
+    pattern=DISK_ACCESS_NORMAL;
+  } else if (name=="random") {
+    pattern=DISK_ACCESS_RANDOM;
+  } else if (name=="sequential") {
+    pattern=DISK_ACCESS_SEQUENTIAL;
+  } else {
+    return ERROR_BADCONFIG;
+  }
   return ERROR_NOERROR;
 }
 
@@ -524,7 +1069,10 @@ SIZE_T DiskSystem::GetNumBlocks() const
 
 bool DiskSystem::IsBlockAllocated(const SIZE_T block)
 {
-  return GETBIT(block);
+  pthread_mutex_lock(&lock);
+  bool allocated=GETBIT(block);
+  pthread_mutex_unlock(&lock);
+  return allocated;
 }
 
 
@@ -536,14 +1084,16 @@ ERROR_T DiskSystem::NotifyAllocateBlocks(const SIZE_T offset, const SIZE_T innum
   }
 
 
+  pthread_mutex_lock(&lock);
   for (SIZE_T i=offset; i<(offset+innumblocks); i++) { 
-    if (IsBlockAllocated(i)) {
+    if (GETBIT(i)) {
       if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
 	cerr << "Disksystem: NotifyAllocateBlocks: Block "<<i<<" is being allocated, but it's already allocated!"<<endl;
       }
     }
     SETBIT(i);
   }
+  pthread_mutex_unlock(&lock);
 
   return ERROR_NOERROR;
 }
@@ -556,14 +1106,16 @@ ERROR_T DiskSystem::NotifyDeallocateBlocks(const SIZE_T offset,const SIZE_T innu
   }
 
 
+  pthread_mutex_lock(&lock);
   for (SIZE_T i=offset; i<(offset+innumblocks); i++) { 
-    if (!IsBlockAllocated(i)) {
+    if (!GETBIT(i)) {
       if (PRINT_DISKSYSTEM_ALLOCATION_ERRORS) {
 	cerr << "Disksystem: NotifyDeallocateBlocks: Block "<<i<<" is being deallocated, but it's already deallocated!"<<endl;
       }
     }
     CLEARBIT(i);
   }
+  pthread_mutex_unlock(&lock);
 
   return ERROR_NOERROR;
 }
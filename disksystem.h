@@ -4,13 +4,51 @@
 #include <string>
 #include <iostream>
 #include <vector>
+#include <pthread.h>
 
 #include "global.h"
 #include "block.h"
+#include "diskqueue.h"
 
 using namespace std;
 
-// Models a single disk with a single outstanding request
+// Access patterns for a mapped disk, passed on to madvise
+enum DiskAccessPattern {DISK_ACCESS_NORMAL, DISK_ACCESS_RANDOM, DISK_ACCESS_SEQUENTIAL};
+
+// The order in which a batch of requests is served
+enum DiskSchedule {DISK_SCHEDULE_FIFO, DISK_SCHEDULE_SSTF, DISK_SCHEDULE_SCAN, DISK_SCHEDULE_CLOOK};
+
+
+// Models a single disk.  The time model charges requests as if
+// they were served one at a time, in the order they are issued.
+// A batch of requests submitted together is first put in the order
+// the scheduler picks (SetSchedule):
+//
+//   fifo   as given
+//   sstf   whichever is cheapest to reach from where the head is,
+//          by the seek and rotation model, repeatedly
+//   scan   elevator: on in the direction the head was going, then
+//          back the other way
+//   clook  ascending from the head, then wrap around to the lowest
+//
+// The head position, and so the cost of every request, carries over
+// from one batch to the next.
+//
+// The data file is accessed with positional I/O on a raw descriptor,
+// so transfers need no shared file position and may be issued from
+// several threads at once.  Requests may also be submitted
+// asynchronously, in which case many of them can be outstanding on
+// the real device together (see DiskQueue).  The seek model, the
+// bitmap and the creation of the queue are protected by lock.
+//
+// The data file may instead be mapped into memory (Map), which
+// serves reads and writes with memcpy and lets a caller use the
+// mapped bytes of a block in place.  The time model is charged just
+// the same.
+//
+// Or it may be opened for direct I/O (EnableDirectIO), which moves
+// data between the device and the caller's blocks without a copy in
+// the kernel's page cache, and without kernel readahead.
 //
 // Includes storage allocator and free space bitmap to 
 // simplify project - REAL DISKS DO NOT HAVE ALLOCATORS OR BITMAPS
@@ -18,7 +56,7 @@ using namespace std;
 class DiskSystem {
  private:
   BYTE_T *bitmap;
-  FILE*  datafilefd;
+  int    datafilefd;
   FILE*  configfilefd;
   FILE*  bitmapfilefd;
 
@@ -41,8 +79,33 @@ class DiskSystem {
   double trackseeklatency;
   double rotationallatency;
 
+  pthread_mutex_t lock;
+  DiskQueue *queue;
+
+  BYTE_T *mapbase;     // page aligned start of the mapping
+  size_t  maplen;
+  BYTE_T *mapped;      // block 0, or 0 if not mapped
+
+  SIZE_T  dioalign;    // buffer alignment for direct I/O, 0 if not direct
+
+  DiskSchedule schedule;
+  bool    sweepup;     // direction of the last scan
+
+  bool IsAligned(const BYTE_T *p) const { return !dioalign || ((unsigned long)p)%dioalign==0; }
+
  protected:
+  // Time to serve an access with the head at fromtrack/fromsector,
+  // and where the head is left
+  double AccessTime(const SIZE_T fromtrack, const SIZE_T fromsector,
+		    const SIZE_T off, const SIZE_T num,
+		    SIZE_T &totrack, SIZE_T &tosector) const;
+  // Call with lock held
   virtual double ModelAccess(const SIZE_T off, const SIZE_T num);
+  virtual void   Schedule(vector<DiskRequest *> &reqs);
+  ERROR_T StartAccess(const char *who, const SIZE_T off, const SIZE_T num, double &reqtime);
+  ERROR_T SubmitBatch(vector<DiskRequest *> &reqs);
+  void    StartTransfer(DiskRequest &req);
+  ERROR_T ExtendDataFile();
 
   ERROR_T SanityCheckConfig();
   ERROR_T InitFromConfigFile();
@@ -75,6 +138,8 @@ class DiskSystem {
   virtual ~DiskSystem();
 
   // Each returns the number of milliseconds the operation has taken
+  //
+  // A multiblock request is a single vectored system call
 
   ERROR_T Read(const SIZE_T inoffblock,
 	       const SIZE_T numblock,
@@ -94,6 +159,65 @@ class DiskSystem {
 		const Block &blocks,
 		double &reqtime);
 
+  // Asynchronous form of the above.  Submit checks the request,
+  // charges it to the time model (setting req.reqtime), and starts
+  // the transfer.  Wait returns once it is done, with req.rc.  Every
+  // request that Submit accepts must be waited for.
+  ERROR_T Submit(DiskRequest &req);
+  ERROR_T Wait(DiskRequest &req);
+  // A batch of requests, served and charged in the order the
+  // scheduler picks (each one's reqtime is what it cost in that
+  // order).  Either all of them are accepted or none are.
+  ERROR_T Submit(vector<DiskRequest> &reqs);
+  // The same for requests that live elsewhere.  reqs is left in the
+  // order they were served.
+  ERROR_T Submit(vector<DiskRequest *> &reqs);
+
+  void         SetSchedule(const DiskSchedule sched);
+  DiskSchedule GetSchedule() const { return schedule; }
+  // returns one of ERROR_NOERROR or ERROR_BADCONFIG if name is not
+  // one of fifo, sstf, scan, or clook
+  static ERROR_T ParseSchedule(const string &name, DiskSchedule &sched);
+
+  // Serve the data file from a shared mapping from now on.  The
+  // file is extended to cover the whole disk first.  Writes land in
+  // the mapping and reach the file when it is synced, which Unmap
+  // and the destructor do.  Map, Advise and Unmap must not overlap
+  // with any other use of the disk.
+  // returns ERROR_NOERROR, ERROR_CONFLICT if already mapped or doing
+  // direct I/O, or ERROR_NOMEM if the mapping can't be made
+  ERROR_T Map(const DiskAccessPattern pattern=DISK_ACCESS_RANDOM);
+  ERROR_T Advise(const DiskAccessPattern pattern);
+  ERROR_T Unmap();
+  bool    IsMapped() const { return mapped!=0; }
+  // Where a block lives in the mapping, or 0 if the disk is not
+  // mapped.  A Block that borrows this storage (Block::Borrow) is
+  // read and written by the disk without any copying.
+  BYTE_T *GetMappedBlock(const SIZE_T block) const;
+  // Write mapped changes to the given blocks (all blocks if numblock
+  // is zero) back to the file.  Does nothing if the disk is not mapped.
+  ERROR_T Sync(const SIZE_T offblock=0, const SIZE_T numblock=0);
+
+  // Transfer data with O_DIRECT from now on, so that the only cached
+  // copy of a block is the caller's.  The block size and offset must
+  // be multiples of the direct I/O alignment of the file system.
+  // Blocks whose data is not aligned to GetAlignment() still work:
+  // Read and Submit give them aligned storage (Block::Align), and
+  // Write copies them to an aligned buffer first.  Must not overlap
+  // with any other use of the disk.
+  // returns ERROR_NOERROR, ERROR_CONFLICT if the disk is mapped,
+  // ERROR_BADCONFIG if the block size or offset are not aligned, or
+  // ERROR_NOFILE if the file system can't do direct I/O
+  ERROR_T EnableDirectIO();
+  ERROR_T DisableDirectIO();
+  bool    IsDirectIO() const { return dioalign!=0; }
+  // What Block data should be aligned to, 0 if anything will do
+  SIZE_T  GetAlignment() const { return dioalign; }
+
+  // returns one of ERROR_NOERROR or ERROR_BADCONFIG if name is not
+  // one of normal, random, or sequential
+  static ERROR_T ParseAccessPattern(const string &name, DiskAccessPattern &pattern);
+
   SIZE_T GetBlockSize() const;
   SIZE_T GetNumBlocks() const;
 
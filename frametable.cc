@@ -0,0 +1,189 @@
+#include "frametable.h"
+
+
+FrameTable::FrameTable(const SIZE_T numframes) : count(0), freeframes(0)
+{
+  SIZE_T n=numframes>0 ? numframes : 1;
+  SIZE_T size=16;
+
+  // Keep the table at most half full
+  while (size<2*n) {
+    size*=2;
+  }
+  slots = new Slot [size];
+  for (SIZE_T i=0;i<size;i++) {
+    slots[i].frame=0;
+  }
+  mask=size-1;
+
+  AddFrames(n);
+}
+
+
+FrameTable::~FrameTable()
+{
+  delete [] slots;
+  for (SIZE_T i=0;i<arenas.size();i++) {
+    delete [] arenas[i];
+  }
+}
+
+
+// Fibonacci hashing spreads runs of consecutive block numbers
+SIZE_T FrameTable::Home(const SIZE_T blocknum) const
+{
+  SIZE_T h=blocknum*2654435769U;
+
+  return (h ^ (h>>16)) & mask;
+}
+
+
+void FrameTable::AddFrames(const SIZE_T num)
+{
+  CacheFrame *arena = new CacheFrame [num];
+
+  arenas.push_back(arena);
+  for (SIZE_T i=num;i>0;i--) {
+    arena[i-1].next=freeframes;
+    freeframes=&(arena[i-1]);
+  }
+}
+
+
+void FrameTable::Grow()
+{
+  Slot *old=slots;
+  SIZE_T oldsize=mask+1;
+
+  slots = new Slot [2*oldsize];
+  for (SIZE_T i=0;i<2*oldsize;i++) {
+    slots[i].frame=0;
+  }
+  mask=2*oldsize-1;
+
+  for (SIZE_T i=0;i<oldsize;i++) {
+    if (old[i].frame) {
+      SIZE_T j;
+      for (j=Home(old[i].blocknum); slots[j].frame; j=(j+1)&mask) {
+      }
+      slots[j]=old[i];
+    }
+  }
+  delete [] old;
+}
+
+
+CacheFrame *FrameTable::Find(const SIZE_T blocknum) const
+{
+  for (SIZE_T i=Home(blocknum); slots[i].frame; i=(i+1)&mask) {
+    if (slots[i].blocknum==blocknum) {
+      return slots[i].frame;
+    }
+  }
+  return 0;
+}
+
+
+CacheFrame *FrameTable::Take(const SIZE_T blocknum)
+{
+  if (!freeframes) {
+    // only when everything is pinned, so a few will do
+    AddFrames(64);
+  }
+
+  CacheFrame *f=freeframes;
+  freeframes=f->next;
+  f->next=0;
+  f->blocknum=blocknum;
+  return f;
+}
+
+
+CacheFrame *FrameTable::Insert(const SIZE_T blocknum)
+{
+  SIZE_T i;
+
+  if (2*(count+1)>mask+1) {
+    Grow();
+  }
+
+  CacheFrame *f=Take(blocknum);
+
+  for (i=Home(blocknum); slots[i].frame; i=(i+1)&mask) {
+  }
+  slots[i].blocknum=blocknum;
+  slots[i].frame=f;
+  count++;
+
+  return f;
+}
+
+
+void FrameTable::Erase(CacheFrame *f)
+{
+  SIZE_T i, j, k;
+
+  for (i=Home(f->blocknum); slots[i].frame!=f; i=(i+1)&mask) {
+  }
+
+  // Backward shift deletion: move later members of the probe run
+  // into the hole unless that would put them before their home
+  // slot, so that no tombstones are needed
+  for (j=(i+1)&mask; slots[j].frame; j=(j+1)&mask) {
+    k=Home(slots[j].blocknum);
+    if (i<=j ? (i<k && k<=j) : (i<k || k<=j)) {
+      continue;
+    }
+    slots[i]=slots[j];
+    i=j;
+  }
+  slots[i].frame=0;
+  count--;
+
+  Release(f);
+}
+
+
+CacheFrame *FrameTable::Replace(CacheFrame *f)
+{
+  SIZE_T i;
+
+  for (i=Home(f->blocknum); slots[i].frame!=f; i=(i+1)&mask) {
+  }
+  slots[i].frame=Take(f->blocknum);
+  f->retired=true;
+  return slots[i].frame;
+}
+
+
+void FrameTable::Release(CacheFrame *f)
+{
+  // Everything but the block storage goes back to the initial state
+  f->blocknum=0;
+  f->block.dirty=false;
+  f->block.lastaccessed=-1;
+  f->prev=0;
+  f->queue=0;
+  f->referenced=false;
+  f->readytime=0;
+  f->prefetched=false;
+  f->dirtyprev=f->dirtynext=0;
+  f->dirtytime=0;
+  f->version=0;
+  f->pincount=0;
+  f->retired=false;
+  f->next=freeframes;
+  freeframes=f;
+}
+
+
+CacheFrame *FrameTable::Next(SIZE_T &pos) const
+{
+  while (pos<=mask) {
+    if (slots[pos].frame) {
+      return slots[pos++].frame;
+    }
+    pos++;
+  }
+  return 0;
+}
@@ -0,0 +1,71 @@
+#ifndef _frametable
+#define _frametable
+
+#include <vector>
+
+#include "global.h"
+#include "cachepolicy.h"
+
+using namespace std;
+
+
+//
+// Maps block numbers to the frames that hold them.
+//
+// The frames live in an arena that is allocated up front, so a
+// frame's address never changes and reusing one costs nothing.
+// A frame keeps its Block storage when it is reused, so once the
+// cache is warm no block data is allocated either.  The index is an
+// open addressing table with linear probing that holds the block
+// number next to the frame pointer.  A hit usually takes one probe
+// and touches a single cache line of the table.
+//
+// The arena only grows if frames are requested beyond numframes
+// (which the buffer cache does only when everything is pinned).
+//
+class FrameTable {
+ private:
+  struct Slot {
+    SIZE_T      blocknum;
+    CacheFrame *frame;     // 0 means the slot is empty
+  };
+
+  Slot        *slots;
+  SIZE_T       mask;       // table size - 1, table size is a power of 2
+  SIZE_T       count;
+  vector<CacheFrame *> arenas;
+  CacheFrame  *freeframes; // linked through next
+
+  SIZE_T Home(const SIZE_T blocknum) const;
+  void   Grow();
+  void   AddFrames(const SIZE_T num);
+  CacheFrame *Take(const SIZE_T blocknum);
+
+ public:
+  FrameTable(const SIZE_T numframes);
+  FrameTable() { throw GenericException(); }
+  FrameTable(const FrameTable &rhs) { throw GenericException(); }
+  FrameTable & operator=(const FrameTable &rhs) { throw GenericException(); return *this; }
+  ~FrameTable();
+
+  // 0 if the block is not resident
+  CacheFrame *Find(const SIZE_T blocknum) const;
+  // A blank frame for a block that is not resident
+  CacheFrame *Insert(const SIZE_T blocknum);
+  // Forget a frame and make it available for reuse
+  void        Erase(CacheFrame *f);
+  // A blank frame that takes f's place for its block.  f is left
+  // out of the table, marked retired, until it is Released.
+  CacheFrame *Replace(CacheFrame *f);
+  // Make a retired frame available for reuse
+  void        Release(CacheFrame *f);
+
+  SIZE_T GetSize() const { return count; }
+
+  // Visit every frame:  for (pos=0; (f=Next(pos)); ) { ... }
+  // Don't Insert or Erase while doing this.
+  CacheFrame *Next(SIZE_T &pos) const;
+};
+
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef _global
 #define _global
 
+#include <pthread.h>
 
 typedef unsigned char BYTE_T;
 typedef unsigned int SIZE_T;
@@ -29,6 +30,14 @@ const ERROR_T ERROR_INSERT=-16;
 struct GenericException {};
 
 
+// Holds a mutex for the lifetime of the object
+struct MutexHolder {
+  pthread_mutex_t *m;
+  MutexHolder(pthread_mutex_t *mutex) : m(mutex) { pthread_mutex_lock(m); }
+  ~MutexHolder() { pthread_mutex_unlock(m); }
+};
+
+
 // The following two are used to print allocation sanity checks
 // The disk info includes a private allocation bitmap
 // that is modified through advisory functions.  Unfortunately,
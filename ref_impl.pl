@@ -63,6 +63,16 @@ while ($line=<STDIN>) {
       print STDERR "Lookup ($key) found $value\n" if $debug;
       print "OK $value\n";
     }
+  } elsif ($op eq "SCAN" || $op eq "RSCAN") { 
+    ($lo, $hi)=split(/\s+/,$rest);
+    print STDERR "Scanning from $lo to $hi\n" if $debug;
+    print "OK BEGIN SCAN\n";
+    @keys=grep { ($lo eq "-" || $_ ge $lo) && ($hi eq "-" || $_ le $hi) } sort keys %content;
+    @keys=reverse @keys if $op eq "RSCAN";
+    foreach $key (@keys) {
+      print "($key,$content{$key})\n";
+    }
+    print "OK END SCAN\n";
   } elsif ($op eq "DISPLAY") { 
     print STDERR "Displaying content in sorted order\n" if $debug;
     print "OK BEGIN DISPLAY\n";
@@ -1,9 +1,11 @@
 #include <iostream>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <string>
 #include <strstream>
 #include <fstream>
+#include <unistd.h>
 #include "btree.h"
 
 
@@ -11,7 +13,7 @@ using namespace std;
 
 void usage()
 {
-  cerr << "usage: sim filestem cachesize < specfile \n";
+  cerr << "usage: sim [-p lru|clock|2q|arc] [-f dirtyratio,maxage] [-s shards] [-k bytes|u32|u64|var] [-t hotlevels] [-m normal|random|sequential] [-d] [-q fifo|sstf|scan|clook] filestem cachesize < specfile \n";
 }
 
 
@@ -20,13 +22,74 @@ int main(int argc, char *argv[])
 
   // CONFORMS to the interface of ref_impl.pl
 
-  if (argc != 3){
+  CachePolicyType policy=CACHE_POLICY_LRU;
+  SIZE_T numshards=1;
+  int keytype=BTREE_KEY_BYTES;
+  SIZE_T hotlevels=BTREE_HOT_LEVELS;
+  bool flush=false;
+  bool map=false;
+  bool direct=false;
+  DiskSchedule schedule=DISK_SCHEDULE_CLOOK;
+  DiskAccessPattern pattern=DISK_ACCESS_RANDOM;
+  double dirtyratio, maxage;
+  int opt;
+
+  while ((opt=getopt(argc,argv,"p:f:s:k:t:m:dq:"))!=-1) {
+    switch (opt) {
+    case 'p':
+      if (CachePolicy::ParseType(optarg,policy)!=ERROR_NOERROR) {
+	usage();
+	return 1;
+      }
+      break;
+    case 'f':
+      if (sscanf(optarg,"%lf,%lf",&dirtyratio,&maxage)!=2) {
+	usage();
+	return 1;
+      }
+      flush=true;
+      break;
+    case 's':
+      numshards=atoi(optarg);
+      break;
+    case 'k':
+      if (NodeMetadata::ParseKeyType(optarg,keytype)!=ERROR_NOERROR) {
+	usage();
+	return 1;
+      }
+      break;
+    case 't':
+      hotlevels=atoi(optarg);
+      break;
+    case 'm':
+      if (DiskSystem::ParseAccessPattern(optarg,pattern)!=ERROR_NOERROR) {
+	usage();
+	return 1;
+      }
+      map=true;
+      break;
+    case 'd':
+      direct=true;
+      break;
+    case 'q':
+      if (DiskSystem::ParseSchedule(optarg,schedule)!=ERROR_NOERROR) {
+	usage();
+	return 1;
+      }
+      break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+
+  if (argc-optind != 2){
     usage();
     return 1;
   }
 
-  char *filestem=argv[1];
-  SIZE_T cachesize=atoi(argv[2]);
+  char *filestem=argv[optind];
+  SIZE_T cachesize=atoi(argv[optind+1]);
   SIZE_T superblocknum;
 
   FILE *file; 
@@ -38,15 +101,31 @@ int main(int argc, char *argv[])
   // run lots of operations
   // so we need to do this outside the loop
   DiskSystem disk(filestem);
-  BufferCache cache(&disk,cachesize);
+  BufferCache cache(&disk,cachesize,policy,numshards);
   // will be set on init
   BTreeIndex *btree;
 
+  disk.SetSchedule(schedule);
+
+  if (map && (rc=disk.Map(pattern))!=ERROR_NOERROR) {
+    cerr << "Can't map disk due to error "<<rc<<"\n";
+    return -1;
+  }
+
+  if (direct && (rc=disk.EnableDirectIO())!=ERROR_NOERROR) {
+    cerr << "Can't use direct I/O due to error "<<rc<<"\n";
+    return -1;
+  }
 
   if ((rc=cache.Attach())!=ERROR_NOERROR) {
     cerr << "Can't attach cache due to error "<<rc<<"\n";
     return -1;
   }
+
+  if (flush && (rc=cache.StartFlusher(dirtyratio,maxage))!=ERROR_NOERROR) {
+    cerr << "Can't start flusher due to error "<<rc<<"\n";
+    return -1;
+  }
   
   file=stdin;
 
@@ -59,7 +138,8 @@ int main(int argc, char *argv[])
     is >> action >> key >> value;
 
     if (action == "INIT") {
-      btree = new BTreeIndex(atoi(key.c_str()),atoi(value.c_str()),&cache);
+      btree = new BTreeIndex(atoi(key.c_str()),atoi(value.c_str()),&cache,true,keytype);
+      btree->SetHotLevels(hotlevels);
       if ((rc=btree->Attach(0, true))!=ERROR_NOERROR) {
 	cerr << "Can't attach btree with initialization due to error "<<rc<<"\n";
 	cout << "FAIL\n";
@@ -99,11 +179,82 @@ int main(int argc, char *argv[])
 	}
  	cout << endl;
       }
+    } else if (action == "MULTILOOKUP"){
+      // MULTILOOKUP n is followed by n lines with a key each, and
+      // the results are printed as if each had been a LOOKUP
+      int n=atoi(key.c_str());
+      vector<KEY_T> keys;
+      vector<VALUE_T> values;
+      for (int i=0;i<n && fgets(line, sizeof(line), file)!=NULL;i++) {
+	string k;
+	istrstream ks(line,strlen(line));
+	ks >> k;
+	keys.push_back(KEY_T(k.c_str()));
+      }
+      if ((rc=btree->MultiLookup(keys,values))!=ERROR_NOERROR) {
+	for (unsigned int i=0; i<keys.size(); i++) {
+	  cout <<"FAIL"<< endl;
+	}
+	cerr <<"Can't multilookup due to error "<<rc<<endl;
+      } else {
+	for (unsigned int i=0; i<keys.size(); i++) {
+	  if (values[i].length==0) {
+	    cout <<"FAIL"<< endl;
+	    cerr <<"Can't lookup due to error "<<ERROR_NONEXISTENT<<endl;
+	  } else {
+	    cout <<"OK ";
+	    for (unsigned int k=0; k<values[i].length; k++) {
+	      cout << values[i].data[k];
+	    }
+	    cout << endl;
+	  }
+	}
+      }
+    } else if (action == "SCAN" || action == "RSCAN") {
+      // SCAN lo hi lists the pairs with lo <= key <= hi in increasing
+      // order of key, and RSCAN in decreasing order.  A bound of -
+      // leaves that end open.
+      BTreeScan scan;
+      KEY_T scan_key;
+      VALUE_T scan_value;
+      if ((rc=btree->Scan(key=="-" ? KEY_T() : KEY_T(key.c_str()),
+			  value=="-" ? KEY_T() : KEY_T(value.c_str()),
+			  scan,action=="RSCAN"))!=ERROR_NOERROR) {
+	cout <<"FAIL"<<endl;
+	cerr <<"Can't scan due to error "<<rc<<endl;
+      } else {
+	cout <<"OK BEGIN SCAN\n";
+	while ((rc=scan.Next(scan_key,scan_value))==ERROR_NOERROR) {
+	  cout << "(";
+	  for (unsigned int k=0; k<scan_key.length; k++) {
+	    cout << scan_key.data[k];
+	  }
+	  cout << ",";
+	  for (unsigned int k=0; k<scan_value.length; k++) {
+	    cout << scan_value.data[k];
+	  }
+	  cout << ")\n";
+	}
+	scan.Close();
+	if (rc!=ERROR_NONEXISTENT) {
+	  cout <<"FAIL"<<endl;
+	  cerr <<"Can't scan due to error "<<rc<<endl;
+	} else {
+	  cout <<"OK END SCAN\n";
+	}
+      }
     } else if (action == "DISPLAY") {
       // This should always be OK
       cout <<"OK BEGIN DISPLAY\n";
       btree->Display(cout,BTREE_SORTED_KEYVAL);
       cout <<"OK END DISPLAY\n";
+    } else if (action == "CHECKPOINT"){
+      if ((rc=btree->Checkpoint())!=ERROR_NOERROR) {
+	cout <<"FAIL"<<endl;
+	cerr <<"Can't checkpoint due to error "<<rc<<endl;
+      } else {
+	cout <<"OK\n";
+      }
     } else if (action == "DEINIT"){
       if ((rc=btree->Detach(superblocknum))!=ERROR_NOERROR) { 
 	cout << "FAIL"<<endl;
@@ -122,6 +273,26 @@ int main(int argc, char *argv[])
     
   fclose(file);
 
+  if ((rc=cache.StopFlusher())!=ERROR_NOERROR) {
+    cerr << "Flusher stopped due to error "<<rc<<"\n";
+  }
+
+  cerr << "Performance statistics:\n";
+
+  cerr << "policy          = "<<cache.GetPolicyName()<<endl;
+  cerr << "numreads        = "<<cache.GetNumReads()<<endl;
+  cerr << "numdiskreads    = "<<cache.GetNumDiskReads()<<endl;
+  cerr << "numwrites       = "<<cache.GetNumWrites()<<endl;
+  cerr << "numdiskwrites   = "<<cache.GetNumDiskWrites()<<endl;
+  cerr << "numwriterequests= "<<cache.GetNumDiskWriteRequests()<<endl;
+  cerr << "numprefetches   = "<<cache.GetNumPrefetches()<<endl;
+  cerr << "numprefetchhits = "<<cache.GetNumPrefetchHits()<<endl;
+  cerr << "numbgwrites     = "<<cache.GetNumBackgroundWrites()<<endl;
+  cerr << "hit ratio       = "<<(cache.GetNumHits()+cache.GetNumMisses() ? (double)cache.GetNumHits()/(double)(cache.GetNumHits()+cache.GetNumMisses()) : 0)<<endl;
+  cerr << endl;
+
+  cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+
   return 0;
 
 }